@@ -0,0 +1,252 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Binary matrix exchange format, written by common/binary_matrix.jl. A file is
+// a 128 byte header followed by the pointer, index and value arrays, each
+// starting on a 64 byte boundary, so a driver can mmap the file and hand the
+// arrays to Eigen, MKL or TACO in place instead of parsing MatrixMarket text.
+// Pointers and indices are zero-based and share one width, 32 or 64 bits.
+// Dense operands use the same container with column-major values only.
+
+enum binary_layout_t : uint32_t {
+  BINARY_CSR = 0,
+  BINARY_CSC = 1,
+  BINARY_DENSE = 2,
+};
+
+struct binary_matrix_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t layout;
+  uint32_t index_bits;
+  uint32_t value_bits;
+  uint64_t rows;
+  uint64_t cols;
+  uint64_t nnz;
+  uint64_t pos_offset;
+  uint64_t idx_offset;
+  uint64_t val_offset;
+  uint8_t reserved[56];
+};
+static_assert(sizeof(binary_matrix_header_t) == 128, "binary matrix header must be 128 bytes");
+
+constexpr char BINARY_MATRIX_MAGIC[8] = {'F', 'B', 'S', 'P', 'M', 'A', 'T', '\0'};
+constexpr uint32_t BINARY_MATRIX_VERSION = 1;
+constexpr uint64_t BINARY_MATRIX_ALIGNMENT = 64;
+
+inline bool binary_matrix_exists(const std::string &path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0;
+}
+
+// Read-only view of a binary matrix file. The mapping is private, so the
+// arrays can be passed to libraries that take non-const pointers without any
+// write ever reaching the file.
+class binary_matrix_t {
+public:
+  binary_matrix_header_t header;
+
+  explicit binary_matrix_t(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(binary_matrix_header_t)) {
+      close(fd);
+      throw std::runtime_error("Truncated binary matrix " + path);
+    }
+    length = info.st_size;
+    base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+      base = nullptr;
+      throw std::runtime_error("Failed to mmap " + path);
+    }
+    std::memcpy(&header, base, sizeof(header));
+    validate(path);
+  }
+
+  binary_matrix_t(const binary_matrix_t &) = delete;
+  binary_matrix_t &operator=(const binary_matrix_t &) = delete;
+
+  ~binary_matrix_t() {
+    if (base) munmap(base, length);
+  }
+
+  size_t bytes() const { return length; }
+
+  uint64_t outer() const {
+    return header.layout == BINARY_CSR ? header.rows : header.cols;
+  }
+
+  template <typename Int>
+  Int *pos() const { return indices<Int>(header.pos_offset); }
+
+  template <typename Int>
+  Int *idx() const { return indices<Int>(header.idx_offset); }
+
+  double *val() const {
+    return reinterpret_cast<double *>((char *)base + header.val_offset);
+  }
+
+  // The pointer or index array as Int. When the file was written with another
+  // width the values are converted into `storage` and that copy is returned.
+  template <typename Int>
+  Int *pos_as(std::vector<Int> &storage) const {
+    return convert<Int>(header.pos_offset, outer() + 1, storage);
+  }
+
+  template <typename Int>
+  Int *idx_as(std::vector<Int> &storage) const {
+    return convert<Int>(header.idx_offset, header.nnz, storage);
+  }
+
+private:
+  void *base = nullptr;
+  size_t length = 0;
+
+  template <typename Int>
+  Int *indices(uint64_t offset) const {
+    if (header.index_bits != 8 * sizeof(Int)) {
+      throw std::runtime_error("Binary matrix has " + std::to_string(header.index_bits) + "-bit indices");
+    }
+    return reinterpret_cast<Int *>((char *)base + offset);
+  }
+
+  template <typename Int>
+  Int *convert(uint64_t offset, uint64_t count, std::vector<Int> &storage) const {
+    if (header.index_bits == 8 * sizeof(Int)) {
+      return indices<Int>(offset);
+    }
+    storage.resize(count);
+    for (uint64_t p = 0; p < count; p++) {
+      uint64_t value = header.index_bits == 32 ? ((uint32_t *)((char *)base + offset))[p]
+                                               : ((uint64_t *)((char *)base + offset))[p];
+      if (value > (uint64_t)std::numeric_limits<Int>::max()) {
+        throw std::runtime_error("Binary matrix indices do not fit in " + std::to_string(8 * sizeof(Int)) + " bits");
+      }
+      storage[p] = (Int)value;
+    }
+    return storage.data();
+  }
+
+  void validate(const std::string &path) const {
+    if (std::memcmp(header.magic, BINARY_MATRIX_MAGIC, sizeof(BINARY_MATRIX_MAGIC)) != 0) {
+      throw std::runtime_error("Not a binary matrix: " + path);
+    }
+    if (header.version != BINARY_MATRIX_VERSION) {
+      throw std::runtime_error("Unsupported binary matrix version in " + path);
+    }
+    if (header.layout > BINARY_DENSE || (header.index_bits != 32 && header.index_bits != 64) || header.value_bits != 64) {
+      throw std::runtime_error("Unsupported binary matrix layout in " + path);
+    }
+    uint64_t index_bytes = header.index_bits / 8;
+    bool fits = header.val_offset + header.nnz * sizeof(double) <= length;
+    if (header.layout != BINARY_DENSE) {
+      fits = fits && header.pos_offset + (outer() + 1) * index_bytes <= length;
+      fits = fits && header.idx_offset + header.nnz * index_bytes <= length;
+    }
+    if (!fits) {
+      throw std::runtime_error("Truncated binary matrix " + path);
+    }
+  }
+};
+
+inline uint64_t binary_matrix_align(uint64_t offset) {
+  return (offset + BINARY_MATRIX_ALIGNMENT - 1) / BINARY_MATRIX_ALIGNMENT * BINARY_MATRIX_ALIGNMENT;
+}
+
+// Writes a binary matrix array by array, so that producers can stream each
+// array in blocks: pad_to() the offset of the pos, idx and val arrays in turn
+// and write() each array's contents.
+class binary_matrix_writer_t {
+public:
+  binary_matrix_header_t header = {};
+
+  binary_matrix_writer_t(const std::string &path, binary_layout_t layout, uint64_t rows, uint64_t cols,
+                         uint64_t nnz, uint32_t index_bits)
+      : path(path), file(path, std::ios::binary) {
+    std::memcpy(header.magic, BINARY_MATRIX_MAGIC, sizeof(BINARY_MATRIX_MAGIC));
+    header.version = BINARY_MATRIX_VERSION;
+    header.layout = layout;
+    header.index_bits = index_bits;
+    header.value_bits = 64;
+    header.rows = rows;
+    header.cols = cols;
+    header.nnz = nnz;
+    uint64_t outer = layout == BINARY_CSR ? rows : cols;
+    uint64_t offset = sizeof(header);
+    if (layout != BINARY_DENSE) {
+      header.pos_offset = binary_matrix_align(offset);
+      header.idx_offset = binary_matrix_align(header.pos_offset + (outer + 1) * index_bits / 8);
+      offset = header.idx_offset + nnz * index_bits / 8;
+    }
+    header.val_offset = binary_matrix_align(offset);
+    if (!file) {
+      throw std::runtime_error("Failed to open " + path);
+    }
+    file.write((const char *)&header, sizeof(header));
+    written = sizeof(header);
+  }
+
+  void pad_to(uint64_t offset) {
+    static const char zeros[BINARY_MATRIX_ALIGNMENT] = {};
+    file.write(zeros, offset - written);
+    written = offset;
+  }
+
+  void write(const void *data, uint64_t bytes) {
+    file.write((const char *)data, bytes);
+    written += bytes;
+    if (!file) {
+      throw std::runtime_error("Failed to write " + path);
+    }
+  }
+
+  // Write at an absolute offset, for writers that fill the sections out of
+  // order instead of through pad_to and write; gaps read back as zeros.
+  void write_at(uint64_t offset, const void *data, uint64_t bytes) {
+    file.seekp(offset);
+    file.write((const char *)data, bytes);
+    if (!file) {
+      throw std::runtime_error("Failed to write " + path);
+    }
+  }
+
+private:
+  std::string path;
+  std::ofstream file;
+  uint64_t written = 0;
+};
+
+// Write a compressed (CSR or CSC) or dense matrix. For dense layouts pos and
+// idx are ignored and nnz is rows * cols.
+template <typename Int>
+void write_binary_matrix(const std::string &path, binary_layout_t layout, uint64_t rows, uint64_t cols,
+                         uint64_t nnz, const Int *pos, const Int *idx, const double *val) {
+  binary_matrix_writer_t writer(path, layout, rows, cols, nnz, 8 * sizeof(Int));
+  if (layout != BINARY_DENSE) {
+    writer.pad_to(writer.header.pos_offset);
+    writer.write(pos, ((layout == BINARY_CSR ? rows : cols) + 1) * sizeof(Int));
+    writer.pad_to(writer.header.idx_offset);
+    writer.write(idx, nnz * sizeof(Int));
+  }
+  writer.pad_to(writer.header.val_offset);
+  writer.write(val, nnz * sizeof(double));
+}
+
+inline void write_binary_vector(const std::string &path, uint64_t n, const double *val) {
+  write_binary_matrix<int32_t>(path, BINARY_DENSE, n, 1, n, nullptr, nullptr, val);
+}
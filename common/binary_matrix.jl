@@ -0,0 +1,68 @@
+using SparseArrays
+
+# Writer for the binary matrix exchange format read by common/binary_matrix.hpp:
+# a 128 byte header followed by 64 byte aligned pointer, index and value arrays.
+# Indices are zero-based, 32 or 64 bits wide.
+const BINARY_MATRIX_MAGIC = codeunits("FBSPMAT\0")
+const BINARY_MATRIX_VERSION = UInt32(1)
+const BINARY_CSR = UInt32(0)
+const BINARY_CSC = UInt32(1)
+const BINARY_DENSE = UInt32(2)
+
+binary_index_type(A) = max(size(A)..., nnz(A)) < typemax(Int32) ? Int32 : Int64
+
+function write_binary_matrix(path, A::SparseMatrixCSC; layout=:csc, index_type=binary_index_type(A))
+    (m, n) = size(A)
+    if layout == :csr
+        A = SparseMatrixCSC(permutedims(A))
+    end
+    pos = index_type.(A.colptr .- 1)
+    idx = index_type.(A.rowval .- 1)
+    val = Vector{Float64}(A.nzval)
+    write_binary_arrays(path, layout == :csr ? BINARY_CSR : BINARY_CSC, m, n, pos, idx, val)
+end
+
+function write_binary_vector(path, x::AbstractVector)
+    write_binary_arrays(path, BINARY_DENSE, length(x), 1, Int32[], Int32[], Vector{Float64}(x))
+end
+
+# Values of a dense binary vector, such as the outputs drivers fetch.
+function read_binary_vector(path)
+    open(path) do io
+        read(io, 8) == BINARY_MATRIX_MAGIC || error("$path is not a binary matrix")
+        skip(io, 4)
+        read(io, UInt32) == BINARY_DENSE || error("$path is not dense")
+        skip(io, 24)
+        nnz = read(io, UInt64)
+        skip(io, 16)
+        seek(io, read(io, UInt64))
+        return read!(io, Vector{Float64}(undef, nnz))
+    end
+end
+
+function write_binary_arrays(path, layout, m, n, pos::Vector{Ti}, idx::Vector{Ti}, val) where {Ti}
+    align(offset) = cld(offset, 64) * 64
+    pos_offset = idx_offset = 0
+    offset = 128
+    if layout != BINARY_DENSE
+        pos_offset = align(offset)
+        idx_offset = align(pos_offset + sizeof(pos))
+        offset = idx_offset + sizeof(idx)
+    end
+    val_offset = align(offset)
+    open(path, "w") do io
+        pad(at) = write(io, zeros(UInt8, at - position(io)))
+        write(io, BINARY_MATRIX_MAGIC)
+        write(io, BINARY_MATRIX_VERSION, layout, UInt32(8 * sizeof(Ti)), UInt32(64))
+        write(io, UInt64[m, n, length(val), pos_offset, idx_offset, val_offset])
+        pad(128)
+        if layout != BINARY_DENSE
+            pad(pos_offset)
+            write(io, pos)
+            pad(idx_offset)
+            write(io, idx)
+        end
+        pad(val_offset)
+        write(io, val)
+    end
+end
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "index.hpp"
+
+// A CSR matrix with sorted column indices, borrowed from its owner.
+struct csr_view_t {
+  sparse_index_t rows = 0;
+  sparse_index_t cols = 0;
+  const sparse_index_t *pos = nullptr;
+  const sparse_index_t *idx = nullptr;
+  const double *val = nullptr;
+};
+
+// View a compressed row-major Eigen matrix or Map with sparse_index_t indices.
+template <typename Matrix>
+csr_view_t csr_view(const Matrix &M) {
+  return {(sparse_index_t)M.rows(), (sparse_index_t)M.cols(), M.outerIndexPtr(), M.innerIndexPtr(), M.valuePtr()};
+}
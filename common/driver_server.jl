@@ -0,0 +1,69 @@
+using JSON
+
+# Long-lived C++ drivers started with `-- --server` (see common/server.hpp).
+# Servers are keyed by their full command, environment included, so each
+# driver configuration is spawned once per sweep and keeps its operands and
+# compiled kernels resident between matrices.
+const driver_servers = Dict{Cmd, Base.Process}()
+
+# Thread counts every new server sweeps, as a comma separated list, and
+# whether it pins thread t to the t-th CPU the process may run on.
+const driver_threads = Ref("1")
+const driver_pin = Ref(false)
+
+# Whether new servers read hardware counters around each call (see
+# common/perf_counters.hpp).
+const driver_counters = Ref(false)
+
+# How new servers sample each run (see common/timing.hpp): untimed warmup
+# calls, the minimum seconds and samples, and whether to flush the last level
+# cache before every timed call.
+const driver_warmup = Ref(0)
+const driver_min_time = Ref(0.2)
+const driver_min_reps = Ref(1)
+const driver_flush = Ref(false)
+
+# Whether new SpMV and SpGEMM servers check each run's result against a
+# reference themselves (see common/verify.hpp), and the largest error they
+# accept relative to the largest reference value. The helpers then skip
+# fetching the result, which they return as nothing.
+const driver_verify = Ref(false)
+const driver_tolerance = Ref(1e-9)
+
+const counter_fields = ["cycles", "instructions", "ipc", "llc_misses", "dtlb_misses",
+    "dram_read_bytes", "dram_write_bytes", "bandwidth", "llc_miss_bandwidth", "counters_error"]
+
+function driver_server(cmd::Cmd)
+    proc = get(driver_servers, cmd, nothing)
+    if proc === nothing || !process_running(proc)
+        proc = open(cmd, "r+")
+        driver_servers[cmd] = proc
+        driver_request(proc, "threads", driver_threads[], (driver_pin[] ? ("pin",) : ())...)
+        driver_request(proc, "counters", driver_counters[] ? "on" : "off")
+        driver_request(proc, "timing", driver_warmup[], driver_min_time[], driver_min_reps[], driver_flush[] ? "flush" : "noflush")
+        driver_verify[] && driver_request(proc, "verify", "on", driver_tolerance[])
+    end
+    return proc
+end
+
+function driver_request(proc, command, args...)
+    println(proc, join([command, map(arg -> repr(string(arg)), args)...], " "))
+    flush(proc)
+    line = readline(proc)
+    isempty(line) && error("driver server exited during $command")
+    reply = JSON.parse(line)
+    reply["status"] == "ok" || error("driver server $command failed: $(reply["message"])")
+    return reply
+end
+
+# The hardware counter fields of a run, or nothing when counters were off.
+function counter_measurements(measurements)
+    haskey(measurements, "counted_calls") || return nothing
+    return Dict(field => measurements[field] for field in counter_fields)
+end
+
+# The checksum of a run's result and, when verification was on, how it
+# compared with the reference.
+function verify_measurements(measurements)
+    return (;checksum=measurements["checksum"], verification=get(measurements, "verification", nothing))
+end
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <Eigen/Sparse>
+#include <unsupported/Eigen/SparseExtra>
+#include "binary_matrix.hpp"
+#include "index.hpp"
+#include "market_matrix.hpp"
+#include "memory.hpp"
+#include "rhs_block.hpp"
+
+// Index and value bytes of a compressed Eigen sparse matrix or Map.
+template <typename Matrix>
+json eigen_structure_bytes(const Matrix &M) {
+  size_t indices = M.outerSize() + 1 + M.nonZeros();
+  return structure_bytes(indices * sizeof(typename Matrix::StorageIndex), M.nonZeros() * sizeof(double));
+}
+
+// A sparse operand of the Eigen-based drivers, always used through a Map.
+// <dir>/<name>.bin is preferred when present and is viewed in place when its
+// layout and index width match the matrix type; any other binary file is
+// converted, and without one <dir>/<name>.ttx is parsed by read_market_matrix.
+template <int Options>
+struct eigen_operand_t {
+  using matrix_t = Eigen::SparseMatrix<double, Options, sparse_index_t>;
+  using map_t = Eigen::Map<matrix_t>;
+  using index_t = typename matrix_t::StorageIndex;
+
+  matrix_t owned;
+  std::unique_ptr<binary_matrix_t> file;
+  std::unique_ptr<map_t> view;
+
+  map_t &operator*() const { return *view; }
+  map_t *operator->() const { return view.get(); }
+
+  void load(const std::string &dir, const std::string &name) {
+    view.reset();
+    file.reset();
+    owned = matrix_t();
+
+    std::string bin = dir + "/" + name + ".bin";
+    if (binary_matrix_exists(bin)) {
+      file = std::make_unique<binary_matrix_t>(bin);
+      const binary_matrix_header_t &header = file->header;
+      binary_layout_t layout = (Options & Eigen::RowMajor) ? BINARY_CSR : BINARY_CSC;
+      if (header.layout == BINARY_DENSE) {
+        throw std::runtime_error(bin + " is not a sparse matrix");
+      }
+      if (header.layout == layout && header.index_bits == 8 * sizeof(index_t)) {
+        view = std::make_unique<map_t>(header.rows, header.cols, header.nnz,
+                                       file->pos<index_t>(), file->idx<index_t>(), file->val());
+        return;
+      }
+      std::vector<index_t> pos_storage, idx_storage;
+      index_t *pos = file->pos_as<index_t>(pos_storage);
+      index_t *idx = file->idx_as<index_t>(idx_storage);
+      if (header.layout == BINARY_CSR) {
+        owned = Eigen::Map<Eigen::SparseMatrix<double, Eigen::RowMajor, index_t>>(
+            header.rows, header.cols, header.nnz, pos, idx, file->val());
+      } else {
+        owned = Eigen::Map<Eigen::SparseMatrix<double, Eigen::ColMajor, index_t>>(
+            header.rows, header.cols, header.nnz, pos, idx, file->val());
+      }
+      file.reset();
+    } else {
+      binary_layout_t layout = (Options & Eigen::RowMajor) ? BINARY_CSR : BINARY_CSC;
+      market_matrix_t<index_t> market = read_market_matrix<index_t>(dir + "/" + name + ".ttx", layout);
+      owned = map_t(market.rows, market.cols, market.nnz(), market.pos.data(), market.idx.data(), market.val.data());
+    }
+    view_owned();
+  }
+
+  // Hold a copy of `M` instead of the loaded matrix.
+  template <typename Matrix>
+  void assign(const Matrix &M) {
+    matrix_t copy = M;
+    view.reset();
+    file.reset();
+    owned = std::move(copy);
+    view_owned();
+  }
+
+  // Keep only the upper triangle, for kernels that read half of a symmetric
+  // matrix and mirror it.
+  void keep_upper() {
+    assign(view->template triangularView<Eigen::Upper>());
+  }
+
+private:
+  void view_owned() {
+    owned.makeCompressed();
+    view = std::make_unique<map_t>(owned.rows(), owned.cols(), owned.nonZeros(),
+                                   owned.outerIndexPtr(), owned.innerIndexPtr(), owned.valuePtr());
+  }
+};
+
+// A dense vector from <dir>/<name>.bin, or from <dir>/<name>.ttx written as an
+// n x 1 coordinate matrix.
+inline Eigen::VectorXd load_eigen_vector(const std::string &dir, const std::string &name) {
+  std::string bin = dir + "/" + name + ".bin";
+  if (binary_matrix_exists(bin)) {
+    binary_matrix_t file(bin);
+    if (file.header.layout != BINARY_DENSE) {
+      throw std::runtime_error(bin + " is not a dense vector");
+    }
+    return Eigen::Map<Eigen::VectorXd>(file.val(), file.header.nnz);
+  }
+  std::string ttx = dir + "/" + name + ".ttx";
+  market_matrix_t<sparse_index_t> market = read_market_matrix<sparse_index_t>(ttx, BINARY_CSC);
+  if (market.cols != 1) {
+    throw std::runtime_error(ttx + " is not a vector");
+  }
+  Eigen::VectorXd x = Eigen::VectorXd::Zero(market.rows);
+  for (sparse_index_t p = 0; p < market.pos[1]; p++) x[market.idx[p]] = market.val[p];
+  return x;
+}
+
+// A row-major block of right-hand sides or results of the SpMM modes.
+using eigen_block_t = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+// The n x k block X of the SpMM modes, see load_rhs_block.
+inline eigen_block_t load_eigen_block(const std::string &dir, const Eigen::VectorXd &x, int k) {
+  std::vector<double> X = load_rhs_block(dir, x.data(), x.size(), k);
+  return Eigen::Map<eigen_block_t>(X.data(), x.size(), k);
+}
+
+// Write a dense block as <path>, a MatrixMarket coordinate file.
+template <typename Block>
+void save_eigen_block(const Block &Y, const std::string &path) {
+  Eigen::MatrixXd dense = Y;
+  Eigen::SparseMatrix<double> sparse = dense.sparseView();
+  Eigen::saveMarket(sparse, path.c_str());
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+// Width of sparse pointers and indices in the Eigen, MKL and native drivers,
+// chosen at build time: `make INDEX64=1` defines INDEX64 and links ILP64 MKL,
+// for matrices with more than 2^31 nonzeros. The default 32-bit build moves
+// half the index bytes and is the faster choice whenever it fits. TACO always
+// uses 32-bit indices. The 64-bit type is spelled as ILP64 MKL_INT (long long)
+// so Eigen and MKL share index arrays without conversion.
+#ifdef INDEX64
+using sparse_index_t = long long;
+#else
+using sparse_index_t = int32_t;
+#endif
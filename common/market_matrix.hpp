@@ -0,0 +1,389 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "binary_matrix.hpp"
+
+// Parallel reader for the MatrixMarket (.mtx) and TensorMarket (.ttx) files
+// the drivers take when no binary operand is present. The file is mapped and
+// split into chunks at line boundaries; each thread counts the lines of its
+// chunks with memchr, then parses them in place with std::from_chars, whose
+// Eisel-Lemire fast path needs no locale or stream state. The entries are
+// scattered straight into CSR or CSC with a counting sort over the outer
+// dimension, and each row or column is sorted on its own, by index and then
+// by line, so that duplicates are summed in the same order on every run.
+//
+// Coordinate and general array files are read, with real, integer or pattern
+// values. As in Eigen::loadMarket, pattern entries read as 1, symmetric and
+// hermitian files are mirrored, skew-symmetric ones mirrored negated, and
+// duplicate entries are summed. An order-1 tensor reads as an n x 1 matrix.
+
+template <typename Int>
+struct market_matrix_t {
+  uint64_t rows = 0;
+  uint64_t cols = 0;
+  std::vector<Int> pos;
+  std::vector<Int> idx;
+  std::vector<double> val;
+
+  uint64_t nnz() const { return idx.size(); }
+};
+
+namespace market_detail {
+
+struct header_t {
+  bool coordinate = true;
+  bool pattern = false;
+  bool symmetric = false;
+  bool skew = false;
+  int order = 2;
+  uint64_t rows = 0;
+  uint64_t cols = 1;
+  uint64_t entries = 0;
+};
+
+inline bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+// The first non-blank character of [p, end), or the end of the line.
+inline const char *skip_blanks(const char *p, const char *end) {
+  while (p < end && is_blank(*p)) p++;
+  return p;
+}
+
+inline const char *next_line(const char *p, const char *end) {
+  const char *newline = (const char *)memchr(p, '\n', end - p);
+  return newline ? newline + 1 : end;
+}
+
+// Whether the line at p holds data, rather than nothing or a comment.
+inline bool has_entry(const char *p, const char *end) {
+  p = skip_blanks(p, end);
+  return p < end && *p != '\n' && *p != '%';
+}
+
+inline const char *parse_index(const char *p, const char *end, uint64_t &value) {
+  p = skip_blanks(p, end);
+  auto [next, error] = std::from_chars(p, end, value);
+  return error == std::errc() ? next : nullptr;
+}
+
+inline const char *parse_value(const char *p, const char *end, double &value) {
+  p = skip_blanks(p, end);
+  if (p < end && *p == '+') p++;
+  auto [next, error] = std::from_chars(p, end, value);
+  return error == std::errc() ? next : nullptr;
+}
+
+inline std::string lower(std::string word) {
+  for (char &c : word) c = std::tolower((unsigned char)c);
+  return word;
+}
+
+// Parse the banner, comments and size line, and return where the entries start.
+inline const char *parse_header(const char *p, const char *end, header_t &header, const std::string &path) {
+  const char *line_end = next_line(p, end);
+  std::istringstream banner(std::string(p, line_end));
+  std::string magic, object, format, field, symmetry;
+  banner >> magic >> object >> format >> field >> symmetry;
+  object = lower(object);
+  format = lower(format);
+  field = lower(field);
+  symmetry = lower(symmetry);
+  if (magic != "%%MatrixMarket" || (object != "matrix" && object != "tensor")) {
+    throw std::runtime_error("Not a MatrixMarket file: " + path);
+  }
+  if ((format != "coordinate" && format != "array") ||
+      (field != "real" && field != "double" && field != "integer" && field != "pattern") ||
+      (symmetry != "general" && symmetry != "symmetric" && symmetry != "skew-symmetric" && symmetry != "hermitian")) {
+    throw std::runtime_error("Unsupported MatrixMarket header in " + path);
+  }
+  header.coordinate = format == "coordinate";
+  header.pattern = field == "pattern";
+  header.symmetric = symmetry != "general";
+  header.skew = symmetry == "skew-symmetric";
+  if (!header.coordinate && (header.pattern || header.symmetric)) {
+    throw std::runtime_error("Only general array files are supported: " + path);
+  }
+
+  p = line_end;
+  while (p < end && !has_entry(p, end)) p = next_line(p, end);
+  line_end = next_line(p, end);
+  std::vector<uint64_t> sizes;
+  uint64_t size;
+  for (const char *q; (q = parse_index(p, line_end, size)); p = q) sizes.push_back(size);
+  if (header.coordinate) {
+    if (sizes.empty()) sizes.push_back(0);
+    header.entries = sizes.back();
+    sizes.pop_back();
+  }
+  if (sizes.size() != 1 && sizes.size() != 2) {
+    throw std::runtime_error("Only vectors and matrices can be read from " + path);
+  }
+  header.order = sizes.size();
+  header.rows = sizes[0];
+  header.cols = header.order == 2 ? sizes[1] : 1;
+  if (!header.coordinate) header.entries = header.rows * header.cols;
+  if (header.symmetric && header.rows != header.cols) {
+    throw std::runtime_error("Symmetric matrix is not square in " + path);
+  }
+  return line_end;
+}
+
+// A read-only mapping of a whole file.
+class mapped_file_t {
+public:
+  const char *data = nullptr;
+  size_t length = 0;
+
+  explicit mapped_file_t(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+      close(fd);
+      throw std::runtime_error("Empty MatrixMarket file " + path);
+    }
+    length = info.st_size;
+    void *base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+      throw std::runtime_error("Failed to mmap " + path);
+    }
+    madvise(base, length, MADV_SEQUENTIAL);
+    data = (const char *)base;
+  }
+
+  mapped_file_t(const mapped_file_t &) = delete;
+  mapped_file_t &operator=(const mapped_file_t &) = delete;
+
+  ~mapped_file_t() {
+    munmap((void *)data, length);
+  }
+};
+
+// Running sums of a[0, n) in place. Every thread sums one contiguous block,
+// the block totals are scanned, and every block then adds the total before it.
+template <typename Int>
+void prefix_sum(Int *a, uint64_t n) {
+  int threads = 1;
+#ifdef _OPENMP
+  threads = omp_get_max_threads();
+#endif
+  std::vector<Int> totals(threads + 1, 0);
+  #pragma omp parallel num_threads(threads)
+  {
+#ifdef _OPENMP
+    int t = omp_get_thread_num();
+    int team = omp_get_num_threads();
+#else
+    int t = 0;
+    int team = 1;
+#endif
+    uint64_t begin = n * t / team, stop = n * (t + 1) / team;
+    for (uint64_t i = begin + 1; i < stop; i++) a[i] += a[i - 1];
+    totals[t + 1] = stop > begin ? a[stop - 1] : 0;
+    #pragma omp barrier
+    Int before = 0;
+    for (int u = 0; u < t; u++) before += totals[u + 1];
+    for (uint64_t i = begin; i < stop; i++) a[i] += before;
+  }
+}
+
+} // namespace market_detail
+
+// Read <path> into CSR (layout BINARY_CSR) or CSC (BINARY_CSC) arrays with
+// zero-based Int indices and sorted inner indices.
+template <typename Int>
+market_matrix_t<Int> read_market_matrix(const std::string &path, binary_layout_t layout) {
+  using namespace market_detail;
+  if (layout != BINARY_CSR && layout != BINARY_CSC) {
+    throw std::invalid_argument("MatrixMarket files are read as CSR or CSC");
+  }
+  mapped_file_t file(path);
+  const char *end = file.data + file.length;
+  header_t header;
+  const char *data = parse_header(file.data, end, header, path);
+  const uint64_t limit = std::numeric_limits<Int>::max();
+  if (header.rows > limit || header.cols > limit || header.entries > limit) {
+    throw std::runtime_error(path + " does not fit in " + std::to_string(8 * sizeof(Int)) + "-bit indices");
+  }
+
+  // Chunks of about equal bytes, moved forward to the next line start
+  int threads = 1;
+#ifdef _OPENMP
+  threads = omp_get_max_threads();
+#endif
+  size_t bytes = end - data;
+  size_t chunks = std::max<size_t>(1, std::min<size_t>(4 * threads, bytes >> 16));
+  std::vector<const char *> starts(chunks + 1, end);
+  starts[0] = data;
+  for (size_t c = 1; c < chunks; c++) {
+    starts[c] = std::max(starts[c - 1], next_line(data + bytes * c / chunks - 1, end));
+  }
+  std::vector<uint64_t> offsets(chunks + 1, 0);
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (size_t c = 0; c < chunks; c++) {
+    uint64_t lines = 0;
+    for (const char *p = starts[c]; p < starts[c + 1]; p = next_line(p, starts[c + 1])) {
+      lines += has_entry(p, starts[c + 1]);
+    }
+    offsets[c + 1] = lines;
+  }
+  for (size_t c = 0; c < chunks; c++) offsets[c + 1] += offsets[c];
+  if (offsets[chunks] != header.entries) {
+    throw std::runtime_error(path + " holds " + std::to_string(offsets[chunks]) + " entries, not " +
+                             std::to_string(header.entries));
+  }
+
+  // Parse every chunk into zero-based triplets
+  uint64_t entries = header.entries;
+  std::vector<Int> I(entries), J(entries);
+  std::vector<double> V(entries, 1.0);
+  bool malformed = false;
+  #pragma omp parallel for schedule(dynamic, 1) reduction(||:malformed)
+  for (size_t c = 0; c < chunks; c++) {
+    uint64_t e = offsets[c];
+    for (const char *p = starts[c], *line_end; p < starts[c + 1] && !malformed; p = line_end) {
+      line_end = next_line(p, starts[c + 1]);
+      if (!has_entry(p, line_end)) continue;
+      uint64_t i, j = 1;
+      const char *q = p;
+      if (header.coordinate) {
+        q = parse_index(q, line_end, i);
+        if (q && header.order == 2) q = parse_index(q, line_end, j);
+      } else {
+        i = e % header.rows + 1;
+        j = e / header.rows + 1;
+      }
+      if (q && !header.pattern) q = parse_value(q, line_end, V[e]);
+      if (!q || i < 1 || i > header.rows || j < 1 || j > header.cols) {
+        malformed = true;
+        break;
+      }
+      I[e] = i - 1;
+      J[e] = j - 1;
+      e++;
+    }
+  }
+  if (malformed) {
+    throw std::runtime_error("Malformed entry in " + path);
+  }
+
+  // Counting sort by outer index, mirrored entries included
+  market_matrix_t<Int> matrix;
+  matrix.rows = header.rows;
+  matrix.cols = header.cols;
+  const std::vector<Int> &outer = layout == BINARY_CSR ? I : J;
+  const std::vector<Int> &inner = layout == BINARY_CSR ? J : I;
+  uint64_t outer_size = layout == BINARY_CSR ? header.rows : header.cols;
+  matrix.pos.assign(outer_size + 1, 0);
+  Int *count = matrix.pos.data() + 1;
+  uint64_t mirrored = 0;
+  #pragma omp parallel for schedule(static) reduction(+:mirrored)
+  for (uint64_t e = 0; e < entries; e++) {
+    __atomic_fetch_add(&count[outer[e]], 1, __ATOMIC_RELAXED);
+    if (header.symmetric && I[e] != J[e]) {
+      __atomic_fetch_add(&count[inner[e]], 1, __ATOMIC_RELAXED);
+      mirrored++;
+    }
+  }
+  if (entries + mirrored > limit) {
+    throw std::runtime_error(path + " does not fit in " + std::to_string(8 * sizeof(Int)) + "-bit indices");
+  }
+  prefix_sum(matrix.pos.data() + 1, outer_size);
+  matrix.idx.resize(entries + mirrored);
+  matrix.val.resize(entries + mirrored);
+  // The slots within a row depend on thread timing, so every entry carries
+  // its line number and rows are sorted on it after the index; duplicates are
+  // then summed in file order whatever the thread count.
+  std::vector<uint64_t> line(entries + mirrored);
+  std::vector<Int> cursor(matrix.pos.begin(), matrix.pos.end() - 1);
+  double sign = header.skew ? -1 : 1;
+  #pragma omp parallel for schedule(static)
+  for (uint64_t e = 0; e < entries; e++) {
+    Int slot = __atomic_fetch_add(&cursor[outer[e]], 1, __ATOMIC_RELAXED);
+    matrix.idx[slot] = inner[e];
+    matrix.val[slot] = V[e];
+    line[slot] = e;
+    if (header.symmetric && I[e] != J[e]) {
+      slot = __atomic_fetch_add(&cursor[inner[e]], 1, __ATOMIC_RELAXED);
+      matrix.idx[slot] = outer[e];
+      matrix.val[slot] = sign * V[e];
+      line[slot] = e;
+    }
+  }
+  I = std::vector<Int>();
+  J = std::vector<Int>();
+  V = std::vector<double>();
+
+  // Sort each row or column and sum its duplicates into its first entries
+  std::vector<Int> &length = cursor;
+  bool duplicates = false;
+  #pragma omp parallel reduction(||:duplicates)
+  {
+    std::vector<std::tuple<Int, uint64_t, double>> sorted;
+    #pragma omp for schedule(dynamic, 256)
+    for (uint64_t o = 0; o < outer_size; o++) {
+      Int begin = matrix.pos[o], stop = matrix.pos[o + 1];
+      bool in_order = true;
+      for (Int p = begin + 1; p < stop && in_order; p++) {
+        in_order = std::make_pair(matrix.idx[p - 1], line[p - 1]) < std::make_pair(matrix.idx[p], line[p]);
+      }
+      if (!in_order) {
+        sorted.clear();
+        for (Int p = begin; p < stop; p++) sorted.emplace_back(matrix.idx[p], line[p], matrix.val[p]);
+        std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+          return std::tie(std::get<0>(a), std::get<1>(a)) < std::tie(std::get<0>(b), std::get<1>(b));
+        });
+        for (Int p = begin; p < stop; p++) std::tie(matrix.idx[p], std::ignore, matrix.val[p]) = sorted[p - begin];
+      }
+      Int kept = begin;
+      for (Int p = begin; p < stop; p++) {
+        if (kept > begin && matrix.idx[kept - 1] == matrix.idx[p]) {
+          matrix.val[kept - 1] += matrix.val[p];
+        } else {
+          matrix.idx[kept] = matrix.idx[p];
+          matrix.val[kept] = matrix.val[p];
+          kept++;
+        }
+      }
+      length[o] = kept - begin;
+      duplicates = duplicates || kept < stop;
+    }
+  }
+  line = std::vector<uint64_t>();
+  if (duplicates) {
+    Int kept = 0;
+    for (uint64_t o = 0; o < outer_size; o++) {
+      std::copy_n(matrix.idx.begin() + matrix.pos[o], length[o], matrix.idx.begin() + kept);
+      std::copy_n(matrix.val.begin() + matrix.pos[o], length[o], matrix.val.begin() + kept);
+      matrix.pos[o] = kept;
+      kept += length[o];
+    }
+    matrix.pos[outer_size] = kept;
+    matrix.idx.resize(kept);
+    matrix.val.resize(kept);
+  }
+  return matrix;
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+// Include after benchmark.hpp, which provides json.
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <sys/resource.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define MEMORY_HOOKS 1
+#endif
+
+// Heap accounting through an interposed allocator. Each driver executable
+// defines malloc and friends, which count every allocation made by the driver,
+// Eigen, MKL, libtaco or a dlopen-ed TACO kernel before handing it to glibc.
+// The drivers are single translation units, so defining them here is safe.
+struct allocation_counters_t {
+  std::atomic<long long> allocated{0};
+  std::atomic<long long> allocations{0};
+  std::atomic<long long> live{0};
+  std::atomic<long long> peak{0};
+};
+
+inline allocation_counters_t allocation_counters;
+
+#ifdef MEMORY_HOOKS
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+}
+
+static inline void count_allocation(void *ptr) {
+  if (!ptr) return;
+  long long bytes = malloc_usable_size(ptr);
+  allocation_counters.allocated += bytes;
+  allocation_counters.allocations++;
+  long long live = allocation_counters.live += bytes;
+  long long peak = allocation_counters.peak.load(std::memory_order_relaxed);
+  while (live > peak && !allocation_counters.peak.compare_exchange_weak(peak, live)) {}
+}
+
+static inline void count_free(void *ptr) {
+  if (ptr) allocation_counters.live -= malloc_usable_size(ptr);
+}
+
+// glibc declares these noexcept, so the definitions must be too.
+extern "C" {
+void *malloc(size_t size) noexcept {
+  void *ptr = __libc_malloc(size);
+  count_allocation(ptr);
+  return ptr;
+}
+
+void *calloc(size_t count, size_t size) noexcept {
+  void *ptr = __libc_calloc(count, size);
+  count_allocation(ptr);
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) noexcept {
+  count_free(ptr);
+  void *result = __libc_realloc(ptr, size);
+  // A failed realloc leaves the old block in place.
+  count_allocation(result || size == 0 ? result : ptr);
+  return result;
+}
+
+void *memalign(size_t alignment, size_t size) noexcept {
+  void *ptr = __libc_memalign(alignment, size);
+  count_allocation(ptr);
+  return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept {
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) noexcept {
+  void *ptr = memalign(alignment, size);
+  if (!ptr) return ENOMEM;
+  *out = ptr;
+  return 0;
+}
+
+void free(void *ptr) noexcept {
+  count_free(ptr);
+  __libc_free(ptr);
+}
+}
+#endif
+
+// Reset the kernel's peak RSS (VmHWM) so that it only covers what follows.
+// Returns false where /proc/self/clear_refs is unavailable, in which case
+// peak_rss_bytes() is the peak of the whole process.
+inline bool reset_peak_rss() {
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  if (!clear_refs) return false;
+  clear_refs << "5";
+  clear_refs.flush();
+  return bool(clear_refs);
+}
+
+inline long long peak_rss_bytes() {
+  std::ifstream status("/proc/self/status");
+  std::string field;
+  while (status >> field) {
+    if (field == "VmHWM:") {
+      long long kilobytes;
+      status >> kilobytes;
+      return kilobytes * 1024;
+    }
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return usage.ru_maxrss * 1024LL;
+#endif
+}
+
+// Run setup and then test once more, outside the timed loop, and measure the
+// peak RSS and heap traffic of that single call. "workspace_bytes" is the heap
+// the call needed at its peak beyond what it still held when it returned.
+template <typename Setup, typename Test>
+json measure_memory(Setup setup, Test test) {
+  setup();
+  bool scoped = reset_peak_rss();
+  long long allocated = allocation_counters.allocated;
+  long long allocations = allocation_counters.allocations;
+  long long live = allocation_counters.live;
+  allocation_counters.peak = live;
+  test();
+
+  json memory;
+  memory["peak_rss"] = peak_rss_bytes();
+  memory["peak_rss_scope"] = scoped ? "call" : "process";
+#ifdef MEMORY_HOOKS
+  long long peak = allocation_counters.peak - live;
+  long long retained = allocation_counters.live - live;
+  memory["allocated_bytes"] = allocation_counters.allocated - allocated;
+  memory["allocations"] = allocation_counters.allocations - allocations;
+  memory["heap_peak_bytes"] = peak;
+  memory["workspace_bytes"] = peak > retained ? peak - retained : 0;
+#else
+  memory["allocated_bytes"] = nullptr;
+  memory["allocations"] = nullptr;
+  memory["heap_peak_bytes"] = nullptr;
+  memory["workspace_bytes"] = nullptr;
+#endif
+  return memory;
+}
+
+inline json structure_bytes(size_t index_bytes, size_t value_bytes) {
+  json bytes;
+  bytes["index_bytes"] = index_bytes;
+  bytes["value_bytes"] = value_bytes;
+  return bytes;
+}
+
+// Merge the call's memory measurements and the sizes of the named structures
+// into `measurements`. "memory" is the total footprint: index and value bytes
+// of every structure plus the call's workspace.
+inline void record_memory(json &measurements, const json &memory, const json &structures) {
+  long long total = memory["workspace_bytes"].is_null() ? 0 : memory["workspace_bytes"].get<long long>();
+  for (auto &structure : structures) {
+    total += structure["index_bytes"].get<long long>() + structure["value_bytes"].get<long long>();
+  }
+  measurements.update(memory);
+  measurements["structures"] = structures;
+  measurements["memory"] = total;
+}
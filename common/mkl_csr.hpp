@@ -0,0 +1,274 @@
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <mkl.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "eigen_operand.hpp"
+#include "numa.hpp"
+
+using mkl_csr_map_t = Eigen::Map<Eigen::SparseMatrix<double, Eigen::RowMajor, MKL_INT>>;
+
+// A view of a CSR handle computed by MKL (e.g. the output of mkl_sparse_sp2m)
+// as an Eigen matrix, without copying. The view is valid until the handle is
+// destroyed.
+inline mkl_csr_map_t mkl_csr_map(sparse_matrix_t M) {
+  sparse_index_base_t indexing;
+  MKL_INT rows, cols;
+  MKL_INT *rows_start, *rows_end, *columns;
+  double *values;
+  sparse_status_t status = mkl_sparse_d_export_csr(M, &indexing, &rows, &cols, &rows_start, &rows_end, &columns, &values);
+  if (status != SPARSE_STATUS_SUCCESS) {
+    throw std::runtime_error("Failed to export CSR matrix from MKL. Error code: " + std::to_string(status));
+  }
+  if (indexing != SPARSE_INDEX_BASE_ZERO || rows_end != rows_start + 1) {
+    throw std::runtime_error("MKL returned a CSR matrix that is not zero-based with a shared row pointer array");
+  }
+  return mkl_csr_map_t(rows, cols, rows_start[rows], rows_start, columns, values);
+}
+
+// An MKL CSR handle for the MKL drivers. The operand is loaded through Eigen
+// (see eigen_operand_t) and its arrays are handed to MKL in place whenever
+// Eigen's index type is MKL_INT, which holds in both the default and the
+// INDEX64 build; only a mismatched build copies them into MKL arrays. Once
+// place_rows has copied the arrays, the Eigen operand is dropped.
+struct mkl_csr_t {
+  MKL_INT rows = 0;
+  MKL_INT cols = 0;
+  MKL_INT *csr_row_pointer = nullptr;
+  MKL_INT *csr_columns = nullptr;
+  double *csr_values = nullptr;
+  sparse_matrix_t handle = nullptr;
+
+  eigen_operand_t<Eigen::RowMajor> eigen;
+  bool owns_arrays = false;
+
+  // After place_rows, the arrays the handle is built over, and the node
+  // (index into topology.nodes) and rows [begin, end) of every thread.
+  struct placed_part_t {
+    int node = 0;
+    MKL_INT begin = 0;
+    MKL_INT end = 0;
+  };
+  numa_topology_t topology;
+  std::vector<placed_part_t> parts;
+  numa_array_t<MKL_INT> placed_row_pointer;
+  numa_array_t<MKL_INT> placed_columns;
+  numa_array_t<double> placed_values;
+
+  mkl_csr_t() = default;
+  mkl_csr_t(const mkl_csr_t &) = delete;
+  mkl_csr_t &operator=(const mkl_csr_t &) = delete;
+
+  ~mkl_csr_t() { release(); }
+
+  void release() {
+    release_handle();
+    eigen = eigen_operand_t<Eigen::RowMajor>();
+  }
+
+  void load(const std::string &dir, const std::string &name) {
+    release();
+    eigen.load(dir, name);
+    assign(*eigen);
+  }
+
+  // Replace the matrix by its upper triangle, for SPARSE_MATRIX_TYPE_SYMMETRIC
+  // with SPARSE_FILL_MODE_UPPER.
+  void keep_upper() {
+    if (!eigen.view) {
+      // place_rows dropped the Eigen operand, take the placed arrays instead
+      eigen.assign(mkl_csr_map_t(rows, cols, csr_row_pointer[rows], csr_row_pointer, csr_columns, csr_values));
+    }
+    release_handle();
+    eigen.keep_upper();
+    assign(*eigen);
+  }
+
+  // Build the handle over a compressed Eigen matrix. A row-major matrix with
+  // MKL_INT indices is wrapped without a copy and must outlive the handle;
+  // anything else is copied into MKL-owned arrays.
+  template <typename Matrix>
+  void assign(const Matrix &eigen_M) {
+    using index_t = typename Matrix::StorageIndex;
+    if (handle) mkl_sparse_destroy(handle);
+    handle = nullptr;
+    rows = eigen_M.rows();
+    cols = eigen_M.cols();
+
+    if constexpr (std::is_same<index_t, MKL_INT>::value && Matrix::IsRowMajor) {
+      if (eigen_M.isCompressed()) {
+        csr_row_pointer = const_cast<MKL_INT *>(eigen_M.outerIndexPtr());
+        csr_columns = const_cast<MKL_INT *>(eigen_M.innerIndexPtr());
+        csr_values = const_cast<double *>(eigen_M.valuePtr());
+        create();
+        return;
+      }
+    }
+
+    // Copy through a compressed row-major temporary with MKL_INT indices
+    Eigen::SparseMatrix<double, Eigen::RowMajor, MKL_INT> csr = eigen_M;
+    csr.makeCompressed();
+    csr_row_pointer = (MKL_INT *)mkl_malloc((rows + 1) * sizeof(MKL_INT), 64);
+    csr_columns = (MKL_INT *)mkl_malloc(csr.nonZeros() * sizeof(MKL_INT), 64);
+    csr_values = (double *)mkl_malloc(csr.nonZeros() * sizeof(double), 64);
+    owns_arrays = true;
+    std::copy_n(csr.outerIndexPtr(), rows + 1, csr_row_pointer);
+    std::copy_n(csr.innerIndexPtr(), csr.nonZeros(), csr_columns);
+    std::copy_n(csr.valuePtr(), csr.nonZeros(), csr_values);
+    create();
+  }
+
+  json structure_bytes() const {
+    MKL_INT nnz = csr_row_pointer ? csr_row_pointer[rows] : 0;
+    return ::structure_bytes((rows + 1 + nnz) * sizeof(MKL_INT), nnz * sizeof(double));
+  }
+
+  // Replace the handle by a fresh one over the same arrays, dropping any
+  // hints and optimizations applied to the old one.
+  void reset_handle() {
+    if (handle) mkl_sparse_destroy(handle);
+    handle = nullptr;
+    create();
+  }
+
+  // Spread `threads` threads over the NUMA nodes and pin them there (see
+  // numa_topology_t::place), cut the rows into one contiguous range of about
+  // equal nonzeros per thread, and rebuild the handle over copies of the
+  // arrays whose pages each range's thread wrote first, then drop the Eigen
+  // operand so A is held once. The placement is approximate: with GNU OpenMP
+  // MKL runs on the same pinned workers, but it does not document how it
+  // splits the rows, so a thread may read ranges placed for another node.
+  // placement() confirms where the pages landed, not which thread reads
+  // them. The pages stay placed until the next load or keep_upper, the
+  // threads pinned until the next set_num_threads.
+  void place_rows(int threads) {
+    topology = numa_topology_t::detect();
+    std::vector<std::pair<int, int>> placement = topology.place(threads);
+    MKL_INT nnz = csr_row_pointer[rows];
+    numa_array_t<MKL_INT> pos(rows + 1);
+    numa_array_t<MKL_INT> idx(nnz);
+    numa_array_t<double> val(nnz);
+    parts.assign(threads, placed_part_t());
+    #pragma omp parallel num_threads(threads)
+    {
+#ifdef _OPENMP
+      int t = omp_get_thread_num();
+#else
+      int t = 0;
+#endif
+      pin_to_cpu(placement[t].second);
+      auto cut = [&](int p) -> MKL_INT {
+        if (p == threads) return rows;
+        double target = (double)nnz * p / threads;
+        return std::lower_bound(csr_row_pointer, csr_row_pointer + rows + 1, target) - csr_row_pointer;
+      };
+      placed_part_t &part = parts[t];
+      part.node = placement[t].first;
+      part.begin = cut(t);
+      part.end = cut(t + 1);
+      MKL_INT first = csr_row_pointer[part.begin];
+      MKL_INT last = csr_row_pointer[part.end];
+      std::copy(csr_row_pointer + part.begin, csr_row_pointer + part.end + (t == threads - 1), pos.data() + part.begin);
+      std::copy(csr_columns + first, csr_columns + last, idx.data() + first);
+      std::copy(csr_values + first, csr_values + last, val.data() + first);
+    }
+
+    if (handle) mkl_sparse_destroy(handle);
+    handle = nullptr;
+    if (owns_arrays) {
+      mkl_free(csr_row_pointer);
+      mkl_free(csr_columns);
+      mkl_free(csr_values);
+      owns_arrays = false;
+    }
+    placed_row_pointer = std::move(pos);
+    placed_columns = std::move(idx);
+    placed_values = std::move(val);
+    csr_row_pointer = placed_row_pointer.data();
+    csr_columns = placed_columns.data();
+    csr_values = placed_values.data();
+    create();
+    eigen = eigen_operand_t<Eigen::RowMajor>();
+  }
+
+  // Per node of the last place_rows: its threads, rows, nonzeros and bytes
+  // of A, and the share of those pages move_pages finds on the node (null
+  // where it cannot tell). Which node's threads MKL gives each range is not
+  // known, see place_rows.
+  json placement() const {
+    json nodes = json::array();
+    for (size_t k = 0; k < topology.nodes.size(); k++) {
+      int threads = 0;
+      MKL_INT placed_rows = 0;
+      MKL_INT nnz = 0;
+      double local = 0;
+      size_t sampled = 0;
+      for (const placed_part_t &part : parts) {
+        if (part.node != (int)k) continue;
+        MKL_INT first = csr_row_pointer[part.begin];
+        MKL_INT last = csr_row_pointer[part.end];
+        threads++;
+        placed_rows += part.end - part.begin;
+        nnz += last - first;
+        std::pair<const void *, size_t> arrays[] = {
+          {csr_row_pointer + part.begin, (part.end - part.begin) * sizeof(MKL_INT)},
+          {csr_columns + first, (last - first) * sizeof(MKL_INT)},
+          {csr_values + first, (last - first) * sizeof(double)},
+        };
+        for (auto [data, size] : arrays) {
+          double share = local_page_share(data, size, topology.nodes[k]);
+          if (share < 0) continue;
+          local += share * size;
+          sampled += size;
+        }
+      }
+      if (threads == 0) continue;
+      nodes.push_back({
+        {"node", topology.nodes[k]},
+        {"threads", threads},
+        {"rows", placed_rows},
+        {"nnz", nnz},
+        {"bytes", (placed_rows + nnz) * sizeof(MKL_INT) + nnz * sizeof(double)},
+        {"local_pages", sampled > 0 ? json(local / sampled) : json(nullptr)},
+      });
+    }
+    return nodes;
+  }
+
+private:
+  // Destroy the handle and free any arrays copied or placed for it, leaving
+  // the Eigen operand in place.
+  void release_handle() {
+    if (handle) mkl_sparse_destroy(handle);
+    if (owns_arrays) {
+      mkl_free(csr_row_pointer);
+      mkl_free(csr_columns);
+      mkl_free(csr_values);
+    }
+    handle = nullptr;
+    csr_row_pointer = csr_columns = nullptr;
+    csr_values = nullptr;
+    owns_arrays = false;
+    parts.clear();
+    placed_row_pointer = numa_array_t<MKL_INT>();
+    placed_columns = numa_array_t<MKL_INT>();
+    placed_values = numa_array_t<double>();
+  }
+
+  void create() {
+    sparse_status_t status = mkl_sparse_d_create_csr(&handle, SPARSE_INDEX_BASE_ZERO, rows, cols,
+                                                     csr_row_pointer, csr_row_pointer + 1,
+                                                     csr_columns, csr_values);
+    if (status != SPARSE_STATUS_SUCCESS) {
+      handle = nullptr;
+      throw std::runtime_error("Failed to create CSR matrix with MKL. Error code: " + std::to_string(status));
+    }
+  }
+};
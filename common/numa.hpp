@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+// NUMA placement for the native drivers, without libnuma. Nodes and their
+// CPUs are read from sysfs, threads are placed by pinning them to the CPUs of
+// a node, and memory by first touch: a page of a fresh anonymous mapping lands
+// on the node of the thread that first writes it. move_pages(2), asked for no
+// target nodes, reports where pages actually ended up. Elsewhere than Linux
+// there is one node, threads stay where the scheduler puts them and page
+// placement is unknown.
+
+// "0-3,8,10-11" as a list of CPUs.
+inline std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  std::istringstream ranges(list);
+  std::string range;
+  while (std::getline(ranges, range, ',')) {
+    if (range.empty() || range == "\n") continue;
+    size_t dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+struct numa_topology_t {
+  // Node numbers and the CPUs of each, for the nodes that have CPUs.
+  std::vector<int> nodes;
+  std::vector<std::vector<int>> cpus;
+
+  // The online nodes from /sys/devices/system/node, or a single node 0 with
+  // every CPU when the kernel exposes none.
+  static numa_topology_t detect() {
+    numa_topology_t topology;
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string list;
+    if (online >> list) {
+      for (int node : parse_cpu_list(list)) {
+        std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string node_cpus;
+        if (!(cpulist >> node_cpus)) continue;
+        std::vector<int> cpus = parse_cpu_list(node_cpus);
+        if (cpus.empty()) continue;
+        topology.nodes.push_back(node);
+        topology.cpus.push_back(cpus);
+      }
+    }
+    if (topology.nodes.empty()) {
+      topology.nodes = {0};
+      topology.cpus.assign(1, {});
+      int cores = std::max(1u, std::thread::hardware_concurrency());
+      for (int cpu = 0; cpu < cores; cpu++) topology.cpus[0].push_back(cpu);
+    }
+    return topology;
+  }
+
+  // Spread `threads` threads over the nodes in proportion to their CPUs,
+  // each node's threads in a contiguous range of thread numbers. Returns the
+  // index into `nodes` and the CPU of every thread.
+  std::vector<std::pair<int, int>> place(int threads) const {
+    size_t total = 0;
+    for (const std::vector<int> &node_cpus : cpus) total += node_cpus.size();
+    std::vector<std::pair<int, int>> placement;
+    size_t before = 0;
+    for (size_t n = 0; n < nodes.size(); n++) {
+      int first = before * threads / total;
+      before += cpus[n].size();
+      int last = before * threads / total;
+      for (int t = first; t < last; t++) {
+        placement.emplace_back(n, cpus[n][(t - first) % cpus[n].size()]);
+      }
+    }
+    return placement;
+  }
+};
+
+inline void pin_to_cpu(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+#else
+  (void)cpu;
+#endif
+}
+
+// An array in pages that no thread has touched yet, so that whichever thread
+// writes a page first places it.
+template <typename T>
+class numa_array_t {
+public:
+  numa_array_t() = default;
+
+  explicit numa_array_t(size_t n) : n(n) {
+    if (n == 0) return;
+    base = mmap(nullptr, bytes(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      base = nullptr;
+      throw std::bad_alloc();
+    }
+  }
+
+  numa_array_t(numa_array_t &&other) noexcept { *this = std::move(other); }
+
+  numa_array_t &operator=(numa_array_t &&other) noexcept {
+    std::swap(base, other.base);
+    std::swap(n, other.n);
+    return *this;
+  }
+
+  numa_array_t(const numa_array_t &) = delete;
+  numa_array_t &operator=(const numa_array_t &) = delete;
+
+  ~numa_array_t() {
+    if (base) munmap(base, bytes());
+  }
+
+  T *data() const { return (T *)base; }
+  size_t size() const { return n; }
+  size_t bytes() const { return n * sizeof(T); }
+  T &operator[](size_t i) const { return data()[i]; }
+
+private:
+  void *base = nullptr;
+  size_t n = 0;
+};
+
+// Share of the resident pages of [data, data + bytes) that are on `node`,
+// over up to `samples` pages spread evenly across the range, or -1 when the
+// kernel cannot tell (no move_pages, or no page resident).
+inline double local_page_share(const void *data, size_t bytes, int node, size_t samples = 1024) {
+#ifdef __linux__
+  if (bytes == 0) return -1;
+  size_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t first = (uintptr_t)data / page;
+  uintptr_t last = ((uintptr_t)data + bytes - 1) / page;
+  size_t pages = last - first + 1;
+  size_t count = std::min(pages, samples);
+  std::vector<void *> addresses(count);
+  for (size_t s = 0; s < count; s++) {
+    addresses[s] = (void *)((first + s * pages / count) * page);
+  }
+  std::vector<int> status(count, -1);
+  if (syscall(SYS_move_pages, 0, count, addresses.data(), nullptr, status.data(), 0) != 0) return -1;
+  size_t resident = 0;
+  size_t local = 0;
+  for (int where : status) {
+    if (where < 0) continue;
+    resident++;
+    local += where == node;
+  }
+  return resident ? (double)local / resident : -1;
+#else
+  (void)data, (void)bytes, (void)node, (void)samples;
+  return -1;
+#endif
+}
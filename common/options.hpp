@@ -0,0 +1,167 @@
+#pragma once
+
+// Include after benchmark.hpp, which provides json.
+
+#include <getopt.h>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "server.hpp"
+#include "threads.hpp"
+#include "timing.hpp"
+#include "verify.hpp"
+
+// The command line options every C++ driver takes after `--`: the server and
+// manifest modes, the thread sweep, counters and sampling, and for the drivers
+// that check their result, verification and writing the output. A driver
+// passes its own short and long options through short_options() and
+// long_options(), handles its own cases and hands every other one to parse().
+// Drivers without a verify_t pass none and get neither -V, -T, -W nor -M.
+struct common_options_t {
+  thread_sweep_t &threads;
+  bool &counters;
+  timing_t &timing;
+  verify_t *verify;
+
+  bool server = false;
+  bool write_output = false;
+  std::string manifest;
+
+  common_options_t(thread_sweep_t &threads, bool &counters, timing_t &timing, verify_t *verify = nullptr)
+    : threads(threads), counters(counters), timing(timing), verify(verify) {}
+
+  std::string short_options(const std::string &own) const {
+    return own + "St:pcw:m:r:F" + (verify ? "VT:WM:" : "");
+  }
+
+  // The driver's long options followed by the common ones and the terminator
+  // getopt_long expects.
+  std::vector<option> long_options(std::vector<option> own) const {
+    own.insert(own.end(), {
+      {"server", no_argument, 0, 'S'},
+      {"threads", required_argument, 0, 't'},
+      {"pin", no_argument, 0, 'p'},
+      {"counters", no_argument, 0, 'c'},
+      {"warmup", required_argument, 0, 'w'},
+      {"min_time", required_argument, 0, 'm'},
+      {"min_reps", required_argument, 0, 'r'},
+      {"flush", no_argument, 0, 'F'},
+    });
+    if (verify) {
+      own.insert(own.end(), {
+        {"verify", no_argument, 0, 'V'},
+        {"tolerance", required_argument, 0, 'T'},
+        {"write_output", no_argument, 0, 'W'},
+        {"manifest", required_argument, 0, 'M'},
+      });
+    }
+    own.push_back({0, 0, 0, 0});
+    return own;
+  }
+
+  // Apply option `c`, exiting on an invalid argument. Returns false for an
+  // option that is not a common one.
+  bool parse(int c, const char *optarg) {
+    switch (c) {
+      case 'S':
+        server = true;
+        return true;
+      case 't':
+        parse_or_exit("thread counts", [&] { threads.parse(optarg); });
+        return true;
+      case 'p':
+        threads.pin = true;
+        return true;
+      case 'c':
+        counters = true;
+        return true;
+      case 'w':
+        parse_or_exit("warmup", [&] { timing.warmup = std::stoi(optarg); });
+        return true;
+      case 'm':
+        parse_or_exit("min_time", [&] { timing.min_time = std::stod(optarg); });
+        return true;
+      case 'r':
+        parse_or_exit("min_reps", [&] { timing.min_reps = std::stoi(optarg); });
+        return true;
+      case 'F':
+        timing.flush = true;
+        return true;
+    }
+    if (!verify) return false;
+    switch (c) {
+      case 'V':
+        verify->enabled = true;
+        return true;
+      case 'T':
+        parse_or_exit("tolerance", [&] { verify->tolerance = std::stod(optarg); });
+        return true;
+      case 'W':
+        write_output = true;
+        return true;
+      case 'M':
+        manifest = optarg;
+        return true;
+    }
+    return false;
+  }
+
+  // Print the help lines of the common options with their descriptions
+  // starting at column `width`, like the driver's own lines. `commands` lists
+  // the server commands worth naming, `reference` what -V checks against and
+  // `output` the file -W writes.
+  void help(size_t width, const std::string &commands, const std::string &reference = "",
+            const std::string &output = "") const {
+    help_line(width, "-S, --server", "Serve " + commands + " commands on stdin");
+    help_line(width, "-t, --threads", "Comma separated thread counts to sweep, e.g. 1,2,4,8");
+    help_line(width, "-p, --pin", "Pin thread t to the t-th CPU the process may run on");
+    help_line(width, "-c, --counters", "Read hardware performance counters around each call");
+    help_line(width, "-w, --warmup", "Untimed calls before sampling (default 0)");
+    help_line(width, "-m, --min_time", "Seconds of samples to collect at least (default 0.2)");
+    help_line(width, "-r, --min_reps", "Samples to collect at least (default 1)");
+    help_line(width, "-F, --flush", "Flush the last level cache before every timed call");
+    if (!verify) return;
+    help_line(width, "-V, --verify", "Check the result against " + reference);
+    help_line(width, "-T, --tolerance", "Largest error relative to the largest reference value (default 1e-9)");
+    help_line(width, "-W, --write_output", "Write the result as " + output);
+    help_line(width, "-M, --manifest", "Run every entry of a manifest file, see common/server.hpp");
+  }
+
+  // The server commands that set the common options, next to the driver's.
+  void add_commands(std::map<std::string, server_command_t> &commands) {
+    commands["threads"] = [this](const server_args_t &args) {
+      threads.parse(server_arg(args, 0, "counts"));
+      threads.pin = args.size() > 1 && args[1] == "pin";
+      return json();
+    };
+    commands["counters"] = [this](const server_args_t &args) {
+      counters = server_arg(args, 0, "on|off") == "on";
+      return json();
+    };
+    commands["timing"] = [this](const server_args_t &args) { timing.set(args); return json(); };
+    if (verify) {
+      commands["verify"] = [this](const server_args_t &args) { verify->set(args); return json(); };
+    }
+  }
+
+private:
+  template <typename Parse>
+  static void parse_or_exit(const char *name, Parse parse) {
+    try {
+      parse();
+    } catch (const std::exception &e) {
+      std::cerr << "Invalid " << name << std::endl;
+      exit(1);
+    }
+  }
+
+  // "  <flags>" padded to `width`, or followed by two spaces when longer.
+  static void help_line(size_t width, const std::string &flags, const std::string &text) {
+    std::string line = "  " + flags;
+    line += line.size() < width ? std::string(width - line.size(), ' ') : "  ";
+    std::cout << line << text << std::endl;
+  }
+};
@@ -0,0 +1,260 @@
+#pragma once
+
+// Include after benchmark.hpp, which provides json.
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+#include "timing.hpp"
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// Hardware counters read around the measured call. Core events are opened on
+// every thread of the process and inherited by threads created later, so
+// OpenMP, MKL and TACO workers are all counted. DRAM traffic comes from the
+// Intel uncore memory controllers (uncore_imc_*), which are system wide and
+// usually need perf_event_paranoid <= 0; elsewhere it is reported as null.
+struct perf_event_t {
+  std::string name;
+  uint32_t type;
+  uint64_t config;
+  double scale = 1; // bytes per count for the uncore events
+  std::vector<int> fds;
+
+  perf_event_t(std::string name, uint32_t type, uint64_t config)
+    : name(std::move(name)), type(type), config(config) {}
+};
+
+struct perf_counters_t {
+  std::vector<perf_event_t> core, uncore;
+  std::vector<std::string> errors;
+
+  perf_counters_t() = default;
+  perf_counters_t(const perf_counters_t &) = delete;
+  perf_counters_t &operator=(const perf_counters_t &) = delete;
+  ~perf_counters_t() { close(); }
+
+#ifdef __linux__
+  static uint64_t cache_event(uint64_t cache, uint64_t op, uint64_t result) {
+    return cache | (op << 8) | (result << 16);
+  }
+
+  static int perf_event_open(perf_event_attr &attr, pid_t pid, int cpu) {
+    return syscall(SYS_perf_event_open, &attr, pid, cpu, -1, 0);
+  }
+
+  static std::string read_line(const std::string &path) {
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+  }
+
+  static std::vector<std::string> list_dir(const std::string &path) {
+    std::vector<std::string> names;
+    if (DIR *dir = opendir(path.c_str())) {
+      while (dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+      }
+      closedir(dir);
+    }
+    return names;
+  }
+
+  void open_core(perf_event_t event) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event.type;
+    attr.config = event.config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    for (const std::string &task : list_dir("/proc/self/task")) {
+      int fd = perf_event_open(attr, std::stoi(task), -1);
+      if (fd < 0 && errno == ESRCH) continue; // the thread has exited
+      if (fd < 0) {
+        errors.push_back(event.name + ": " + std::strerror(errno));
+        for (int open_fd : event.fds) ::close(open_fd);
+        return;
+      }
+      event.fds.push_back(fd);
+    }
+    core.push_back(event);
+  }
+
+  // Intel IMC "cas_count_read" and "cas_count_write" events, one counter per
+  // memory controller on the first CPU of its cpumask.
+  void open_uncore(const std::string &name, const std::string &event_name) {
+    std::string devices = "/sys/bus/event_source/devices/";
+    for (const std::string &device : list_dir(devices)) {
+      if (device.rfind("uncore_imc", 0) != 0) continue;
+      std::string path = devices + device;
+      std::string spec = read_line(path + "/events/" + event_name);
+      if (spec.empty()) continue;
+      uint64_t config = 0;
+      for (size_t start = 0; start < spec.size();) {
+        size_t end = spec.find(',', start);
+        std::string term = spec.substr(start, end - start);
+        size_t eq = term.find('=');
+        uint64_t value = std::stoull(term.substr(eq + 1), nullptr, 0);
+        if (term.compare(0, eq, "event") == 0) config |= value;
+        if (term.compare(0, eq, "umask") == 0) config |= value << 8;
+        start = end == std::string::npos ? spec.size() : end + 1;
+      }
+      perf_event_t event{name, (uint32_t)std::stoul(read_line(path + "/type")), config};
+      // The kernel scales CAS counts to MiB; each CAS moves one 64 byte line.
+      std::string scale = read_line(path + "/events/" + event_name + ".scale");
+      std::string unit = read_line(path + "/events/" + event_name + ".unit");
+      event.scale = scale.empty() ? 64 : std::stod(scale) * (unit == "MiB" ? 1 << 20 : 1);
+
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = event.type;
+      attr.config = event.config;
+      attr.disabled = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      int cpu = std::stoi(read_line(path + "/cpumask"));
+      int fd = perf_event_open(attr, -1, cpu);
+      if (fd < 0) {
+        errors.push_back(name + ": " + std::strerror(errno));
+        continue;
+      }
+      event.fds.push_back(fd);
+      uncore.push_back(event);
+    }
+  }
+
+  // Open all counters on the threads that exist now. Counters that cannot be
+  // opened are recorded in `errors` and reported as null.
+  void open() {
+    close();
+    open_core({"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES});
+    open_core({"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS});
+    open_core({"llc_misses", PERF_TYPE_HW_CACHE,
+               cache_event(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)});
+    open_core({"dtlb_misses", PERF_TYPE_HW_CACHE,
+               cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)});
+    open_uncore("dram_read_bytes", "cas_count_read");
+    open_uncore("dram_write_bytes", "cas_count_write");
+  }
+
+  void ioctl_all(unsigned long request) {
+    for (auto *events : {&core, &uncore}) {
+      for (auto &event : *events) {
+        for (int fd : event.fds) ioctl(fd, request, 0);
+      }
+    }
+  }
+
+  void reset() { ioctl_all(PERF_EVENT_IOC_RESET); }
+  void enable() { ioctl_all(PERF_EVENT_IOC_ENABLE); }
+  void disable() { ioctl_all(PERF_EVENT_IOC_DISABLE); }
+
+  // Sum of an event over its counters, scaled up when the kernel had to
+  // multiplex it.
+  static double read(const perf_event_t &event) {
+    double total = 0;
+    for (int fd : event.fds) {
+      uint64_t values[3];
+      if (::read(fd, values, sizeof(values)) != sizeof(values) || values[2] == 0) continue;
+      total += (double)values[0] * values[1] / values[2];
+    }
+    return total * event.scale;
+  }
+
+  void close() {
+    for (auto *events : {&core, &uncore}) {
+      for (auto &event : *events) {
+        for (int fd : event.fds) ::close(fd);
+      }
+      events->clear();
+    }
+    errors.clear();
+  }
+#else
+  void open() { errors.push_back("perf_event is only available on Linux"); }
+  void reset() {}
+  void enable() {}
+  void disable() {}
+  void close() {}
+#endif
+};
+
+// Call test() repeatedly with the counters enabled around each call only, for
+// `calls` calls or, when that is 0, until 100ms have been counted. With
+// timing.flush the caches are flushed before each call, outside the counted
+// window, like the timed samples of benchmark_samples. Returns the counts per
+// call, with null for unavailable counters and the reasons under
+// "counters_error".
+template <typename Setup, typename Test>
+json measure_counters(const timing_t &timing, Setup setup, Test test, int calls) {
+  // One call first, so thread pools exist when the counters are opened.
+  setup();
+  test();
+
+  perf_counters_t counters;
+  counters.open();
+  counters.reset();
+  auto elapsed = std::chrono::high_resolution_clock::duration(0);
+  int counted = 0;
+  while (calls > 0 ? counted < calls : elapsed < std::chrono::milliseconds(100)) {
+    setup();
+    if (timing.flush) flush_caches();
+    auto tic = std::chrono::high_resolution_clock::now();
+    counters.enable();
+    test();
+    counters.disable();
+    elapsed += std::chrono::high_resolution_clock::now() - tic;
+    counted++;
+  }
+  double seconds = std::chrono::duration<double>(elapsed).count();
+
+  json measurements;
+  for (const char *name : {"cycles", "instructions", "llc_misses", "dtlb_misses", "dram_read_bytes", "dram_write_bytes"}) {
+    measurements[name] = nullptr;
+  }
+#ifdef __linux__
+  std::map<std::string, double> totals;
+  for (auto *events : {&counters.core, &counters.uncore}) {
+    for (const perf_event_t &event : *events) {
+      totals[event.name] += perf_counters_t::read(event);
+    }
+  }
+  for (auto &[name, total] : totals) {
+    measurements[name] = total / counted;
+  }
+#endif
+  measurements["ipc"] = nullptr;
+  if (!measurements["cycles"].is_null() && !measurements["instructions"].is_null()) {
+    measurements["ipc"] = measurements["instructions"].get<double>() / measurements["cycles"].get<double>();
+  }
+  // LLC read misses each bring in a 64 byte line: a lower bound on DRAM reads
+  // that is available without uncore access.
+  measurements["llc_miss_bandwidth"] = nullptr;
+  if (!measurements["llc_misses"].is_null()) {
+    measurements["llc_miss_bandwidth"] = measurements["llc_misses"].get<double>() * 64 * counted / seconds;
+  }
+  measurements["bandwidth"] = nullptr;
+  if (!measurements["dram_read_bytes"].is_null() && !measurements["dram_write_bytes"].is_null()) {
+    double bytes = measurements["dram_read_bytes"].get<double>() + measurements["dram_write_bytes"].get<double>();
+    measurements["bandwidth"] = bytes * counted / seconds;
+  }
+  measurements["counted_calls"] = counted;
+  measurements["counters_error"] = counters.errors.empty() ? json(nullptr) : json(counters.errors);
+  return measurements;
+}
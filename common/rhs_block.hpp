@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "binary_matrix.hpp"
+
+// The n x k block X of right-hand sides of the SpMM modes, returned
+// row-major so that a row of A's nonzeros updates k contiguous outputs.
+// <dir>/X.bin is used when it holds a dense n x k matrix (column-major, like
+// every dense binary operand). Otherwise column 0 is x and the other columns
+// are uniform in [0, 1) from a fixed seed, so column 0 of Y = A * X is the
+// usual y and every run sees the same X.
+inline std::vector<double> load_rhs_block(const std::string &dir, const double *x, int64_t n, int k) {
+  std::vector<double> X(n * k);
+  std::string bin = dir + "/X.bin";
+  if (binary_matrix_exists(bin)) {
+    binary_matrix_t file(bin);
+    if (file.header.layout != BINARY_DENSE || file.header.rows != (uint64_t)n || file.header.cols != (uint64_t)k) {
+      throw std::runtime_error(bin + " is not a dense " + std::to_string(n) + " x " + std::to_string(k) + " matrix");
+    }
+    for (int64_t i = 0; i < n; i++) {
+      for (int c = 0; c < k; c++) X[i * k + c] = file.val()[c * n + i];
+    }
+    return X;
+  }
+  for (int64_t i = 0; i < n; i++) {
+    X[i * k] = x[i];
+    for (int c = 1; c < k; c++) {
+      // SplitMix64 of the entry's position
+      uint64_t z = (uint64_t)(i * k + c) * 0x9e3779b97f4a7c15ull;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      z ^= z >> 31;
+      X[i * k + c] = (z >> 11) * 0x1.0p-53;
+    }
+  }
+  return X;
+}
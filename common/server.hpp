@@ -0,0 +1,192 @@
+#pragma once
+
+// Include after benchmark.hpp, which provides json.
+
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Persistent server mode shared by the C++ drivers. A driver started with
+// `-- --server` reads one command per line from stdin and answers each one with
+// a single line of JSON on stdout, so loaded operands and compiled kernels stay
+// resident across a whole sweep instead of being rebuilt by a new process per
+// matrix. Arguments are whitespace separated and may be double-quoted.
+//
+//   load <input dir>          read the operands in <input dir>
+//   schedule <name>           select the schedule used by subsequent runs
+//   timing <warmup> <min_time> <min_reps> [flush]
+//                             sample subsequent runs this way (see timing.hpp)
+//   verify on [tolerance]|off  check each run's result against a reference
+//                             (see verify.hpp)
+//   run <output dir> [reps]   time the kernel, over exactly reps runs if given,
+//                             and write <output dir>/measurements.json
+//   fetch <output dir>        write the result of the last run to <output dir>
+//   quit
+//
+// Every reply carries "status": "ok" or "error"; errors also carry "message".
+//
+// `-- --manifest <file>` runs a whole sweep through the same commands without
+// a client. Each line of <file> is one entry,
+//
+//   <input> <output dir> [<command>=<arg>[,<arg>...] ...]
+//
+// where the settings are issued as commands before the entry runs, e.g.
+// schedule=column-major or format=bcsr,2x2, and stay in effect for later
+// entries; reps=<n> fixes the number of timed runs and fetch=on also writes
+// the result to <output dir>. <input> is an operand directory or a binary
+// matrix file, see manifest_operands. Consecutive entries with the same input
+// load it once, so its operands and compiled kernels are reused. Every entry
+// prints the reply of its run with "entry", "input" and "output" added. Lines
+// that are blank or start with # are skipped.
+
+using server_args_t = std::vector<std::string>;
+using server_command_t = std::function<json(const server_args_t &)>;
+
+inline const std::string &server_arg(const server_args_t &args, size_t i, const char *name) {
+  if (i >= args.size()) {
+    throw std::invalid_argument(std::string("Missing argument <") + name + ">");
+  }
+  return args[i];
+}
+
+inline int serve(const std::map<std::string, server_command_t> &commands,
+                 std::istream &in = std::cin, std::ostream &out = std::cout) {
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream words(line);
+    std::string name;
+    if (!(words >> name)) continue;
+    if (name == "quit") break;
+    server_args_t args;
+    std::string arg;
+    while (words >> std::quoted(arg)) args.push_back(arg);
+
+    json reply;
+    auto command = commands.find(name);
+    if (command == commands.end()) {
+      reply["status"] = "error";
+      reply["message"] = "Unknown command " + name;
+    } else {
+      try {
+        reply = command->second(args);
+        if (reply.is_null()) reply = json::object();
+        reply["status"] = "ok";
+      } catch (const std::exception &e) {
+        reply = json::object();
+        reply["status"] = "error";
+        reply["message"] = e.what();
+      }
+    }
+    out << reply.dump() << std::endl;
+  }
+  return 0;
+}
+
+inline int server_reps(const server_args_t &args, size_t i) {
+  return i < args.size() ? std::stoi(args[i]) : 0;
+}
+
+// Operand directory of a manifest entry. A binary matrix file is linked as
+// A.bin into <output dir>/operands, along with the x, X and B operands of its
+// directory; without a B there it is linked as B.bin too, for A * A.
+inline std::string manifest_operands(const std::string &input, const std::string &output) {
+  namespace fs = std::filesystem;
+  if (fs::is_directory(input)) return input;
+  if (!fs::is_regular_file(input)) {
+    throw std::runtime_error("No such input " + input);
+  }
+  fs::path source = fs::absolute(input);
+  fs::path staged = fs::path(output)/"operands";
+  fs::remove_all(staged);
+  fs::create_directories(staged);
+  fs::create_symlink(source, staged/"A.bin");
+  bool has_b = false;
+  for (const char *name : {"x.bin", "x.ttx", "X.bin", "B.bin", "B.ttx"}) {
+    fs::path operand = source.parent_path()/name;
+    if (operand != source && fs::exists(operand)) {
+      fs::create_symlink(operand, staged/name);
+      has_b = has_b || name[0] == 'B';
+    }
+  }
+  if (!has_b) fs::create_symlink(source, staged/"B.bin");
+  return staged;
+}
+
+// Run the entries of a manifest (see above) with the server's commands, also
+// fetching every result when `fetch` is set. Returns 1 if any entry failed.
+inline int run_manifest(const std::string &path, const std::map<std::string, server_command_t> &commands,
+                        bool fetch = false, std::ostream &out = std::cout) {
+  std::ifstream manifest(path);
+  if (!manifest) {
+    std::cerr << "Failed to open " << path << std::endl;
+    return 1;
+  }
+  auto call = [&](const std::string &name, const server_args_t &args) {
+    auto command = commands.find(name);
+    if (command == commands.end()) {
+      throw std::invalid_argument("Unknown command " + name);
+    }
+    return command->second(args);
+  };
+  std::string line;
+  std::string loaded;
+  int entry = 0;
+  int failed = 0;
+  while (std::getline(manifest, line)) {
+    std::istringstream words(line);
+    std::string input, output;
+    if (!(words >> std::quoted(input)) || input[0] == '#') continue;
+    json reply;
+    try {
+      if (!(words >> std::quoted(output))) {
+        throw std::invalid_argument("Missing output dir");
+      }
+      std::string reps = "0";
+      bool fetch_entry = fetch;
+      std::string setting;
+      while (words >> std::quoted(setting)) {
+        size_t equals = setting.find('=');
+        if (equals == std::string::npos) {
+          throw std::invalid_argument("Expected <command>=<args>, not " + setting);
+        }
+        std::string name = setting.substr(0, equals);
+        server_args_t args;
+        std::istringstream values(setting.substr(equals + 1));
+        for (std::string value; std::getline(values, value, ',');) args.push_back(value);
+        if (name == "reps") {
+          reps = server_arg(args, 0, "reps");
+        } else if (name == "fetch") {
+          fetch_entry = server_arg(args, 0, "on|off") == "on";
+        } else {
+          call(name, args);
+        }
+      }
+      std::filesystem::create_directories(output);
+      if (input != loaded) {
+        loaded.clear();
+        call("load", {manifest_operands(input, output)});
+        loaded = input;
+      }
+      reply = call("run", {output, reps});
+      if (fetch_entry) call("fetch", {output});
+      reply["status"] = "ok";
+    } catch (const std::exception &e) {
+      reply = json::object();
+      reply["status"] = "error";
+      reply["message"] = e.what();
+      failed++;
+    }
+    reply["entry"] = entry++;
+    reply["input"] = input;
+    reply["output"] = output;
+    out << reply.dump() << std::endl;
+  }
+  return failed > 0;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// y = A * x for a symmetric n x n matrix A given by the CSR arrays of its
+// upper triangle U, so each stored value is read once and used twice: a_ij
+// adds a_ij * x_j to y_i and, off the diagonal, a_ij * x_i to y_j.
+//
+// Rows are split across the threads of the team by nonzeros. The mirrored
+// updates of a thread whose rows are [b, e) only land in y[b, l), where l - 1
+// is the largest column of those rows (at least e - 1), so each thread
+// accumulates them in a private buffer over that range, and each y_k sums the
+// buffers whose range holds k. The split and the buffers are kept between
+// calls with the same team size; call reset() when the arrays change.
+template <typename Int>
+struct symmetric_spmv_t {
+  std::vector<std::vector<double>> partials;
+  std::vector<Int> starts, limits;
+  int split_threads = 0;
+
+  void reset() {
+    split_threads = 0;
+  }
+
+  void multiply(Int n, const Int *pos, const Int *idx, const double *val, const double *x, double *y) {
+    #pragma omp parallel
+    {
+#ifdef _OPENMP
+      int threads = omp_get_num_threads();
+      int t = omp_get_thread_num();
+#else
+      int threads = 1;
+      int t = 0;
+#endif
+      #pragma omp single
+      if (threads != split_threads) split(n, pos, idx, threads);
+
+      Int begin = starts[t];
+      Int end = starts[t + 1];
+      std::vector<double> &partial = partials[t];
+      partial.assign(limits[t] - begin, 0.0);
+      double *mirror = partial.data() - begin;
+      for (Int i = begin; i < end; i++) {
+        double x_i = x[i];
+        double sum = 0;
+        for (Int p = pos[i]; p < pos[i + 1]; p++) {
+          Int j = idx[p];
+          sum += val[p] * x[j];
+          if (j != i) mirror[j] += val[p] * x_i;
+        }
+        mirror[i] += sum;
+      }
+
+      #pragma omp barrier
+      #pragma omp for schedule(static)
+      for (Int k = 0; k < n; k++) {
+        double sum = 0;
+        for (int s = 0; s < threads && starts[s] <= k; s++) {
+          if (k < limits[s]) sum += partials[s][k - starts[s]];
+        }
+        y[k] = sum;
+      }
+    }
+  }
+
+  size_t workspace_bytes() const {
+    size_t bytes = (starts.capacity() + limits.capacity()) * sizeof(Int);
+    for (const auto &partial : partials) bytes += partial.capacity() * sizeof(double);
+    return bytes;
+  }
+
+private:
+  void split(Int n, const Int *pos, const Int *idx, int threads) {
+    partials.resize(threads);
+    starts.resize(threads + 1);
+    limits.resize(threads);
+    for (int t = 0; t <= threads; t++) {
+      double target = (double)pos[n] * t / threads;
+      starts[t] = t == threads ? n : std::lower_bound(pos, pos + n + 1, target) - pos;
+    }
+    for (int t = 0; t < threads; t++) {
+      Int limit = starts[t + 1];
+      for (Int p = pos[starts[t]]; p < pos[starts[t + 1]]; p++) limit = std::max(limit, idx[p] + 1);
+      limits[t] = limit;
+    }
+    split_threads = threads;
+  }
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// A persistent cache of the shared objects TACO compiles its kernels into.
+// TACO writes the C source of every kernel to a fresh temporary directory and
+// runs `$TACO_CC $TACO_CFLAGS <source> -o <library>` through the shell, so each
+// process recompiles kernels earlier processes already built. Like ccache,
+// enable_taco_kernel_cache puts the driver itself in front of TACO_CC, and
+// taco_kernel_cache_main, called first in main, answers those compiler calls
+// from <cache>/<hash>.so. The hash covers the compiler command and flags and
+// the generated source, which spells out the index statement, the formats and
+// the schedule. A miss runs the real compiler and stores its output.
+//
+// The cache is $TACO_KERNEL_CACHE, else $XDG_CACHE_HOME/taco-kernels or
+// ~/.cache/taco-kernels. TACO_KERNEL_CACHE=off compiles every kernel again.
+// Clear the cache after upgrading the compiler behind an unchanged command.
+
+constexpr const char *taco_kernel_cache_flag = "--taco-kernel-cache-cc";
+
+inline std::filesystem::path taco_kernel_cache_dir() {
+  const char *dir = getenv("TACO_KERNEL_CACHE");
+  if (dir && *dir) return dir;
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  if (cache_home && *cache_home) return std::filesystem::path(cache_home)/"taco-kernels";
+  const char *home = getenv("HOME");
+  if (home && *home) return std::filesystem::path(home)/".cache"/"taco-kernels";
+  return {};
+}
+
+// Route the TACO compiler calls of this process through the cache.
+inline void enable_taco_kernel_cache() {
+  std::filesystem::path dir = taco_kernel_cache_dir();
+  if (dir.empty() || dir == "off") return;
+  const char *cc = getenv("TACO_CC");
+  std::string compiler = cc && *cc ? cc : "cc";
+  if (compiler.find(taco_kernel_cache_flag) != std::string::npos) return;
+  std::error_code error;
+  std::filesystem::path self = std::filesystem::read_symlink("/proc/self/exe", error);
+  if (error) return;
+  std::string command = "'" + self.string() + "' " + taco_kernel_cache_flag + " " + compiler;
+  setenv("TACO_CC", command.c_str(), 1);
+  setenv("TACO_KERNEL_CACHE", dir.c_str(), 1);
+}
+
+inline int taco_kernel_cache_run(const std::vector<char *> &command) {
+  pid_t child = fork();
+  if (child < 0) return 127;
+  if (child == 0) {
+    execvp(command[0], command.data());
+    perror(command[0]);
+    _exit(127);
+  }
+  int status;
+  if (waitpid(child, &status, 0) < 0) return 127;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// When argv is a compiler call routed here by enable_taco_kernel_cache, serve
+// it and return its exit status. Otherwise return -1.
+inline int taco_kernel_cache_main(int argc, char **argv) {
+  namespace fs = std::filesystem;
+  if (argc < 3 || std::string(argv[1]) != taco_kernel_cache_flag) return -1;
+  std::vector<char *> command(argv + 2, argv + argc);
+  command.push_back(nullptr);
+
+  // FNV-1a over the arguments, with sources replaced by their contents and the
+  // (randomly named) output left out
+  uint64_t hash = 0xcbf29ce484222325ull;
+  auto mix = [&](const std::string &bytes) {
+    for (unsigned char byte : bytes) hash = (hash ^ byte) * 0x100000001b3ull;
+    hash = (hash ^ 0xff) * 0x100000001b3ull;
+  };
+  std::string output;
+  for (int a = 2; a < argc; a++) {
+    std::string arg = argv[a];
+    if (arg == "-o" && a + 1 < argc) {
+      output = argv[++a];
+      continue;
+    }
+    std::string extension = fs::path(arg).extension();
+    if ((extension == ".c" || extension == ".cpp" || extension == ".cu") && fs::is_regular_file(arg)) {
+      std::ifstream source(arg, std::ios::binary);
+      std::stringstream contents;
+      contents << source.rdbuf();
+      arg = contents.str();
+    }
+    mix(arg);
+  }
+
+  fs::path dir = taco_kernel_cache_dir();
+  if (output.empty() || dir.empty()) return taco_kernel_cache_run(command);
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.so", (unsigned long long)hash);
+  fs::path entry = dir/name;
+  std::error_code error;
+  if (fs::copy_file(entry, output, fs::copy_options::overwrite_existing, error)) return 0;
+
+  int status = taco_kernel_cache_run(command);
+  if (status != 0) return status;
+  // Publish with a rename so concurrent drivers never load a partial file
+  fs::create_directories(dir, error);
+  fs::path partial = entry;
+  partial += "." + std::to_string(getpid());
+  if (fs::copy_file(output, partial, fs::copy_options::overwrite_existing, error)) {
+    fs::rename(partial, entry, error);
+    if (error) fs::remove(partial, error);
+  }
+  return 0;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "taco.h"
+#include "binary_matrix.hpp"
+#include "market_matrix.hpp"
+#include "memory.hpp"
+
+// Index and value bytes of a TACO tensor's storage.
+inline json taco_structure_bytes(const taco::Tensor<double> &tensor) {
+  taco::TensorStorage storage = tensor.getStorage();
+  size_t value_bytes = storage.getValues().getSize() * sizeof(double);
+  return structure_bytes(storage.getSizeInBytes() - value_bytes, value_bytes);
+}
+
+// Compile `stmt` into `tensor` with TACO's process-wide parallel schedule set to
+// `schedule` and `chunk` iterations per task, then restore the previous one.
+// TACO writes the schedule into the pragma of every parallel loop it generates.
+inline void taco_compile_scheduled(taco::TensorBase &tensor, taco::IndexStmt stmt,
+                                   taco::ParallelSchedule schedule, int chunk) {
+  taco::ParallelSchedule previous;
+  int previous_chunk;
+  taco::taco_get_parallel_schedule(&previous, &previous_chunk);
+  taco::taco_set_parallel_schedule(schedule, chunk);
+  try {
+    tensor.compile(stmt);
+  } catch (...) {
+    taco::taco_set_parallel_schedule(previous, previous_chunk);
+    throw;
+  }
+  taco::taco_set_parallel_schedule(previous, previous_chunk);
+}
+
+// The schedule clause of the first parallel loop in the kernels TACO generated
+// for `tensor`, such as "dynamic, 1", read from their source. "default" means
+// the pragma has no clause and "" that no loop is parallel.
+inline std::string taco_omp_schedule(const taco::TensorBase &tensor) {
+  std::string source = tensor.getSource();
+  size_t pragma = source.find("#pragma omp parallel for");
+  if (pragma == std::string::npos) return "";
+  std::string line = source.substr(pragma, source.find('\n', pragma) - pragma);
+  size_t open = line.find("schedule(");
+  if (open == std::string::npos) return "default";
+  open += std::string("schedule(").size();
+  return line.substr(open, line.find(')', open) - open);
+}
+
+// The arrays of a CSR ({Dense, Sparse}) TACO tensor.
+struct taco_csr_arrays_t {
+  int rows;
+  int cols;
+  const int *pos;
+  const int *idx;
+  const double *val;
+};
+
+inline taco_csr_arrays_t taco_csr_arrays(const taco::Tensor<double> &tensor) {
+  const taco::TensorStorage &storage = tensor.getStorage();
+  const taco::ModeIndex &columns = storage.getIndex().getModeIndex(1);
+  return {tensor.getDimension(0), tensor.getDimension(1),
+          (const int *)columns.getIndexArray(0).getData(), (const int *)columns.getIndexArray(1).getData(),
+          (const double *)storage.getValues().getData()};
+}
+
+// An operand of the TACO drivers. <dir>/<name>.bin is preferred when present:
+// a CSR file read into a CSR tensor, or a dense file read into a dense vector,
+// is wrapped in place; other binary inputs are inserted into a new tensor of
+// the requested format. Without a binary file <dir>/<name>.ttx is parsed by
+// read_market_matrix and handled the same way, as CSR arrays.
+struct taco_operand_t {
+  std::unique_ptr<binary_matrix_t> file;
+  std::vector<int> pos_storage, idx_storage;
+  std::vector<double> val_storage;
+
+  taco::Tensor<double> load(const std::filesystem::path &dir, const std::string &name, const taco::Format &format) {
+    file.reset();
+    pos_storage = std::vector<int>();
+    idx_storage = std::vector<int>();
+    val_storage = std::vector<double>();
+
+    std::string bin = dir/(name + ".bin");
+    if (!binary_matrix_exists(bin)) {
+      return load_market(dir/(name + ".ttx"), name, format);
+    }
+    file = std::make_unique<binary_matrix_t>(bin);
+    const binary_matrix_header_t &header = file->header;
+    if (std::max({header.rows, header.cols, header.nnz}) > (uint64_t)std::numeric_limits<int>::max()) {
+      throw std::runtime_error(bin + " needs 64-bit indices, which TACO does not support");
+    }
+    int rows = header.rows;
+    int cols = header.cols;
+
+    if (header.layout == BINARY_DENSE) {
+      if (format.getOrder() != 1) {
+        throw std::runtime_error(bin + " is not a sparse matrix");
+      }
+      taco::Tensor<double> tensor(name, {rows}, format);
+      tensor.getStorage().setValues(taco::makeArray(file->val(), header.nnz));
+      return tensor;
+    }
+
+    int *pos = file->pos_as<int>(pos_storage);
+    int *idx = file->idx_as<int>(idx_storage);
+    if (header.layout == BINARY_CSR && format == taco::CSR) {
+      return taco::makeCSR<double>(name, {rows, cols}, pos, idx, file->val());
+    }
+
+    taco::Tensor<double> tensor(name, {rows, cols}, format);
+    for (uint64_t p = 0; p < file->outer(); p++) {
+      for (int q = pos[p]; q < pos[p + 1]; q++) {
+        if (header.layout == BINARY_CSR) {
+          tensor.insert({(int)p, idx[q]}, file->val()[q]);
+        } else {
+          tensor.insert({idx[q], (int)p}, file->val()[q]);
+        }
+      }
+    }
+    tensor.pack();
+    file.reset();
+    return tensor;
+  }
+
+private:
+  taco::Tensor<double> load_market(const std::string &path, const std::string &name, const taco::Format &format) {
+    if (format.getOrder() == 1) {
+      market_matrix_t<int> market = read_market_matrix<int>(path, BINARY_CSC);
+      if (market.cols != 1) {
+        throw std::runtime_error(path + " is not a vector");
+      }
+      taco::Tensor<double> tensor(name, {(int)market.rows}, format);
+      if (format == taco::Format({taco::Dense})) {
+        val_storage.assign(market.rows, 0.0);
+        for (int p = 0; p < market.pos[1]; p++) val_storage[market.idx[p]] = market.val[p];
+        tensor.getStorage().setValues(taco::makeArray(val_storage.data(), val_storage.size()));
+        return tensor;
+      }
+      for (int p = 0; p < market.pos[1]; p++) tensor.insert({market.idx[p]}, market.val[p]);
+      tensor.pack();
+      return tensor;
+    }
+
+    market_matrix_t<int> market = read_market_matrix<int>(path, BINARY_CSR);
+    int rows = market.rows;
+    int cols = market.cols;
+    if (format == taco::CSR) {
+      pos_storage = std::move(market.pos);
+      idx_storage = std::move(market.idx);
+      val_storage = std::move(market.val);
+      return taco::makeCSR<double>(name, {rows, cols}, pos_storage.data(), idx_storage.data(), val_storage.data());
+    }
+    taco::Tensor<double> tensor(name, {rows, cols}, format);
+    for (int i = 0; i < rows; i++) {
+      for (int q = market.pos[i]; q < market.pos[i + 1]; q++) tensor.insert({i, market.idx[q]}, market.val[q]);
+    }
+    tensor.pack();
+    return tensor;
+  }
+};
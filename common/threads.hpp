@@ -0,0 +1,140 @@
+#pragma once
+
+// Include after benchmark.hpp, which provides json.
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Thread counts swept by each run. Every count is timed separately and
+// reported under "scaling"; "time" stays the time at the first count so
+// existing consumers of measurements.json keep working.
+struct thread_sweep_t {
+  std::vector<int> counts = {1};
+  bool pin = false;
+
+  // Parse a comma separated list such as "1,2,4,8".
+  void parse(const std::string &list) {
+    std::vector<int> parsed;
+    std::istringstream items(list);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+      int count = std::stoi(item);
+      if (count < 1) {
+        throw std::invalid_argument("Invalid thread count " + item);
+      }
+      parsed.push_back(count);
+    }
+    if (parsed.empty()) {
+      throw std::invalid_argument("Empty thread count list");
+    }
+    counts = parsed;
+  }
+};
+
+#ifdef __linux__
+// The CPUs the process may run on, as they were the first time this is
+// called, which set_num_threads does before it pins anything.
+inline const cpu_set_t &initial_affinity() {
+  static const cpu_set_t initial = [] {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+      for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++) CPU_SET(cpu, &set);
+    }
+    return set;
+  }();
+  return initial;
+}
+
+// The CPUs of initial_affinity() in increasing order, so that under taskset
+// or a cpuset thread t is pinned to the t-th CPU it may use.
+inline const std::vector<int> &initial_cpus() {
+  static const std::vector<int> cpus = [] {
+    std::vector<int> cpus;
+    const cpu_set_t &initial = initial_affinity();
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &initial)) cpus.push_back(cpu);
+    }
+    return cpus;
+  }();
+  return cpus;
+}
+#endif
+
+// Size the OpenMP team, and with `pin` bind its thread t to the t-th CPU of
+// initial_affinity(). libgomp keeps the same workers between parallel
+// regions, so the binding also holds for the OpenMP regions inside MKL, Eigen
+// and TACO kernels, and for later runs; without `pin` every thread gets the
+// initial affinity back, undoing an earlier pinned sweep or NUMA placement.
+// Throws when a thread cannot be bound, and when pinning is asked for where
+// threads cannot be bound at all.
+inline void set_num_threads(int threads, bool pin) {
+#ifdef _OPENMP
+  omp_set_num_threads(threads);
+#ifdef __linux__
+  const cpu_set_t &initial = initial_affinity();
+  const std::vector<int> &cpus = initial_cpus();
+  int failed = 0;
+  #pragma omp parallel num_threads(threads) reduction(+:failed)
+  {
+    cpu_set_t set = initial;
+    if (pin) {
+      CPU_ZERO(&set);
+      CPU_SET(cpus[omp_get_thread_num() % cpus.size()], &set);
+    }
+    failed += sched_setaffinity(0, sizeof(set), &set) != 0;
+  }
+  if (failed > 0) {
+    throw std::runtime_error("Failed to set the CPU affinity of " + std::to_string(failed) + " of " +
+                             std::to_string(threads) + " threads");
+  }
+#else
+  if (pin) {
+    throw std::invalid_argument("Pinning threads is only supported on Linux");
+  }
+#endif
+#else
+  if (threads != 1) {
+    throw std::invalid_argument("Built without OpenMP, only 1 thread is supported");
+  }
+  if (pin) {
+    throw std::invalid_argument("Built without OpenMP, threads cannot be pinned");
+  }
+#endif
+}
+
+// Call measure(threads) for every count and collect what it returns: either
+// a time, or an object with a "time" and any further per-count measurements.
+// The fields measured at the first count are also copied to the top level.
+template <typename Measure>
+json sweep_threads(const thread_sweep_t &sweep, Measure measure) {
+  json measurements;
+  json scaling = json::array();
+  for (int threads : sweep.counts) {
+    set_num_threads(threads, sweep.pin);
+    json entry;
+    if constexpr (std::is_same_v<decltype(measure(threads)), json>) {
+      entry = measure(threads);
+    } else {
+      entry["time"] = measure(threads);
+    }
+    entry["threads"] = threads;
+    if (scaling.empty()) {
+      measurements.update(entry);
+    }
+    scaling.push_back(entry);
+  }
+  measurements["scaling"] = scaling;
+  measurements["pinned"] = sweep.pin;
+  return measurements;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+// Include after benchmark.hpp, which provides json.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// How the drivers sample the measured call. After `warmup` untimed calls,
+// calls are timed until there are at least min_reps samples and min_time
+// seconds have passed, setup and flushing included, up to max_reps samples.
+// The defaults are those of benchmark() from SparseRooflineBenchmark. With
+// `flush`, a buffer larger than the last level cache is streamed through
+// before every call, so each sample starts cold.
+struct timing_t {
+  int warmup = 0;
+  double min_time = 0.2;
+  int min_reps = 1;
+  int max_reps = 10000;
+  bool flush = false;
+
+  // Server form: <warmup> <min_time> <min_reps> [flush|noflush]
+  void set(const std::vector<std::string> &args) {
+    if (args.size() < 3) {
+      throw std::invalid_argument("Expected <warmup> <min_time> <min_reps> [flush]");
+    }
+    timing_t timing = *this;
+    timing.warmup = std::stoi(args[0]);
+    timing.min_time = std::stod(args[1]);
+    timing.min_reps = std::stoi(args[2]);
+    timing.flush = args.size() > 3 && args[3] == "flush";
+    if (timing.warmup < 0 || timing.min_time < 0 || timing.min_reps < 1) {
+      throw std::invalid_argument("Invalid timing settings");
+    }
+    *this = timing;
+  }
+};
+
+// Bytes of the last level cache, or 64 MiB when it cannot be determined.
+inline size_t last_level_cache_bytes() {
+  long bytes = 0;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+  bytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+  if (bytes <= 0) {
+    std::ifstream size("/sys/devices/system/cpu/cpu0/cache/index3/size");
+    std::string text;
+    if (size >> text) {
+      try {
+        bytes = std::stol(text);
+        if (text.back() == 'K') bytes <<= 10;
+        if (text.back() == 'M') bytes <<= 20;
+      } catch (const std::exception &e) {
+        bytes = 0;
+      }
+    }
+  }
+  return bytes > 0 ? bytes : 64 << 20;
+}
+
+// Write to every line of a buffer twice the size of the last level cache, from
+// all threads of the OpenMP team, so the operands of the next call are evicted
+// from the shared and the private caches alike.
+inline void flush_caches() {
+  static std::vector<unsigned char> buffer(2 * last_level_cache_bytes());
+  static unsigned char round = 0;
+  round++;
+  long long lines = buffer.size() / 64;
+  #pragma omp parallel for schedule(static)
+  for (long long line = 0; line < lines; line++) {
+    buffer[line * 64] += round;
+  }
+}
+
+// Order statistics of the samples, and a 95% bootstrap interval of the median
+// from 1000 resamples with a fixed seed.
+inline json sample_statistics(std::vector<long long> samples) {
+  json statistics;
+  if (samples.empty()) return statistics;
+  auto median_of = [](std::vector<long long> &values) {
+    size_t half = values.size() / 2;
+    std::nth_element(values.begin(), values.begin() + half, values.end());
+    double median = values[half];
+    if (values.size() % 2 == 0) {
+      median = (median + *std::max_element(values.begin(), values.begin() + half)) / 2;
+    }
+    return median;
+  };
+  std::vector<long long> sorted = samples;
+  std::sort(sorted.begin(), sorted.end());
+  double sum = 0;
+  for (long long sample : sorted) sum += sample;
+  size_t n = sorted.size();
+  statistics["reps"] = n;
+  statistics["min"] = sorted.front();
+  statistics["median"] = median_of(samples);
+  statistics["mean"] = sum / n;
+  statistics["p95"] = sorted[(size_t)std::ceil(0.95 * n) - 1];
+
+  const int resamples = 1000;
+  std::mt19937_64 generator(0);
+  std::uniform_int_distribution<size_t> pick(0, n - 1);
+  std::vector<double> medians(resamples);
+  std::vector<long long> resample(n);
+  for (int b = 0; b < resamples; b++) {
+    for (size_t s = 0; s < n; s++) resample[s] = sorted[pick(generator)];
+    medians[b] = median_of(resample);
+  }
+  std::sort(medians.begin(), medians.end());
+  statistics["median_ci"] = {medians[resamples * 25 / 1000], medians[resamples * 975 / 1000 - 1]};
+  return statistics;
+}
+
+// Time test() as configured, or exactly `reps` times when reps > 0, calling
+// setup() untimed before each call. Returns the fastest sample as "time", so
+// existing consumers keep working, and under "timing" every sample in
+// nanoseconds together with their statistics.
+template <typename Setup, typename Test>
+json benchmark_samples(const timing_t &timing, Setup setup, Test test, int reps = 0) {
+  for (int trial = 0; trial < timing.warmup; trial++) {
+    setup();
+    test();
+  }
+  int min_reps = reps > 0 ? reps : timing.min_reps;
+  int max_reps = reps > 0 ? reps : std::max(timing.max_reps, timing.min_reps);
+  auto min_time = std::chrono::duration<double>(reps > 0 ? 0.0 : timing.min_time);
+  std::vector<long long> samples;
+  auto start = std::chrono::high_resolution_clock::now();
+  while ((int)samples.size() < max_reps) {
+    setup();
+    if (timing.flush) flush_caches();
+    auto tic = std::chrono::high_resolution_clock::now();
+    test();
+    auto toc = std::chrono::high_resolution_clock::now();
+    samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(toc - tic).count());
+    if ((int)samples.size() >= min_reps && toc - start >= min_time) break;
+  }
+
+  json entry;
+  entry["time"] = *std::min_element(samples.begin(), samples.end());
+  json statistics = sample_statistics(samples);
+  statistics["warmup"] = timing.warmup;
+  statistics["flushed"] = timing.flush;
+  statistics["samples"] = samples;
+  entry["timing"] = statistics;
+  return entry;
+}
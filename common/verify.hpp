@@ -0,0 +1,405 @@
+#pragma once
+
+// Include after benchmark.hpp, which provides json.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "binary_matrix.hpp"
+#include "market_matrix.hpp"
+#include "rhs_block.hpp"
+
+// In-driver checking of SpMV and SpGEMM results, so that a run only has to
+// write its output when the caller wants the values themselves.
+//
+// The reference is <dir>/y_ref.bin, Y_ref.bin or C_ref.bin when the harness
+// wrote one, and is otherwise computed here from the operands in <dir> with a
+// plain row-by-row kernel. An output passes when its largest absolute
+// difference from the reference is at most `tolerance` times the largest
+// reference magnitude, which is robust to the summation order of the kernel
+// under test. Independently of verification, output_checksum() identifies an
+// output in measurements.json.
+
+using verify_matrix_t = market_matrix_t<int64_t>;
+
+// Sum, absolute sum and FNV-1a hash of the bits of n values. The hash only
+// matches for bitwise identical outputs, so compare the sums across kernels
+// or thread counts that reduce in another order.
+inline json output_checksum(const double *val, size_t n) {
+  double sum = 0;
+  double abs_sum = 0;
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t p = 0; p < n; p++) {
+    sum += val[p];
+    abs_sum += std::fabs(val[p]);
+    unsigned char bytes[sizeof(double)];
+    std::memcpy(bytes, &val[p], sizeof(double));
+    for (unsigned char byte : bytes) {
+      hash = (hash ^ byte) * 0x100000001b3ull;
+    }
+  }
+  char text[17];
+  std::snprintf(text, sizeof(text), "%016" PRIx64, hash);
+  return {{"values", n}, {"sum", sum}, {"abs_sum", abs_sum}, {"hash", text}};
+}
+
+namespace verify_detail {
+
+// The same matrix in the other compressed layout, by a counting sort over
+// the inner dimension. Inner indices come out sorted.
+inline verify_matrix_t switch_layout(const verify_matrix_t &M, binary_layout_t from) {
+  uint64_t outer = from == BINARY_CSR ? M.rows : M.cols;
+  uint64_t inner = from == BINARY_CSR ? M.cols : M.rows;
+  verify_matrix_t T;
+  T.rows = M.rows;
+  T.cols = M.cols;
+  T.pos.assign(inner + 1, 0);
+  T.idx.resize(M.nnz());
+  T.val.resize(M.nnz());
+  for (int64_t i : M.idx) T.pos[i + 1]++;
+  for (uint64_t i = 0; i < inner; i++) T.pos[i + 1] += T.pos[i];
+  std::vector<int64_t> next(T.pos.begin(), T.pos.end() - 1);
+  for (uint64_t o = 0; o < outer; o++) {
+    for (int64_t p = M.pos[o]; p < M.pos[o + 1]; p++) {
+      int64_t q = next[M.idx[p]]++;
+      T.idx[q] = o;
+      T.val[q] = M.val[p];
+    }
+  }
+  return T;
+}
+
+// Operand <dir>/<name> in `layout` (CSR or CSC), from <name>.bin in any
+// layout or from <name>.ttx.
+inline verify_matrix_t load_matrix(const std::string &dir, const std::string &name, binary_layout_t layout) {
+  std::string bin = dir + "/" + name + ".bin";
+  if (!binary_matrix_exists(bin)) {
+    return read_market_matrix<int64_t>(dir + "/" + name + ".ttx", layout);
+  }
+  binary_matrix_t file(bin);
+  verify_matrix_t M;
+  M.rows = file.header.rows;
+  M.cols = file.header.cols;
+  binary_layout_t stored = (binary_layout_t)file.header.layout;
+  if (stored == BINARY_DENSE) {
+    // Dense operands are column-major
+    stored = BINARY_CSC;
+    M.pos.push_back(0);
+    for (uint64_t j = 0; j < M.cols; j++) {
+      for (uint64_t i = 0; i < M.rows; i++) {
+        double v = file.val()[j * M.rows + i];
+        if (v != 0) {
+          M.idx.push_back(i);
+          M.val.push_back(v);
+        }
+      }
+      M.pos.push_back(M.idx.size());
+    }
+  } else {
+    std::vector<int64_t> pos_storage, idx_storage;
+    const int64_t *pos = file.pos_as<int64_t>(pos_storage);
+    const int64_t *idx = file.idx_as<int64_t>(idx_storage);
+    M.pos.assign(pos, pos + file.outer() + 1);
+    M.idx.assign(idx, idx + file.header.nnz);
+    M.val.assign(file.val(), file.val() + file.header.nnz);
+  }
+  return stored == layout ? M : switch_layout(M, stored);
+}
+
+// CSR arrays of operand <dir>/<name>, or of its transpose, which are its
+// CSC arrays.
+inline verify_matrix_t load_csr(const std::string &dir, const std::string &name, bool transpose) {
+  if (!transpose) {
+    return load_matrix(dir, name, BINARY_CSR);
+  }
+  verify_matrix_t M = load_matrix(dir, name, BINARY_CSC);
+  std::swap(M.rows, M.cols);
+  return M;
+}
+
+// Dense vector <dir>/<name>, from <name>.bin or <name>.ttx.
+inline std::vector<double> load_vector(const std::string &dir, const std::string &name) {
+  std::string bin = dir + "/" + name + ".bin";
+  if (binary_matrix_exists(bin)) {
+    binary_matrix_t file(bin);
+    if (file.header.layout != BINARY_DENSE) {
+      throw std::runtime_error(bin + " is not a dense vector");
+    }
+    return std::vector<double>(file.val(), file.val() + file.header.nnz);
+  }
+  verify_matrix_t M = read_market_matrix<int64_t>(dir + "/" + name + ".ttx", BINARY_CSC);
+  if (M.cols != 1) {
+    throw std::runtime_error(dir + "/" + name + ".ttx is not a vector");
+  }
+  std::vector<double> x(M.rows, 0);
+  for (int64_t p = 0; p < M.pos[1]; p++) x[M.idx[p]] = M.val[p];
+  return x;
+}
+
+// The symmetric CSR matrix whose upper triangle is that of A. The lower
+// triangle of A is ignored, like the symmetric kernels do.
+inline verify_matrix_t mirror_upper(const verify_matrix_t &A) {
+  verify_matrix_t U;
+  U.rows = A.rows;
+  U.cols = A.cols;
+  U.pos.push_back(0);
+  for (uint64_t i = 0; i < A.rows; i++) {
+    for (int64_t p = A.pos[i]; p < A.pos[i + 1]; p++) {
+      if ((uint64_t)A.idx[p] >= i) {
+        U.idx.push_back(A.idx[p]);
+        U.val.push_back(A.val[p]);
+      }
+    }
+    U.pos.push_back(U.idx.size());
+  }
+  // Row i of L holds column i of U, the diagonal last
+  verify_matrix_t L = switch_layout(U, BINARY_CSR);
+  verify_matrix_t S;
+  S.rows = A.rows;
+  S.cols = A.cols;
+  S.pos.push_back(0);
+  for (uint64_t i = 0; i < A.rows; i++) {
+    S.idx.insert(S.idx.end(), L.idx.begin() + L.pos[i], L.idx.begin() + L.pos[i + 1]);
+    S.val.insert(S.val.end(), L.val.begin() + L.pos[i], L.val.begin() + L.pos[i + 1]);
+    if (L.pos[i + 1] > L.pos[i] && (uint64_t)L.idx[L.pos[i + 1] - 1] == i) {
+      S.idx.pop_back();
+      S.val.pop_back();
+    }
+    S.idx.insert(S.idx.end(), U.idx.begin() + U.pos[i], U.idx.begin() + U.pos[i + 1]);
+    S.val.insert(S.val.end(), U.val.begin() + U.pos[i], U.val.begin() + U.pos[i + 1]);
+    S.pos.push_back(S.idx.size());
+  }
+  return S;
+}
+
+// C = A * B in CSR with sorted columns, rows in parallel: one pass counts
+// the columns of each row, the next fills them.
+inline verify_matrix_t multiply(const verify_matrix_t &A, const verify_matrix_t &B) {
+  if (A.cols != B.rows) {
+    throw std::runtime_error("A and B do not conform");
+  }
+  verify_matrix_t C;
+  C.rows = A.rows;
+  C.cols = B.cols;
+  C.pos.assign(C.rows + 1, 0);
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      for (uint64_t i = 0; i < C.rows; i++) C.pos[i + 1] += C.pos[i];
+      C.idx.resize(C.pos[C.rows]);
+      C.val.resize(C.pos[C.rows]);
+    }
+    #pragma omp parallel
+    {
+      std::vector<int64_t> mark(C.cols, -1);
+      std::vector<double> sums(C.cols, 0);
+      std::vector<int64_t> cols;
+      #pragma omp for schedule(dynamic, 64)
+      for (int64_t i = 0; i < (int64_t)C.rows; i++) {
+        cols.clear();
+        for (int64_t p = A.pos[i]; p < A.pos[i + 1]; p++) {
+          int64_t k = A.idx[p];
+          for (int64_t q = B.pos[k]; q < B.pos[k + 1]; q++) {
+            int64_t j = B.idx[q];
+            if (mark[j] != i) {
+              mark[j] = i;
+              sums[j] = 0;
+              cols.push_back(j);
+            }
+            sums[j] += A.val[p] * B.val[q];
+          }
+        }
+        if (pass == 0) {
+          C.pos[i + 1] = cols.size();
+          continue;
+        }
+        std::sort(cols.begin(), cols.end());
+        int64_t q = C.pos[i];
+        for (int64_t j : cols) {
+          C.idx[q] = j;
+          C.val[q++] = sums[j];
+        }
+      }
+    }
+  }
+  return C;
+}
+
+} // namespace verify_detail
+
+struct verify_t {
+  // Compare each run's output with a reference.
+  bool enabled = false;
+  // Largest difference allowed, relative to the largest reference magnitude.
+  double tolerance = 1e-9;
+
+  // Server form: on [tolerance] | off
+  void set(const std::vector<std::string> &args) {
+    if (args.empty() || (args[0] != "on" && args[0] != "off")) {
+      throw std::invalid_argument("Expected on [tolerance] | off");
+    }
+    double next = args.size() > 1 ? std::stod(args[1]) : tolerance;
+    if (!(next >= 0)) {
+      throw std::invalid_argument("Invalid tolerance");
+    }
+    enabled = args[0] == "on";
+    tolerance = next;
+  }
+
+  // Check the row-major n x k output Y of Y = A * X, or of Y = A^T * X with
+  // `transpose`, against <dir>/y_ref.bin (k = 1) or Y_ref.bin, or against
+  // the product of A and x in <dir>, X being the block load_rhs_block()
+  // derives from x. With `symmetric` only the upper triangle of A is used,
+  // mirrored, as the symmetric kernels do.
+  json spmv(const std::string &dir, const double *Y, uint64_t n, int k, bool transpose, bool symmetric) const {
+    std::string name = k == 1 ? "y_ref" : "Y_ref";
+    std::string bin = dir + "/" + name + ".bin";
+    std::vector<double> reference(n * k, 0);
+    if (binary_matrix_exists(bin)) {
+      binary_matrix_t file(bin);
+      if (file.header.layout != BINARY_DENSE || file.header.rows != n || file.header.cols != (uint64_t)k) {
+        throw std::runtime_error(bin + " is not a dense " + std::to_string(n) + " x " + std::to_string(k) + " matrix");
+      }
+      for (uint64_t i = 0; i < n; i++) {
+        for (int c = 0; c < k; c++) reference[i * k + c] = file.val()[c * n + i];
+      }
+    } else {
+      name = "computed";
+      // The CSC arrays of A are the CSR arrays of A^T
+      verify_matrix_t A = verify_detail::load_matrix(dir, "A", transpose && !symmetric ? BINARY_CSC : BINARY_CSR);
+      uint64_t rows = transpose ? A.cols : A.rows;
+      uint64_t cols = transpose ? A.rows : A.cols;
+      if (symmetric) {
+        if (A.rows != A.cols) {
+          throw std::runtime_error("Symmetric mode needs a square matrix");
+        }
+        A = verify_detail::mirror_upper(A);
+      }
+      std::vector<double> x = verify_detail::load_vector(dir, "x");
+      if (rows != n || x.size() != cols) {
+        throw std::runtime_error("Output and operands in " + dir + " do not conform");
+      }
+      std::vector<double> X = k == 1 ? x : load_rhs_block(dir, x.data(), cols, k);
+      #pragma omp parallel for schedule(dynamic, 256)
+      for (int64_t i = 0; i < (int64_t)rows; i++) {
+        for (int64_t p = A.pos[i]; p < A.pos[i + 1]; p++) {
+          for (int c = 0; c < k; c++) reference[i * k + c] += A.val[p] * X[A.idx[p] * k + c];
+        }
+      }
+    }
+    json result = compare_dense(Y, reference.data(), n * k);
+    result["reference"] = name;
+    return result;
+  }
+
+  // Check C = A * B, stored in `layout` (CSR or CSC) with Int indices,
+  // against <dir>/C_ref.bin or the product of A and B in <dir>, where
+  // transpose_a or transpose_b mean that <dir> holds A^T or B^T. Entries
+  // missing from one side count as zeros there, so explicit zeros in C do
+  // not fail it, and inner indices need not be sorted.
+  template <typename Int>
+  json spgemm(const std::string &dir, binary_layout_t layout, uint64_t rows, uint64_t cols,
+              const Int *pos, const Int *idx, const double *val,
+              bool transpose_a = false, bool transpose_b = false) const {
+    std::string name;
+    verify_matrix_t C = reference_spgemm(dir, layout, transpose_a, transpose_b, name);
+    if (C.rows != rows || C.cols != cols) {
+      throw std::runtime_error("C does not conform to the reference");
+    }
+    uint64_t outer = layout == BINARY_CSR ? rows : cols;
+    double scale = 0;
+    for (double v : C.val) scale = std::max(scale, std::fabs(v));
+    double max_error = 0;
+    uint64_t mismatches = 0;
+    std::vector<std::pair<Int, double>> entries;
+    for (uint64_t o = 0; o < outer; o++) {
+      entries.clear();
+      for (Int p = pos[o]; p < pos[o + 1]; p++) entries.emplace_back(idx[p], val[p]);
+      std::sort(entries.begin(), entries.end(),
+                [](const std::pair<Int, double> &a, const std::pair<Int, double> &b) { return a.first < b.first; });
+      size_t p = 0;
+      int64_t q = C.pos[o];
+      while (p < entries.size() || q < C.pos[o + 1]) {
+        double difference;
+        if (q == C.pos[o + 1] || (p < entries.size() && entries[p].first < C.idx[q])) {
+          difference = entries[p++].second;
+        } else if (p == entries.size() || C.idx[q] < entries[p].first) {
+          difference = C.val[q++];
+        } else {
+          // Duplicates in C are summed before they are compared
+          double sum = 0;
+          for (Int i = entries[p].first; p < entries.size() && entries[p].first == i; p++) sum += entries[p].second;
+          difference = sum - C.val[q++];
+        }
+        note_error(std::fabs(difference), scale, max_error, mismatches);
+      }
+    }
+    json result = summarize(max_error, scale, mismatches);
+    result["reference"] = name;
+    result["nnz"] = (uint64_t)pos[outer];
+    result["reference_nnz"] = C.nnz();
+    return result;
+  }
+
+  // Check a dense row-major C = A * B against the reference.
+  json spgemm_dense(const std::string &dir, uint64_t rows, uint64_t cols, const double *val,
+                    bool transpose_a = false, bool transpose_b = false) const {
+    std::string name;
+    verify_matrix_t C = reference_spgemm(dir, BINARY_CSR, transpose_a, transpose_b, name);
+    if (C.rows != rows || C.cols != cols) {
+      throw std::runtime_error("C does not conform to the reference");
+    }
+    std::vector<double> reference(rows * cols, 0);
+    for (uint64_t i = 0; i < rows; i++) {
+      for (int64_t p = C.pos[i]; p < C.pos[i + 1]; p++) reference[i * cols + C.idx[p]] += C.val[p];
+    }
+    json result = compare_dense(val, reference.data(), rows * cols);
+    result["reference"] = name;
+    return result;
+  }
+
+private:
+  verify_matrix_t reference_spgemm(const std::string &dir, binary_layout_t layout, bool transpose_a, bool transpose_b,
+                                   std::string &name) const {
+    name = "C_ref";
+    if (binary_matrix_exists(dir + "/C_ref.bin")) {
+      return verify_detail::load_matrix(dir, "C_ref", layout);
+    }
+    name = "computed";
+    verify_matrix_t C = verify_detail::multiply(verify_detail::load_csr(dir, "A", transpose_a),
+                                                verify_detail::load_csr(dir, "B", transpose_b));
+    return layout == BINARY_CSR ? C : verify_detail::switch_layout(C, BINARY_CSR);
+  }
+
+  json compare_dense(const double *val, const double *reference, uint64_t n) const {
+    double scale = 0;
+    for (uint64_t p = 0; p < n; p++) scale = std::max(scale, std::fabs(reference[p]));
+    double max_error = 0;
+    uint64_t mismatches = 0;
+    for (uint64_t p = 0; p < n; p++) note_error(std::fabs(val[p] - reference[p]), scale, max_error, mismatches);
+    return summarize(max_error, scale, mismatches);
+  }
+
+  // A NaN error is a mismatch and makes the maximum NaN, so it never passes.
+  void note_error(double error, double scale, double &max_error, uint64_t &mismatches) const {
+    if (!(error <= tolerance * scale)) mismatches++;
+    if (!(error <= max_error) && !std::isnan(max_error)) max_error = error;
+  }
+
+  json summarize(double max_error, double scale, uint64_t mismatches) const {
+    double relative_error = scale > 0 ? max_error / scale : max_error;
+    return {
+      {"max_error", max_error},
+      {"relative_error", relative_error},
+      {"tolerance", tolerance},
+      {"mismatches", mismatches},
+      {"passed", relative_error <= tolerance},
+    };
+  }
+};
@@ -0,0 +1,359 @@
+#include <algorithm>
+#include <chrono>
+#include <sys/stat.h>
+#include <iostream>
+#include <cstdint>
+#include <vector>
+#include "../deps/SparseRooflineBenchmark/src/benchmark.hpp"
+#include "../common/server.hpp"
+#include "../common/threads.hpp"
+#include "../common/memory.hpp"
+#include "../common/perf_counters.hpp"
+#include "../common/timing.hpp"
+#include "../common/eigen_operand.hpp"
+#include "../common/csr_view.hpp"
+#include "../common/options.hpp"
+
+extern int optind;
+
+// Direction-optimizing breadth-first search (Beamer, Asanovic and Patterson).
+// Row v of A lists the out-neighbors of vertex v. Levels expand top-down from
+// a queue, each thread claiming unvisited neighbors with a compare-and-swap,
+// until the frontier's out-edges exceed the unexplored edges / alpha. Then
+// levels run bottom-up: every unvisited vertex scans its in-neighbors for one
+// in the frontier bitmap, until the frontier falls below n / beta and stops
+// growing.
+struct bfs_t {
+  enum direction_t { TOP_DOWN, BOTTOM_UP };
+
+  struct level_t {
+    direction_t direction;
+    sparse_index_t frontier;
+    long long edges;
+    long long time;
+  };
+
+  int alpha = 15;
+  int beta = 18;
+  std::vector<sparse_index_t> parent;
+  std::vector<sparse_index_t> queue, next_queue;
+  std::vector<uint64_t> front, next;
+  std::vector<level_t> levels;
+
+  static bool test(const std::vector<uint64_t> &bits, sparse_index_t v) {
+    return bits[v >> 6] >> (v & 63) & 1;
+  }
+
+  // Expand queue[0, size) into next_queue and return its size. scout becomes
+  // the out-degree sum of the new frontier.
+  sparse_index_t top_down(const csr_view_t &out, sparse_index_t size, long long &scout, long long &edges) {
+    sparse_index_t tail = 0;
+    long long new_scout = 0, examined = 0;
+    #pragma omp parallel reduction(+:new_scout, examined)
+    {
+      std::vector<sparse_index_t> local;
+      #pragma omp for schedule(dynamic, 64) nowait
+      for (sparse_index_t q = 0; q < size; q++) {
+        sparse_index_t u = queue[q];
+        for (sparse_index_t p = out.pos[u]; p < out.pos[u + 1]; p++) {
+          sparse_index_t v = out.idx[p];
+          sparse_index_t unvisited = parent[v];
+          if (unvisited < 0 &&
+              __atomic_compare_exchange_n(&parent[v], &unvisited, u, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            local.push_back(v);
+            new_scout += out.pos[v + 1] - out.pos[v];
+          }
+        }
+        examined += out.pos[u + 1] - out.pos[u];
+      }
+      sparse_index_t offset = __atomic_fetch_add(&tail, (sparse_index_t)local.size(), __ATOMIC_RELAXED);
+      std::copy(local.begin(), local.end(), next_queue.begin() + offset);
+    }
+    queue.swap(next_queue);
+    scout = new_scout;
+    edges += examined;
+    return tail;
+  }
+
+  // Visit every unvisited vertex with an in-neighbor in `front`, mark it in
+  // `next`, and return how many were found. A task owns whole bitmap words.
+  sparse_index_t bottom_up(const csr_view_t &in, long long &edges) {
+    sparse_index_t n = in.rows;
+    sparse_index_t words = front.size();
+    sparse_index_t awake = 0;
+    long long examined = 0;
+    #pragma omp parallel for schedule(dynamic, 16) reduction(+:awake, examined)
+    for (sparse_index_t w = 0; w < words; w++) {
+      uint64_t bits = 0;
+      for (sparse_index_t v = w * 64; v < std::min(n, w * 64 + 64); v++) {
+        if (parent[v] >= 0) continue;
+        for (sparse_index_t p = in.pos[v]; p < in.pos[v + 1]; p++) {
+          sparse_index_t u = in.idx[p];
+          examined++;
+          if (test(front, u)) {
+            parent[v] = u;
+            bits |= 1ull << (v & 63);
+            awake++;
+            break;
+          }
+        }
+      }
+      next[w] = bits;
+    }
+    front.swap(next);
+    edges += examined;
+    return awake;
+  }
+
+  void queue_to_bitmap(sparse_index_t size) {
+    std::fill(front.begin(), front.end(), 0);
+    #pragma omp parallel for schedule(static)
+    for (sparse_index_t q = 0; q < size; q++) {
+      sparse_index_t v = queue[q];
+      __atomic_fetch_or(&front[v >> 6], 1ull << (v & 63), __ATOMIC_RELAXED);
+    }
+  }
+
+  sparse_index_t bitmap_to_queue() {
+    sparse_index_t tail = 0;
+    sparse_index_t words = front.size();
+    #pragma omp parallel
+    {
+      std::vector<sparse_index_t> local;
+      #pragma omp for schedule(static) nowait
+      for (sparse_index_t w = 0; w < words; w++) {
+        for (uint64_t bits = front[w]; bits; bits &= bits - 1) {
+          local.push_back(w * 64 + __builtin_ctzll(bits));
+        }
+      }
+      sparse_index_t offset = __atomic_fetch_add(&tail, (sparse_index_t)local.size(), __ATOMIC_RELAXED);
+      std::copy(local.begin(), local.end(), queue.begin() + offset);
+    }
+    return tail;
+  }
+
+  void search(const csr_view_t &out, const csr_view_t &in, sparse_index_t source) {
+    sparse_index_t n = out.rows;
+    parent.assign(n, -1);
+    queue.resize(n);
+    next_queue.resize(n);
+    front.assign((n + 63) / 64, 0);
+    next.assign(front.size(), 0);
+    levels.clear();
+
+    parent[source] = source;
+    queue[0] = source;
+    sparse_index_t size = 1;
+    long long scout = out.pos[source + 1] - out.pos[source];
+    long long unexplored = out.pos[n];
+    while (size > 0) {
+      if (scout > unexplored / alpha) {
+        auto tic = std::chrono::high_resolution_clock::now();
+        queue_to_bitmap(size);
+        sparse_index_t awake = size;
+        sparse_index_t previous;
+        do {
+          previous = awake;
+          level_t level = {BOTTOM_UP, awake, 0, 0};
+          awake = bottom_up(in, level.edges);
+          auto toc = std::chrono::high_resolution_clock::now();
+          level.time = std::chrono::duration_cast<std::chrono::nanoseconds>(toc - tic).count();
+          levels.push_back(level);
+          tic = toc;
+        } while (awake > 0 && (awake >= previous || awake > n / beta));
+        size = bitmap_to_queue();
+        scout = 1;
+        levels.back().time += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::high_resolution_clock::now() - tic).count();
+      } else {
+        auto tic = std::chrono::high_resolution_clock::now();
+        level_t level = {TOP_DOWN, size, 0, 0};
+        unexplored -= scout;
+        size = top_down(out, size, scout, level.edges);
+        level.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::high_resolution_clock::now() - tic).count();
+        levels.push_back(level);
+      }
+    }
+  }
+
+  size_t workspace_bytes() const {
+    return (parent.capacity() + queue.capacity() + next_queue.capacity()) * sizeof(sparse_index_t) +
+           (front.capacity() + next.capacity()) * sizeof(uint64_t);
+  }
+};
+
+struct bfs_native_t {
+  thread_sweep_t threads;
+  // Also read hardware counters around the measured call.
+  bool counters = false;
+  // Warmup, sample count and cache flushing of the measured call.
+  timing_t timing;
+  sparse_index_t source = 0;
+  eigen_operand_t<Eigen::RowMajor> A;
+  // Row v of AT lists the in-neighbors of v, for the bottom-up levels.
+  Eigen::SparseMatrix<double, Eigen::RowMajor, sparse_index_t> AT;
+  bfs_t bfs;
+
+  void load(const std::string &input) {
+    A.load(input, "A");
+    if (A->rows() != A->cols()) {
+      throw std::runtime_error("The adjacency matrix must be square");
+    }
+    AT = A->transpose();
+  }
+
+  json run(const std::string &output, int reps) {
+    if (source < 0 || source >= A->rows()) {
+      throw std::invalid_argument("Source vertex out of range");
+    }
+    csr_view_t out = csr_view(*A);
+    csr_view_t in = csr_view(AT);
+    auto setup = []() {};
+    auto test = [&]() {
+      bfs.search(out, in, source);
+    };
+    // Graph500 counts the edges of the component reached from the source
+    long long traversed = 0;
+    json measurements = sweep_threads(threads, [&](int) {
+      json entry;
+      entry.update(benchmark_samples(timing, setup, test, reps));
+      traversed = 0;
+      for (sparse_index_t v = 0; v < out.rows; v++) {
+        if (bfs.parent[v] >= 0) traversed += out.pos[v + 1] - out.pos[v];
+      }
+      entry["teps"] = traversed / (entry["time"].get<double>() * 1e-9);
+      if (counters) entry.update(measure_counters(timing, setup, test, reps));
+      return entry;
+    });
+    record_memory(measurements, measure_memory(setup, test), {
+      {"A", eigen_structure_bytes(*A)},
+      {"AT", eigen_structure_bytes(AT)},
+      {"frontier", structure_bytes(bfs.workspace_bytes(), 0)},
+    });
+
+    json levels = json::array();
+    long long examined = 0;
+    for (const bfs_t::level_t &level : bfs.levels) {
+      levels.push_back({
+        {"direction", level.direction == bfs_t::TOP_DOWN ? "top-down" : "bottom-up"},
+        {"frontier", level.frontier},
+        {"edges_examined", level.edges},
+        {"time", level.time},
+      });
+      examined += level.edges;
+    }
+    measurements["source"] = source;
+    measurements["alpha"] = bfs.alpha;
+    measurements["beta"] = bfs.beta;
+    measurements["reached"] = std::count_if(bfs.parent.begin(), bfs.parent.end(), [](sparse_index_t p) { return p >= 0; });
+    measurements["edges_traversed"] = traversed;
+    measurements["edges_examined"] = examined;
+    measurements["depth"] = bfs.levels.size();
+    measurements["levels"] = levels;
+    std::ofstream measurements_file(output + "/measurements.json");
+    measurements_file << measurements;
+    measurements_file.close();
+    return measurements;
+  }
+
+  // Write the parent of every vertex, one-based with 0 for unreached vertices
+  // and the source as its own parent.
+  void fetch(const std::string &output) {
+    Eigen::VectorXd parent(bfs.parent.size());
+    for (size_t v = 0; v < bfs.parent.size(); v++) parent[v] = bfs.parent[v] + 1;
+    Eigen::SparseMatrix<double> sparseParent = Eigen::MatrixXd(parent).sparseView();
+    Eigen::saveMarket(sparseParent, (output + "/parent.ttx").c_str());
+  }
+};
+
+int main(int argc, char **argv) {
+  auto params = parse(argc, argv);
+
+  bfs_native_t bfs;
+  common_options_t options(bfs.threads, bfs.counters, bfs.timing);
+
+  std::vector<option> long_options = options.long_options({
+    {"help", no_argument, 0, 'h'},
+    {"source", required_argument, 0, 's'},
+    {"alpha", required_argument, 0, 'a'},
+    {"beta", required_argument, 0, 'b'},
+  });
+  std::string short_options = options.short_options("hs:a:b:");
+
+  // Parse the options
+  int option_index = 0;
+  int c;
+  optind = 1;
+  while ((c = getopt_long(params.argc, params.argv, short_options.c_str(), long_options.data(), &option_index)) != -1) {
+    switch (c) {
+      case 'h':
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -h, --help      Print this help message" << std::endl;
+        std::cout << "  -s, --source    Zero-based source vertex (default 0)" << std::endl;
+        std::cout << "  -a, --alpha     Go bottom-up when frontier edges exceed unexplored edges / alpha (default 15)" << std::endl;
+        std::cout << "  -b, --beta      Go top-down when the frontier shrinks below n / beta (default 18)" << std::endl;
+        options.help(18, "load/source/run/fetch");
+        exit(0);
+      case 's':
+        try {
+          bfs.source = std::stoll(optarg);
+        } catch (const std::exception &e) {
+          std::cerr << "Invalid source" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'a':
+        try {
+          bfs.bfs.alpha = std::stoi(optarg);
+        } catch (const std::exception &e) {
+          std::cerr << "Invalid alpha" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'b':
+        try {
+          bfs.bfs.beta = std::stoi(optarg);
+        } catch (const std::exception &e) {
+          std::cerr << "Invalid beta" << std::endl;
+          exit(1);
+        }
+        break;
+      case '?':
+        // getopt_long already printed an error message
+        break;
+      default:
+        if (!options.parse(c, optarg)) abort();
+    }
+  }
+
+  if (bfs.bfs.alpha < 1 || bfs.bfs.beta < 1) {
+    std::cerr << "alpha and beta must be positive" << std::endl;
+    exit(1);
+  }
+
+  std::map<std::string, server_command_t> commands = {
+    {"load", [&](const server_args_t &args) { bfs.load(server_arg(args, 0, "input dir")); return json(); }},
+    {"source", [&](const server_args_t &args) { bfs.source = std::stoll(server_arg(args, 0, "vertex")); return json(); }},
+    {"run", [&](const server_args_t &args) { return bfs.run(server_arg(args, 0, "output dir"), server_reps(args, 1)); }},
+    {"fetch", [&](const server_args_t &args) { bfs.fetch(server_arg(args, 0, "output dir")); return json(); }},
+  };
+  options.add_commands(commands);
+  if (options.server) return serve(commands);
+
+  // Check that all required options are present
+  if (params.input.empty() || params.output.empty()) {
+    std::cerr << "Missing required option" << std::endl;
+    exit(1);
+  }
+
+  try {
+    bfs.load(params.input);
+    bfs.run(params.output, 0);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+  bfs.fetch(params.output);
+  return 0;
+}
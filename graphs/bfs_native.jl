@@ -0,0 +1,21 @@
+using TensorMarket
+function bfs_native(A; source=1)
+    tmpdir = mktempdir(@__DIR__, prefix="experiment_")
+    A_path = joinpath(tmpdir, "A.bin")
+    parent_path = joinpath(tmpdir, "parent.ttx")
+    # Row v of the driver's A lists the out-neighbors of v, which are column v
+    # here, so the CSC arrays of A are written as the CSR arrays of its transpose
+    (n, n) = size(A)
+    Ti = binary_index_type(A)
+    write_binary_arrays(A_path, BINARY_CSR, n, n, Ti.(A.colptr .- 1), Ti.(A.rowval .- 1), ones(nnz(A)))
+    bfs_path = joinpath(@__DIR__, "bfs_native")
+    server = driver_server(`$bfs_path -- --server`)
+    driver_request(server, "load", tmpdir)
+    driver_request(server, "source", source - 1)
+    measurements = driver_request(server, "run", tmpdir)
+    driver_request(server, "fetch", tmpdir)
+    parent = Int.(Vector(reshape(SparseMatrixCSC(fread(parent_path)), :)))
+    return (;time=measurements["time"]*10^-9, mem=Base.summarysize(A), output=parent, teps=measurements["teps"], levels=measurements["levels"], scaling=measurements["scaling"])
+end
+
+has_bfs_native() = isfile(joinpath(@__DIR__, "bfs_native"))
@@ -1,82 +1,493 @@
 #include <iostream>
 #include <fstream>
-#include <set>
 #include <vector>
-#include <random>
+#include <string>
+#include <cstdint>
+#include <cstdio>
 #include <algorithm>
+#include <cmath>
+#include <getopt.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "../common/binary_matrix.hpp"
 
-void generate_rmat_graph(int scale, int avg_edges_per_vertex) {
-    int num_vertices = 1 << scale;  // 2^scale
-    int num_edges = num_vertices * avg_edges_per_vertex;
-
-    // Using a set to store unique edges (src, dst)
-    std::set<std::pair<int, int>> edges;
-
-    // Random number generator for weights
-    std::default_random_engine generator;
-    std::uniform_real_distribution<double> weight_distribution(0.0, 1.0); // Weights between 0 and 1
-
-    // Edge generation parameters
-    double a = 0.57, b = 0.19, c = 0.19, d = 0.05;
-
-    while (edges.size() < num_edges) {
-        int src = 1, dst = 1;
-        int stride = num_vertices / 2;
-
-        for (int i = 0; i < scale; ++i) {
-            double rand_val = static_cast<double>(rand()) / RAND_MAX;
-            if (rand_val < a) {
-                // Stay in top-left quadrant
-            } else if (rand_val < a + b) {
-                // Move to top-right quadrant
-                dst += stride;
-            } else if (rand_val < a + b + c) {
-                // Move to bottom-left quadrant
+// Parallel R-MAT generator. Every draw comes from a counter-based hash of the
+// seed and its position, so the graph depends only on the seed and never on
+// the number of threads. The source vertices are split into ranges by their
+// top bits, each drawn from the R-MAT distribution conditioned on those bits
+// at a rate proportional to its probability, and the graph is the first
+// num_edges distinct edges of that combined stream of draws, with self loops
+// dropped. Duplicates can only fall in the same range, so every range is
+// deduplicated on its own with a parallel sort: a first pass finds where the
+// stream reaches num_edges distinct edges, and a second draws every range up
+// to that point and writes it out before drawing the next. Only one range of
+// edges, packed as (src << 32) | dst, is held at a time, so memory follows
+// the largest range rather than the whole graph. The output is MatrixMarket
+// text or a CSR file in the binary matrix format.
+
+// Edge generation parameters
+const double a = 0.57, b = 0.19, c = 0.19, d = 1 - a - b - c;
+
+// Most source bits used to pick a range, the fewest source bits left to vary
+// within one, and the draws a range should not exceed when fewer bits do
+const int MAX_RANGE_BITS = 16;
+const int MIN_RANGE_SCALE = 8;
+const uint64_t RANGE_DRAWS = 1 << 22;
+
+const uint64_t NO_EDGE = UINT64_MAX;
+
+int num_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// SplitMix64 finalizer.
+uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Draw j of source range r, or NO_EDGE for a self loop. The first range_bits
+// levels of the walk take their source half from r and their destination
+// half conditioned on it; the rest are plain R-MAT levels. Each 64 bit hash
+// gives the quadrant choices of two levels.
+uint64_t rmat_edge(uint64_t seed, uint64_t r, int range_bits, uint64_t j, int scale) {
+    uint64_t key = mix(mix(seed ^ mix(r)) ^ mix(j));
+    uint64_t src = 0, dst = 0;
+    uint64_t stride = 1ULL << (scale - 1);
+    uint64_t bits = 0;
+    for (int i = 0; i < scale; ++i) {
+        if (i % 2 == 0) {
+            bits = mix(key + i);
+        }
+        double rand_val = (double)(uint32_t)(bits >> (i % 2 ? 32 : 0)) / 4294967296.0;
+        if (i < range_bits) {
+            // Source half fixed by the range, destination half given it
+            if ((r >> (range_bits - 1 - i)) & 1) {
                 src += stride;
+                if (rand_val < d / (c + d)) dst += stride;
             } else {
-                // Move to bottom-right quadrant
-                src += stride;
-                dst += stride;
+                if (rand_val < b / (a + b)) dst += stride;
             }
-            stride /= 2;
+        } else if (rand_val < a) {
+            // Stay in top-left quadrant
+        } else if (rand_val < a + b) {
+            // Move to top-right quadrant
+            dst += stride;
+        } else if (rand_val < a + b + c) {
+            // Move to bottom-left quadrant
+            src += stride;
+        } else {
+            // Move to bottom-right quadrant
+            src += stride;
+            dst += stride;
         }
+        stride /= 2;
+    }
+    return src == dst ? NO_EDGE : (src << 32) | dst;
+}
+
+// Weight of an edge, between 0 and 1, fixed by the seed and the edge itself.
+double edge_weight(uint64_t seed, uint64_t edge) {
+    return (mix(mix(seed + 1) ^ edge) >> 11) * 0x1.0p-53;
+}
 
-        // Ensure src and dst are different
-        if (src != dst) {
-            edges.emplace(src, dst);
+// Merge sorted a and b into out, with every thread merging the part of a
+// between two splitters and the part of b that falls between them.
+void parallel_merge(const uint64_t *a, uint64_t na, const uint64_t *b, uint64_t nb, uint64_t *out) {
+    int parts = num_threads();
+    #pragma omp parallel for schedule(static, 1)
+    for (int p = 0; p < parts; ++p) {
+        uint64_t a_begin = na * p / parts;
+        uint64_t a_end = na * (p + 1) / parts;
+        uint64_t b_begin = nb * p / parts;
+        uint64_t b_end = nb * (p + 1) / parts;
+        if (na > 0) {
+            b_begin = p == 0 ? 0 : std::lower_bound(b, b + nb, a[a_begin]) - b;
+            b_end = p == parts - 1 ? nb : std::lower_bound(b, b + nb, a[a_end]) - b;
         }
+        std::merge(a + a_begin, a + a_end, b + b_begin, b + b_end, out + a_begin + b_begin);
     }
+}
 
-    // Sort edges based on src, then dst
-    std::vector<std::pair<int, int>> sorted_edges(edges.begin(), edges.end());
+// Sort runs of the keys in parallel, then merge pairs of runs until one is left.
+void parallel_sort(std::vector<uint64_t> &keys, std::vector<uint64_t> &buffer) {
+    int runs = num_threads();
+    uint64_t n = keys.size();
+    std::vector<uint64_t> bounds(runs + 1);
+    for (int r = 0; r <= runs; ++r) {
+        bounds[r] = n * r / runs;
+    }
+    #pragma omp parallel for schedule(static, 1)
+    for (int r = 0; r < runs; ++r) {
+        std::sort(keys.begin() + bounds[r], keys.begin() + bounds[r + 1]);
+    }
+    buffer.resize(n);
+    for (int width = 1; width < runs; width *= 2) {
+        for (int r = 0; r < runs; r += 2 * width) {
+            uint64_t lo = bounds[r];
+            uint64_t mid = bounds[std::min(r + width, runs)];
+            uint64_t hi = bounds[std::min(r + 2 * width, runs)];
+            parallel_merge(keys.data() + lo, mid - lo, keys.data() + mid, hi - mid, buffer.data() + lo);
+        }
+        keys.swap(buffer);
+    }
+}
 
-    // Write to .mtx file
-    std::ofstream outfile("rmat_s" + std::to_string(scale) + "_e" + std::to_string(avg_edges_per_vertex) + ".mtx");
-    if (outfile.is_open()) {
+// Move the keys for which keep(i) holds to the front of out, in order, and
+// return how many there are.
+template <typename Keep>
+uint64_t parallel_compact(const std::vector<uint64_t> &keys, std::vector<uint64_t> &out, Keep keep) {
+    int parts = num_threads();
+    uint64_t n = keys.size();
+    std::vector<uint64_t> counts(parts + 1, 0);
+    #pragma omp parallel for schedule(static, 1)
+    for (int p = 0; p < parts; ++p) {
+        for (uint64_t i = n * p / parts; i < n * (p + 1) / parts; ++i) {
+            counts[p + 1] += keep(i);
+        }
+    }
+    for (int p = 0; p < parts; ++p) {
+        counts[p + 1] += counts[p];
+    }
+    out.resize(counts[parts]);
+    #pragma omp parallel for schedule(static, 1)
+    for (int p = 0; p < parts; ++p) {
+        uint64_t o = counts[p];
+        for (uint64_t i = n * p / parts; i < n * (p + 1) / parts; ++i) {
+            if (keep(i)) out[o++] = keys[i];
+        }
+    }
+    return counts[parts];
+}
+
+// Source bits that pick a range: the fewest that keep the first and most
+// likely range within RANGE_DRAWS draws. Every range keeps a few hundred
+// sources, whose degrees then vary as they would in a single stream; the
+// draws of a range only follow its expected share to within one.
+int choose_range_bits(int scale, uint64_t num_edges) {
+    int bits = 0;
+    double draws = num_edges;
+    while (bits < std::min(scale - MIN_RANGE_SCALE, MAX_RANGE_BITS) && draws > RANGE_DRAWS) {
+        draws *= a + b;
+        ++bits;
+    }
+    return bits;
+}
+
+// When the draws of every range happen. Range r is hit by a draw of the
+// unconditioned walk with probability p[r], and its draw j happens at time
+// (j + offset[r]) / p[r] with a hashed offset in [0, 1), so by time t range r
+// has made t * p[r] draws on average, including the ranges too unlikely to
+// get one, and the ranges together follow the proportions of a single R-MAT
+// stream. Draws are ordered by time and then by range.
+struct range_schedule_t {
+    std::vector<double> p;
+    std::vector<double> offset;
+
+    range_schedule_t(int bits, uint64_t seed) : p(1ULL << bits, 1.0), offset(1ULL << bits) {
+        for (uint64_t r = 0; r < p.size(); ++r) {
+            for (int i = 0; i < bits; ++i) {
+                p[r] *= (r >> i) & 1 ? c + d : a + b;
+            }
+            offset[r] = (mix(mix(seed + 2) ^ r) >> 11) * 0x1.0p-53;
+        }
+    }
+
+    double time(uint64_t r, uint64_t j) const {
+        return (j + offset[r]) / p[r];
+    }
+
+    // Draws of range r ordered no later than time t of range s.
+    uint64_t draws_until(uint64_t r, double t, uint64_t s) const {
+        auto until = [&](uint64_t j) {
+            double tj = time(r, j);
+            return tj < t || (tj == t && r <= s);
+        };
+        double estimate = t * p[r] - offset[r];
+        uint64_t n = estimate > 0 ? (uint64_t)std::ceil(estimate) : 0;
+        while (n > 0 && !until(n - 1)) --n;
+        while (until(n)) ++n;
+        return n;
+    }
+};
+
+// Draws [first, first + n) of range r into draws, in order.
+void draw_range(int scale, int bits, uint64_t r, uint64_t first, uint64_t n, uint64_t seed,
+                std::vector<uint64_t> &draws) {
+    draws.resize(n);
+    #pragma omp parallel for schedule(static)
+    for (uint64_t k = 0; k < n; ++k) {
+        draws[k] = rmat_edge(seed, r, bits, first + k, scale);
+    }
+}
+
+// The distinct edges among the draws in keys, sorted, into out; keys is
+// sorted along the way and buffer is scratch space.
+template <typename Keep>
+void distinct_edges(std::vector<uint64_t> &keys, std::vector<uint64_t> &buffer, std::vector<uint64_t> &out,
+                    Keep keep) {
+    parallel_sort(keys, buffer);
+    parallel_compact(keys, out, [&](uint64_t i) {
+        return keys[i] != NO_EDGE && (i == 0 || keys[i - 1] != keys[i]) && keep(keys[i]);
+    });
+}
+
+// Time and range of the draw that brings the stream to num_edges distinct
+// edges. Every range is drawn up to time t0, where the ranges have made at
+// most num_edges draws between them, and its first appearances of new edges
+// in a window after t0 are collected; the num_edges-th distinct edge is then
+// the right one of those. A window that falls short is doubled.
+std::pair<double, uint64_t> stream_end(int scale, int bits, const range_schedule_t &schedule,
+                                       uint64_t num_edges, uint64_t seed) {
+    uint64_t ranges = schedule.p.size();
+    double t0 = num_edges > ranges ? num_edges - ranges : 0;
+    double window = num_edges / 16 + 2 * ranges + 1;
+    std::vector<uint64_t> draws, keys, buffer, edges, fresh, first;
+    while (true) {
+        uint64_t before = 0;
+        std::vector<std::pair<double, uint64_t>> firsts;
+        for (uint64_t r = 0; r < ranges; ++r) {
+            uint64_t n0 = schedule.draws_until(r, t0, 0);
+            uint64_t n1 = schedule.draws_until(r, t0 + window, 0);
+            draw_range(scale, bits, r, 0, n0, seed, keys);
+            distinct_edges(keys, buffer, edges, [](uint64_t) { return true; });
+            before += edges.size();
+
+            draw_range(scale, bits, r, n0, n1 - n0, seed, draws);
+            keys = draws;
+            distinct_edges(keys, buffer, fresh, [&](uint64_t edge) {
+                return !std::binary_search(edges.begin(), edges.end(), edge);
+            });
+            first.assign(fresh.size(), UINT64_MAX);
+            #pragma omp parallel for schedule(static)
+            for (uint64_t k = 0; k < draws.size(); ++k) {
+                auto found = std::lower_bound(fresh.begin(), fresh.end(), draws[k]);
+                if (found == fresh.end() || *found != draws[k]) continue;
+                uint64_t &slot = first[found - fresh.begin()];
+                uint64_t seen = __atomic_load_n(&slot, __ATOMIC_RELAXED);
+                while (n0 + k < seen && !__atomic_compare_exchange_n(&slot, &seen, n0 + k, true, __ATOMIC_RELAXED,
+                                                                     __ATOMIC_RELAXED)) {
+                }
+            }
+            for (uint64_t j : first) {
+                firsts.emplace_back(schedule.time(r, j), r);
+            }
+        }
+        if (before + firsts.size() < num_edges) {
+            window *= 2;
+            continue;
+        }
+        uint64_t needed = num_edges - before;
+        if (needed == 0) {
+            return {t0, 0};
+        }
+        std::nth_element(firsts.begin(), firsts.begin() + needed - 1, firsts.end());
+        return firsts[needed - 1];
+    }
+}
+
+// One-based MatrixMarket triplets, written as the ranges arrive by formatting
+// blocks of edges in parallel and writing them in order.
+class market_output_t {
+public:
+    market_output_t(const std::string &path, uint64_t num_vertices, uint64_t num_edges, uint64_t seed)
+        : path(path), outfile(path), seed(seed) {
+        if (!outfile.is_open()) {
+            throw std::runtime_error("Unable to open " + path + " for writing.");
+        }
         outfile << "%%MatrixMarket matrix coordinate real general\n";
-        outfile << num_vertices << " " << num_vertices << " " << sorted_edges.size() << "\n";
+        outfile << num_vertices << " " << num_vertices << " " << num_edges << "\n";
+    }
+
+    void append(uint64_t, uint64_t, const std::vector<uint64_t> &edges) {
+        int parts = num_threads();
+        const uint64_t block = 1 << 16;
+        text.resize(parts);
+        for (uint64_t start = 0; start < edges.size(); start += block * parts) {
+            #pragma omp parallel for schedule(static, 1)
+            for (int p = 0; p < parts; ++p) {
+                text[p].clear();
+                char line[64];
+                uint64_t end = std::min<uint64_t>(start + block * (p + 1), edges.size());
+                for (uint64_t e = start + block * p; e < end; ++e) {
+                    uint64_t src = (edges[e] >> 32) + 1;
+                    uint64_t dst = (edges[e] & 0xFFFFFFFF) + 1;
+                    int length = std::snprintf(line, sizeof(line), "%llu %llu %g\n", (unsigned long long)src,
+                                               (unsigned long long)dst, edge_weight(seed, edges[e]));
+                    text[p].append(line, length);
+                }
+            }
+            for (const std::string &part : text) {
+                outfile << part;
+            }
+        }
+        if (!outfile) {
+            throw std::runtime_error("Failed to write " + path);
+        }
+    }
+
+private:
+    std::string path;
+    std::ofstream outfile;
+    uint64_t seed;
+    std::vector<std::string> text;
+};
+
+// A CSR matrix in the binary matrix format. The sizes are known up front, so
+// every range writes its rows of pos and its slices of idx and val at their
+// final offsets.
+template <typename Int>
+class binary_csr_output_t {
+public:
+    binary_csr_output_t(const std::string &path, uint64_t num_vertices, uint64_t num_edges, uint64_t seed)
+        : writer(path, BINARY_CSR, num_vertices, num_vertices, num_edges, 8 * sizeof(Int)), seed(seed) {
+        Int total = num_edges;
+        writer.write_at(writer.header.pos_offset + num_vertices * sizeof(Int), &total, sizeof(Int));
+    }
 
-        for (const auto& edge : sorted_edges) {
-            int src = edge.first;
-            int dst = edge.second;
-            double weight = weight_distribution(generator);  // Generate weight for the edge (0 to 1)
-            outfile << src << " " << dst << " " << weight << "\n"; // Write src, dst, and weight
+    // The edges of source vertices [first, last), after `written` earlier edges.
+    void append(uint64_t first, uint64_t last, const std::vector<uint64_t> &edges) {
+        std::vector<Int> pos(last - first);
+        #pragma omp parallel for schedule(static)
+        for (uint64_t v = first; v < last; ++v) {
+            pos[v - first] = written + (std::lower_bound(edges.begin(), edges.end(), v << 32) - edges.begin());
         }
-        outfile.close();
-    } else {
-        std::cerr << "Unable to open file for writing." << std::endl;
+        writer.write_at(writer.header.pos_offset + first * sizeof(Int), pos.data(), pos.size() * sizeof(Int));
+        pos = std::vector<Int>();
+
+        const uint64_t block = 1 << 20;
+        idx.resize(block);
+        val.resize(block);
+        for (uint64_t start = 0; start < edges.size(); start += block) {
+            uint64_t n = std::min(block, edges.size() - start);
+            #pragma omp parallel for schedule(static)
+            for (uint64_t e = 0; e < n; ++e) {
+                idx[e] = edges[start + e] & 0xFFFFFFFF;
+                val[e] = edge_weight(seed, edges[start + e]);
+            }
+            writer.write_at(writer.header.idx_offset + (written + start) * sizeof(Int), idx.data(), n * sizeof(Int));
+            writer.write_at(writer.header.val_offset + (written + start) * sizeof(double), val.data(), n * sizeof(double));
+        }
+        written += edges.size();
+    }
+
+private:
+    binary_matrix_writer_t writer;
+    uint64_t seed;
+    uint64_t written = 0;
+    std::vector<Int> idx;
+    std::vector<double> val;
+};
+
+// Generate the graph one source range at a time and hand every range's
+// sorted edges to output.append in vertex order.
+template <typename Output>
+void generate_rmat(int scale, uint64_t num_edges, uint64_t seed, Output &output) {
+    int bits = choose_range_bits(scale, num_edges);
+    range_schedule_t schedule(bits, seed);
+    std::pair<double, uint64_t> end = stream_end(scale, bits, schedule, num_edges, seed);
+    uint64_t range_vertices = 1ULL << (scale - bits);
+    std::vector<uint64_t> keys, buffer, edges;
+    for (uint64_t r = 0; r < schedule.p.size(); ++r) {
+        draw_range(scale, bits, r, 0, schedule.draws_until(r, end.first, end.second), seed, keys);
+        distinct_edges(keys, buffer, edges, [](uint64_t) { return true; });
+        output.append(r * range_vertices, (r + 1) * range_vertices, edges);
     }
 }
 
+void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [options] <scale> <avg_edges_per_vertex>" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  -h, --help      Print this help message" << std::endl;
+    std::cerr << "  -s, --seed      Random seed (default 1); the graph does not depend on the thread count" << std::endl;
+    std::cerr << "  -t, --threads   Number of threads (default: all)" << std::endl;
+    std::cerr << "  -f, --format    Output format, from [mtx, bin] (default mtx)" << std::endl;
+    std::cerr << "  -o, --output    Output file (default rmat_s<scale>_e<avg_edges_per_vertex>.<format>)" << std::endl;
+}
+
 int main(int argc, char* args[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << args[0] << " <scale> <avg_edges_per_vertex>" << std::endl;
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"seed", required_argument, 0, 's'},
+        {"threads", required_argument, 0, 't'},
+        {"format", required_argument, 0, 'f'},
+        {"output", required_argument, 0, 'o'},
+        {0, 0, 0, 0}
+    };
+
+    uint64_t seed = 1;
+    std::string format = "mtx";
+    std::string output;
+
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long(argc, args, "hs:t:f:o:", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'h':
+                usage(args[0]);
+                return 0;
+            case 's':
+                seed = std::stoull(optarg);
+                break;
+            case 't':
+#ifdef _OPENMP
+                omp_set_num_threads(std::stoi(optarg));
+#endif
+                break;
+            case 'f':
+                format = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage(args[0]);
+                return 1;
+        }
+    }
+
+    if (argc - optind != 2 || (format != "mtx" && format != "bin")) {
+        usage(args[0]);
         return 1;
     }
 
-    int scale = std::stoi(args[1]);
-    int avg_edges_per_vertex = std::stoi(args[2]);
+    int scale = std::stoi(args[optind]);
+    int64_t avg_edges_per_vertex = std::stoll(args[optind + 1]);
+    if (scale < 1 || scale > 32) {
+        std::cerr << "Scale must be between 1 and 32." << std::endl;
+        return 1;
+    }
+    uint64_t num_vertices = 1ULL << scale;  // 2^scale
+    int64_t num_edges = num_vertices * avg_edges_per_vertex;
+    if ((double)num_edges > (double)num_vertices * (num_vertices - 1)) {
+        std::cerr << "More edges requested than the graph can hold." << std::endl;
+        return 1;
+    }
+    if (output.empty()) {
+        output = "rmat_s" + std::to_string(scale) + "_e" + std::to_string(avg_edges_per_vertex) + "." + format;
+    }
 
-    generate_rmat_graph(scale, avg_edges_per_vertex);
+    try {
+        if (format == "mtx") {
+            market_output_t out(output, num_vertices, num_edges, seed);
+            generate_rmat(scale, num_edges, seed, out);
+        } else if (std::max<uint64_t>(num_vertices, num_edges) < INT32_MAX) {
+            binary_csr_output_t<int32_t> out(output, num_vertices, num_edges, seed);
+            generate_rmat(scale, num_edges, seed, out);
+        } else {
+            binary_csr_output_t<int64_t> out(output, num_vertices, num_edges, seed);
+            generate_rmat(scale, num_edges, seed, out);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
     return 0;
 }
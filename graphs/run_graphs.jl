@@ -33,6 +33,10 @@ s = ArgParseSettings("Run graph experiments.")
         arg_type = String
         help = "dataset keyword"
         default = "willow"
+    "--threads", "-t"
+        arg_type = Int
+        help = "number of threads for the LAGraph and native baselines"
+        default = 1
     "--batch", "-b"
         arg_type = Int
         help = "batch number"
@@ -45,12 +49,20 @@ end
 
 parsed_args = parse_args(ARGS, s)
 
+num_threads = parsed_args["threads"]
+
+include("../common/driver_server.jl")
+include("../common/binary_matrix.jl")
+driver_threads[] = string(num_threads)
+
 include("datasets.jl")
 include("bellmanford_finch.jl")
 include("bfs_finch.jl")
 
 include("bfs_lagraph.jl")
+include("bfs_native.jl")
 include("bellmanford_lagraph.jl")
+include("sssp_native.jl")
 
 function bfs_graphs(mtx)
     A = SimpleDiGraph(transpose(mtx))
@@ -125,6 +137,7 @@ for mtx in batch
                 "finch_push_pull" => bfs_finch_push_pull,
                 "finch_push_only" => bfs_finch_push_only,
                 "graphblas" => bfs_lagraph,
+                (has_bfs_native() ? ["native" => bfs_native] : [])...,
             ]
         ),
         ("bellmanford",
@@ -133,6 +146,7 @@ for mtx in batch
                 "Graphs.jl" => bellmanford_graphs,
                 "Finch" => bellmanford_finch,
                 "graphblas" => bellmanford_lagraph,
+                (has_sssp_native() ? ["native_delta_stepping" => sssp_native] : [])...,
             ]
         ),
     ]
@@ -151,12 +165,18 @@ for mtx in batch
 
             # res.y == y_ref || @warn("incorrect result")
             @info "results" key result.time result.mem
-            push!(results, OrderedDict(
+            entry = OrderedDict(
                 "time" => time,
                 "method" => key,
                 "operation" => op_name,
                 "matrix" => mtx,
-            ))
+            )
+            hasproperty(result, :teps) && (entry["teps"] = result.teps)
+            hasproperty(result, :levels) && (entry["levels"] = result.levels)
+            hasproperty(result, :relaxations_per_second) && (entry["relaxations_per_second"] = result.relaxations_per_second)
+            hasproperty(result, :delta) && (entry["delta"] = result.delta)
+            hasproperty(result, :scaling) && (entry["scaling"] = result.scaling)
+            push!(results, entry)
             write(parsed_args["output"], JSON.json(results, 4))
         end
     end
@@ -0,0 +1,343 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <sys/stat.h>
+#include <iostream>
+#include <cstdint>
+#include <vector>
+#include "../deps/SparseRooflineBenchmark/src/benchmark.hpp"
+#include "../common/server.hpp"
+#include "../common/threads.hpp"
+#include "../common/memory.hpp"
+#include "../common/perf_counters.hpp"
+#include "../common/timing.hpp"
+#include "../common/eigen_operand.hpp"
+#include "../common/csr_view.hpp"
+#include "../common/options.hpp"
+
+extern int optind;
+
+constexpr double unreached = std::numeric_limits<double>::infinity();
+
+inline double load_distance(const double *distance) {
+  double value;
+  __atomic_load(distance, &value, __ATOMIC_RELAXED);
+  return value;
+}
+
+// Lower *distance to candidate unless another thread got it lower first.
+// Returns whether candidate was stored.
+inline bool lower_distance(double *distance, double candidate) {
+  double current = load_distance(distance);
+  while (candidate < current) {
+    if (__atomic_compare_exchange(distance, &current, &candidate, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Parallel delta-stepping (Meyer and Sanders) with the bucket fusion of the
+// GAP benchmark suite. Row u of A lists the out-edges of u, weighted by the
+// values. A vertex whose distance drops to d goes into the thread-local bin
+// floor(d / delta). Every round, all threads copy their bins of the lowest
+// nonempty bucket into the shared frontier and relax the frontier's edges
+// together; a thread then keeps draining its own bin of that bucket while it
+// holds fewer than fuse_threshold vertices, saving the rounds (and barriers)
+// that long chains of light edges would cost. Stale frontier entries, whose
+// distance fell into a bucket that was already settled, are skipped.
+struct delta_stepping_t {
+  double delta = 1;
+  size_t fuse_threshold = 1000;
+  std::vector<double> dist;
+  std::vector<sparse_index_t> frontier;
+  long long relaxations = 0;
+  long long updates = 0;
+  long long rounds = 0;
+
+  void search(const csr_view_t &out, sparse_index_t source) {
+    const size_t none = std::numeric_limits<size_t>::max();
+    sparse_index_t n = out.rows;
+    dist.assign(n, unreached);
+    frontier.resize(std::max<size_t>(frontier.size(), n));
+    dist[source] = 0;
+    frontier[0] = source;
+    // Bucket and size of the frontier, for the current and the next round
+    size_t bucket[2] = {0, none};
+    size_t tail[2] = {1, 0};
+    long long relaxed = 0, improved = 0, round_count = 0;
+    #pragma omp parallel reduction(+:relaxed, improved)
+    {
+      std::vector<std::vector<sparse_index_t>> bins;
+      auto relax = [&](sparse_index_t u) {
+        double base = load_distance(&dist[u]);
+        for (sparse_index_t p = out.pos[u]; p < out.pos[u + 1]; p++) {
+          double candidate = base + out.val[p];
+          if (lower_distance(&dist[out.idx[p]], candidate)) {
+            size_t bin = candidate / delta;
+            if (bin >= bins.size()) bins.resize(bin + 1);
+            bins[bin].push_back(out.idx[p]);
+            improved++;
+          }
+        }
+        relaxed += out.pos[u + 1] - out.pos[u];
+      };
+
+      for (size_t round = 0; bucket[round & 1] != none; round++) {
+        size_t &current = bucket[round & 1];
+        size_t &next = bucket[(round + 1) & 1];
+        size_t &current_tail = tail[round & 1];
+        size_t &next_tail = tail[(round + 1) & 1];
+        double lower = delta * current;
+
+        #pragma omp for schedule(dynamic, 64) nowait
+        for (size_t q = 0; q < current_tail; q++) {
+          sparse_index_t u = frontier[q];
+          if (load_distance(&dist[u]) >= lower) relax(u);
+        }
+        std::vector<sparse_index_t> work;
+        while (current < bins.size() && !bins[current].empty() && bins[current].size() < fuse_threshold) {
+          work.swap(bins[current]);
+          bins[current].clear();
+          for (sparse_index_t u : work) relax(u);
+        }
+        for (size_t bin = current; bin < bins.size(); bin++) {
+          if (!bins[bin].empty()) {
+            size_t seen = next;
+            while (bin < seen &&
+                   !__atomic_compare_exchange_n(&next, &seen, bin, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+            break;
+          }
+        }
+        #pragma omp barrier
+
+        size_t count = next < bins.size() ? bins[next].size() : 0;
+        size_t offset = __atomic_fetch_add(&next_tail, count, __ATOMIC_RELAXED);
+        #pragma omp barrier
+        #pragma omp single
+        {
+          if (next_tail > frontier.size()) frontier.resize(std::max(next_tail, 2 * frontier.size()));
+          current = none;
+          current_tail = 0;
+          round_count++;
+        }
+        if (count > 0) {
+          std::copy(bins[next].begin(), bins[next].end(), frontier.begin() + offset);
+          bins[next].clear();
+        }
+        #pragma omp barrier
+      }
+    }
+    relaxations = relaxed;
+    updates = improved;
+    rounds = round_count;
+  }
+};
+
+// Frontier-based Bellman-Ford: every round relaxes the out-edges of the
+// vertices whose distance fell in the previous round, until none does.
+std::vector<double> bellman_ford(const csr_view_t &out, sparse_index_t source) {
+  sparse_index_t n = out.rows;
+  std::vector<double> dist(n, unreached);
+  std::vector<char> active(n, 0), next(n, 0);
+  dist[source] = 0;
+  active[source] = 1;
+  for (bool changed = true; changed;) {
+    changed = false;
+    #pragma omp parallel for schedule(dynamic, 256) reduction(||:changed)
+    for (sparse_index_t u = 0; u < n; u++) {
+      if (!active[u]) continue;
+      double base = load_distance(&dist[u]);
+      for (sparse_index_t p = out.pos[u]; p < out.pos[u + 1]; p++) {
+        if (lower_distance(&dist[out.idx[p]], base + out.val[p])) {
+          __atomic_store_n(&next[out.idx[p]], 1, __ATOMIC_RELAXED);
+          changed = true;
+        }
+      }
+    }
+    active.swap(next);
+    std::fill(next.begin(), next.end(), 0);
+  }
+  return dist;
+}
+
+struct sssp_native_t {
+  thread_sweep_t threads;
+  // Also read hardware counters around the measured call.
+  bool counters = false;
+  // Warmup, sample count and cache flushing of the measured call.
+  timing_t timing;
+  // Compare the distances with Bellman-Ford after the sweep.
+  bool verify = true;
+  sparse_index_t source = 0;
+  // Bucket width, or 0 for the largest weight over the average degree.
+  double delta = 0;
+  eigen_operand_t<Eigen::RowMajor> A;
+  delta_stepping_t sssp;
+
+  void load(const std::string &input) {
+    A.load(input, "A");
+    if (A->rows() != A->cols()) {
+      throw std::runtime_error("The adjacency matrix must be square");
+    }
+    const double *weights = A->valuePtr();
+    for (sparse_index_t p = 0; p < A->nonZeros(); p++) {
+      if (!(weights[p] >= 0)) {
+        throw std::runtime_error("Edge weights must be non-negative");
+      }
+    }
+  }
+
+  json run(const std::string &output, int reps) {
+    if (source < 0 || source >= A->rows()) {
+      throw std::invalid_argument("Source vertex out of range");
+    }
+    csr_view_t out = csr_view(*A);
+    sssp.delta = delta;
+    if (sssp.delta <= 0) {
+      double max_weight = 0;
+      for (sparse_index_t p = 0; p < out.pos[out.rows]; p++) max_weight = std::max(max_weight, out.val[p]);
+      double degree = out.rows > 0 ? (double)out.pos[out.rows] / out.rows : 1;
+      sssp.delta = max_weight > 0 ? max_weight / std::max(degree, 1.0) : 1;
+    }
+    auto setup = []() {};
+    auto test = [&]() {
+      sssp.search(out, source);
+    };
+    json measurements = sweep_threads(threads, [&](int) {
+      json entry;
+      entry.update(benchmark_samples(timing, setup, test, reps));
+      entry["relaxations"] = sssp.relaxations;
+      entry["relaxations_per_second"] = sssp.relaxations / (entry["time"].get<double>() * 1e-9);
+      entry["rounds"] = sssp.rounds;
+      if (counters) entry.update(measure_counters(timing, setup, test, reps));
+      return entry;
+    });
+    record_memory(measurements, measure_memory(setup, test), {
+      {"A", eigen_structure_bytes(*A)},
+      {"buckets", structure_bytes(sssp.frontier.capacity() * sizeof(sparse_index_t), sssp.dist.capacity() * sizeof(double))},
+    });
+
+    measurements["source"] = source;
+    measurements["delta"] = sssp.delta;
+    measurements["reached"] = std::count_if(sssp.dist.begin(), sssp.dist.end(), [](double d) { return d < unreached; });
+    measurements["updates"] = sssp.updates;
+    if (verify) {
+      auto tic = std::chrono::high_resolution_clock::now();
+      std::vector<double> reference = bellman_ford(out, source);
+      auto toc = std::chrono::high_resolution_clock::now();
+      double max_error = 0;
+      long long mismatches = 0;
+      for (sparse_index_t v = 0; v < out.rows; v++) {
+        if (sssp.dist[v] == reference[v]) continue;
+        double error = std::abs(sssp.dist[v] - reference[v]);
+        max_error = std::max(max_error, error);
+        if (!(error <= 1e-12 * std::max(1.0, reference[v]))) mismatches++;
+      }
+      measurements["bellman_ford_time"] = std::chrono::duration_cast<std::chrono::nanoseconds>(toc - tic).count();
+      measurements["max_error"] = max_error;
+      measurements["mismatches"] = mismatches;
+      measurements["verified"] = mismatches == 0;
+    }
+    std::ofstream measurements_file(output + "/measurements.json");
+    measurements_file << measurements;
+    measurements_file.close();
+    return measurements;
+  }
+
+  // Write the distance of every vertex as a dense binary vector, infinite for
+  // unreached vertices.
+  void fetch(const std::string &output) {
+    write_binary_vector(output + "/dist.bin", sssp.dist.size(), sssp.dist.data());
+  }
+};
+
+int main(int argc, char **argv) {
+  auto params = parse(argc, argv);
+
+  sssp_native_t sssp;
+  common_options_t options(sssp.threads, sssp.counters, sssp.timing);
+
+  std::vector<option> long_options = options.long_options({
+    {"help", no_argument, 0, 'h'},
+    {"source", required_argument, 0, 's'},
+    {"delta", required_argument, 0, 'd'},
+    {"no_verify", no_argument, 0, 'n'},
+  });
+  std::string short_options = options.short_options("hs:d:n");
+
+  // Parse the options
+  int option_index = 0;
+  int c;
+  optind = 1;
+  while ((c = getopt_long(params.argc, params.argv, short_options.c_str(), long_options.data(), &option_index)) != -1) {
+    switch (c) {
+      case 'h':
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -h, --help       Print this help message" << std::endl;
+        std::cout << "  -s, --source     Zero-based source vertex (default 0)" << std::endl;
+        std::cout << "  -d, --delta      Bucket width (default: largest weight / average degree)" << std::endl;
+        std::cout << "  -n, --no_verify  Skip the comparison with Bellman-Ford" << std::endl;
+        options.help(19, "load/source/delta/verify/run/fetch");
+        exit(0);
+      case 's':
+        try {
+          sssp.source = std::stoll(optarg);
+        } catch (const std::exception &e) {
+          std::cerr << "Invalid source" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'd':
+        try {
+          sssp.delta = std::stod(optarg);
+        } catch (const std::exception &e) {
+          std::cerr << "Invalid delta" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'n':
+        sssp.verify = false;
+        break;
+      case '?':
+        // getopt_long already printed an error message
+        break;
+      default:
+        if (!options.parse(c, optarg)) abort();
+    }
+  }
+
+  if (sssp.delta < 0) {
+    std::cerr << "delta must not be negative" << std::endl;
+    exit(1);
+  }
+
+  std::map<std::string, server_command_t> commands = {
+    {"load", [&](const server_args_t &args) { sssp.load(server_arg(args, 0, "input dir")); return json(); }},
+    {"source", [&](const server_args_t &args) { sssp.source = std::stoll(server_arg(args, 0, "vertex")); return json(); }},
+    {"delta", [&](const server_args_t &args) { sssp.delta = std::stod(server_arg(args, 0, "width")); return json(); }},
+    {"verify", [&](const server_args_t &args) { sssp.verify = server_arg(args, 0, "on|off") == "on"; return json(); }},
+    {"run", [&](const server_args_t &args) { return sssp.run(server_arg(args, 0, "output dir"), server_reps(args, 1)); }},
+    {"fetch", [&](const server_args_t &args) { sssp.fetch(server_arg(args, 0, "output dir")); return json(); }},
+  };
+  options.add_commands(commands);
+  if (options.server) return serve(commands);
+
+  // Check that all required options are present
+  if (params.input.empty() || params.output.empty()) {
+    std::cerr << "Missing required option" << std::endl;
+    exit(1);
+  }
+
+  try {
+    sssp.load(params.input);
+    sssp.run(params.output, 0);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+  sssp.fetch(params.output);
+  return 0;
+}
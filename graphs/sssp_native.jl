@@ -0,0 +1,29 @@
+function sssp_native(A; source=1)
+    tmpdir = mktempdir(@__DIR__, prefix="experiment_")
+    A_path = joinpath(tmpdir, "A.bin")
+    dist_path = joinpath(tmpdir, "dist.bin")
+    # Column u of A holds the weights of the out-edges of u, which are row u of
+    # the driver's A, as in bfs_native
+    (n, n) = size(A)
+    Ti = binary_index_type(A)
+    write_binary_arrays(A_path, BINARY_CSR, n, n, Ti.(A.colptr .- 1), Ti.(A.rowval .- 1), Vector{Float64}(A.nzval))
+    sssp_path = joinpath(@__DIR__, "sssp_native")
+    server = driver_server(`$sssp_path -- --server`)
+    driver_request(server, "load", tmpdir)
+    driver_request(server, "source", source - 1)
+    measurements = driver_request(server, "run", tmpdir)
+    measurements["verified"] || @warn("delta-stepping distances differ from Bellman-Ford", measurements["max_error"])
+    driver_request(server, "fetch", tmpdir)
+    dists = read_binary_vector(dist_path)
+    # The driver keeps no parents; any in-neighbor on a shortest path will do
+    parents = zeros(Int, n)
+    for u in 1:n, p in nzrange(A, u)
+        i = A.rowval[p]
+        if i != source && dists[u] + A.nzval[p] == dists[i]
+            parents[i] = u
+        end
+    end
+    return (;time=measurements["time"]*10^-9, mem=Base.summarysize(A), output=(dists=dists, parents=parents), relaxations_per_second=measurements["relaxations_per_second"], delta=measurements["delta"], scaling=measurements["scaling"])
+end
+
+has_sssp_native() = isfile(joinpath(@__DIR__, "sssp_native"))
@@ -25,6 +25,38 @@ s = ArgParseSettings("Run spgemm experiments.")
         arg_type = String
         help = "output file path"
         default = "spgemm_results.json"
+    "--threads", "-t"
+        arg_type = String
+        help = "comma separated thread counts for the C++ drivers"
+        default = "1"
+    "--pin"
+        action = :store_true
+        help = "pin C++ driver threads to cores"
+    "--counters"
+        action = :store_true
+        help = "read hardware performance counters in the C++ drivers"
+    "--warmup"
+        arg_type = Int
+        help = "untimed calls before the C++ drivers start sampling"
+        default = 0
+    "--min_time"
+        arg_type = Float64
+        help = "seconds the C++ drivers sample each run for at least"
+        default = 0.2
+    "--min_reps"
+        arg_type = Int
+        help = "samples the C++ drivers take per run at least"
+        default = 1
+    "--flush"
+        action = :store_true
+        help = "flush the last level cache before every timed call in the C++ drivers"
+    "--verify"
+        action = :store_true
+        help = "check results inside the C++ drivers instead of fetching them"
+    "--tolerance"
+        arg_type = Float64
+        help = "largest error the C++ drivers accept, relative to the largest reference value"
+        default = 1e-9
     "--dataset", "-d"
         arg_type = String
         help = "dataset keyword"
@@ -41,6 +73,10 @@ s = ArgParseSettings("Run spgemm experiments.")
         arg_type = Int
         help = "number of iters to run"
         default = 20
+    "--chunk"
+        arg_type = Int
+        help = "rows per dynamically scheduled task of the parallel TACO schedule"
+        default = 16
     "--kernels"
         arg_type = String
         help = "set of kernels to run"
@@ -102,18 +138,36 @@ datasets = Dict(
     ]
 )
 
+include("../common/driver_server.jl")
+include("../common/binary_matrix.jl")
+driver_threads[] = parsed_args["threads"]
+driver_pin[] = parsed_args["pin"]
+driver_counters[] = parsed_args["counters"]
+driver_warmup[] = parsed_args["warmup"]
+driver_min_time[] = parsed_args["min_time"]
+driver_min_reps[] = parsed_args["min_reps"]
+driver_flush[] = parsed_args["flush"]
+driver_verify[] = parsed_args["verify"]
+driver_tolerance[] = parsed_args["tolerance"]
+const taco_chunk = Ref(parsed_args["chunk"])
 include("spgemm_finch.jl")
 include("spgemm_taco.jl")
 include("spgemm_eigen.jl")
 include("spgemm_mkl.jl")
+include("spgemm_native.jl")
 
 methods = Dict(
     "all" => [
         (has_taco() ? ["spgemm_taco_inner" => spgemm_taco_inner] : [])...,
         (has_taco() ? ["spgemm_taco_gustavson" => spgemm_taco_gustavson] : [])...,
         (has_taco() ? ["spgemm_taco_outer" => spgemm_taco_outer] : [])...,
+        (has_taco() ? ["spgemm_taco_gustavson_parallel" => spgemm_taco_gustavson_parallel] : [])...,
         (has_eigen() ? ["spgemm_eigen" => spgemm_eigen] : [])...,
         (has_mkl() ? ["spgemm_mkl" => spgemm_mkl] : [])...,
+        (has_native() ? ["spgemm_native" => spgemm_native] : [])...,
+        (has_native() ? ["spgemm_native_dense" => spgemm_native_dense] : [])...,
+        (has_native() ? ["spgemm_native_hash" => spgemm_native_hash] : [])...,
+        (has_native() ? ["spgemm_native_heap" => spgemm_native_heap] : [])...,
         "spgemm_finch_inner" => spgemm_finch_inner,
         "spgemm_finch_gustavson" => spgemm_finch_gustavson,
         "spgemm_finch_outer" => spgemm_finch_outer,
@@ -122,8 +176,10 @@ methods = Dict(
     ],
     "fast" => [
         (has_taco() ? ["spgemm_taco_gustavson" => spgemm_taco_gustavson] : [])...,
+        (has_taco() ? ["spgemm_taco_gustavson_parallel" => spgemm_taco_gustavson_parallel] : [])...,
         (has_eigen() ? ["spgemm_eigen" => spgemm_eigen] : [])...,
         (has_mkl() ? ["spgemm_mkl" => spgemm_mkl] : [])...,
+        (has_native() ? ["spgemm_native" => spgemm_native] : [])...,
         "spgemm_finch_gustavson" => spgemm_finch_gustavson,
     ],
 )
@@ -151,15 +207,27 @@ for mtx in batch
     for (key, method) in methods[parsed_args["kernels"]]
         @info "testing" key mtx
         res = method(A, B)
-	C_ref = something(C_ref, SparseMatrixCSC(res.C))
-	norm(C_ref - SparseMatrixCSC(res.C))/norm(C_ref) < 0.01 || @warn("incorrect result via norm")
+        if res.C !== nothing
+            C_ref = something(C_ref, SparseMatrixCSC(res.C))
+            norm(C_ref - SparseMatrixCSC(res.C))/norm(C_ref) < 0.01 || @warn("incorrect result via norm")
+        end
+        verification = hasproperty(res, :verification) ? res.verification : nothing
+        verification === nothing || verification["passed"] || @warn("incorrect result via verification", verification)
         @info "results" res.time
-        push!(results, OrderedDict(
+        result = OrderedDict(
             "time" => res.time,
             "method" => key,
             "kernel" => "spgemm",
             "matrix" => mtx,
-        ))
+        )
+        hasproperty(res, :compile_time) && (result["compile_time"] = res.compile_time)
+        hasproperty(res, :scaling) && (result["scaling"] = res.scaling)
+        hasproperty(res, :timing) && (result["timing"] = res.timing)
+        hasproperty(res, :memory) && (result["memory"] = res.memory)
+        hasproperty(res, :checksum) && (result["checksum"] = res.checksum)
+        verification === nothing || (result["verification"] = verification)
+        hasproperty(res, :counters) && res.counters !== nothing && (result["counters"] = res.counters)
+        push!(results, result)
         write(parsed_args["output"], JSON.json(results, 4))
     end
 end
@@ -2,39 +2,118 @@
 #include <sys/stat.h>
 #include <iostream>
 #include <cstdint>
-#include <Eigen/Sparse>
-#include <unsupported/Eigen/SparseExtra>
 #include "../deps/SparseRooflineBenchmark/src/benchmark.hpp"
+#include "../common/server.hpp"
+#include "../common/threads.hpp"
+#include "../common/memory.hpp"
+#include "../common/perf_counters.hpp"
+#include "../common/timing.hpp"
+#include "../common/eigen_operand.hpp"
+#include "../common/verify.hpp"
+#include "../common/options.hpp"
+
+extern int optind;
+
+struct spgemm_eigen_t {
+  thread_sweep_t threads;
+  // Also read hardware counters around the measured call.
+  bool counters = false;
+  // Warmup, sample count and cache flushing of the measured call.
+  timing_t timing;
+  // Check the result against a reference after each run.
+  verify_t verify;
+  eigen_operand_t<Eigen::ColMajor> A;
+  eigen_operand_t<Eigen::ColMajor> B;
+  Eigen::SparseMatrix<double, Eigen::ColMajor, sparse_index_t> C;
+  std::string input;
+
+  void load(const std::string &input) {
+    A.load(input, "A");
+    B.load(input, "B");
+    this->input = input;
+  }
+
+  json run(const std::string &output, int reps) {
+    // Assemble output indices and numerically compute the result
+    auto setup = [this]() {
+      C = *A * *B;
+    };
+    auto test = [this]() {
+      C = *A * *B;
+    };
+    // Eigen's sparse * sparse product is single-threaded, so only one
+    // thread is timed whatever counts were asked for, and measurements.json
+    // says so with "threaded": false.
+    thread_sweep_t serial = threads;
+    serial.counts = {1};
+    json measurements = sweep_threads(serial, [&](int) {
+      json entry;
+      entry.update(benchmark_samples(timing, setup, test, reps));
+      if (counters) entry.update(measure_counters(timing, setup, test, reps));
+      return entry;
+    });
+    record_memory(measurements, measure_memory(setup, test), {
+      {"A", eigen_structure_bytes(*A)},
+      {"B", eigen_structure_bytes(*B)},
+      {"C", eigen_structure_bytes(C)},
+    });
+    measurements["threaded"] = false;
+    measurements["checksum"] = output_checksum(C.valuePtr(), C.nonZeros());
+    if (verify.enabled) {
+      measurements["verification"] = verify.spgemm(input, BINARY_CSC, C.rows(), C.cols(), C.outerIndexPtr(), C.innerIndexPtr(), C.valuePtr());
+    }
+    std::ofstream measurements_file(output+"/measurements.json");
+    measurements_file << measurements;
+    measurements_file.close();
+    return measurements;
+  }
+
+  void fetch(const std::string &output) {
+    Eigen::saveMarket(C, (output + "/C.ttx").c_str());
+  }
+};
 
 int main(int argc, char **argv) {
   auto params = parse(argc, argv);
 
-  FILE *fpA = fopen((params.input+"/A.ttx").c_str(), "r");
-  FILE *fpB = fopen((params.input+"/B.ttx").c_str(), "r");
-  
-  Eigen::SparseMatrix<double> A;
-	Eigen::loadMarket(A, (params.input + "/A.ttx").c_str());
-  Eigen::SparseMatrix<double> B;
-	Eigen::loadMarket(B, (params.input + "/B.ttx").c_str());
-  Eigen::SparseMatrix<double> C;
-
-  // Assemble output indices and numerically compute the result
-  auto time = benchmark(
-    [&A, &B, &C]() {
-	C = A * B;
-    },
-    [&A, &B, &C]() {
-	C = A * B;
+  spgemm_eigen_t spgemm;
+  common_options_t options(spgemm.threads, spgemm.counters, spgemm.timing, &spgemm.verify);
+
+  std::vector<option> long_options = options.long_options({
+    {"help", no_argument, 0, 'h'},
+  });
+  std::string short_options = options.short_options("h");
+
+  // Parse the options
+  int option_index = 0;
+  int c;
+  optind = 1;
+  while ((c = getopt_long(params.argc, params.argv, short_options.c_str(), long_options.data(), &option_index)) != -1) {
+    switch (c) {
+      case 'h':
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -h, --help      Print this help message" << std::endl;
+        options.help(18, "load/verify/run/fetch", "C_ref.bin or A times B", "C.ttx");
+        exit(0);
+      case '?':
+        // getopt_long already printed an error message
+        break;
+      default:
+        if (!options.parse(c, optarg)) abort();
     }
-  );
+  }
 
-  Eigen::saveMarket(C, (params.output + "/C.ttx").c_str());
+  std::map<std::string, server_command_t> commands = {
+    {"load", [&](const server_args_t &args) { spgemm.load(server_arg(args, 0, "input dir")); return json(); }},
+    {"run", [&](const server_args_t &args) { return spgemm.run(server_arg(args, 0, "output dir"), server_reps(args, 1)); }},
+    {"fetch", [&](const server_args_t &args) { spgemm.fetch(server_arg(args, 0, "output dir")); return json(); }},
+  };
+  options.add_commands(commands);
+  if (options.server) return serve(commands);
+  if (!options.manifest.empty()) return run_manifest(options.manifest, commands, options.write_output);
 
-  json measurements;
-  measurements["time"] = time;
-  measurements["memory"] = 0;
-  std::ofstream measurements_file(params.output+"/measurements.json");
-  measurements_file << measurements;
-  measurements_file.close();
+  spgemm.load(params.input);
+  spgemm.run(params.output, 0);
+  if (options.write_output) spgemm.fetch(params.output);
   return 0;
 }
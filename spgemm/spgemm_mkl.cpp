@@ -6,125 +6,160 @@
 #include <Eigen/Sparse>
 #include <unsupported/Eigen/SparseExtra>
 #include "../deps/SparseRooflineBenchmark/src/benchmark.hpp"
-
-int main(int argc, char **argv) {
-    mkl_set_num_threads(1);
-
-	auto params = parse(argc, argv);
-
-	// Define eigen_A and eigen_B matrices
-	Eigen::SparseMatrix<double, Eigen::RowMajor> eigen_A, eigen_B;
-
-	// Load or initialize eigen_A and eigen_B as needed
-	Eigen::loadMarket(eigen_A, (params.input + "/A.ttx").c_str());
-	Eigen::loadMarket(eigen_B, (params.input + "/B.ttx").c_str());
-	MKL_INT m = eigen_A.rows();
-	MKL_INT n = eigen_A.rows();
-
-	// Convert Eigen matrix A to MKL format using Eigen's internal data
-	const int* outerIndexPtr_A = eigen_A.outerIndexPtr();
-	const int* innerIndexPtr_A = eigen_A.innerIndexPtr();
-	const double* valuePtr_A = eigen_A.valuePtr();
-
-	MKL_INT *csr_row_pointer_A = (MKL_INT *)mkl_malloc((eigen_A.rows() + 1) * sizeof(MKL_INT), 64);
-	MKL_INT *csr_columns_A = (MKL_INT *)mkl_malloc(eigen_A.nonZeros() * sizeof(MKL_INT), 64);
-	double *csr_values_A = (double *)mkl_malloc(eigen_A.nonZeros() * sizeof(double), 64);
-
-	for (int i = 0; i <= eigen_A.rows(); ++i) {
-		csr_row_pointer_A[i] = outerIndexPtr_A[i];
+#include "../common/server.hpp"
+#include "../common/threads.hpp"
+#include "../common/memory.hpp"
+#include "../common/perf_counters.hpp"
+#include "../common/timing.hpp"
+#include "../common/mkl_csr.hpp"
+#include "../common/verify.hpp"
+#include "../common/options.hpp"
+
+extern int optind;
+
+struct spgemm_mkl_t {
+	thread_sweep_t threads;
+	// Also read hardware counters around the measured call.
+	bool counters = false;
+	// Warmup, sample count and cache flushing of the measured call.
+	timing_t timing;
+	// Check the result against a reference after each run.
+	verify_t verify;
+	mkl_csr_t A, B;
+	// Place the rows of A and of B on the NUMA nodes of the threads, see
+	// mkl_csr_t::place_rows. Every thread reads rows of B all over, so this
+	// spreads B over the nodes rather than keeping it local; C is allocated
+	// by mkl_sparse_sp2m and stays where MKL puts it.
+	bool numa = false;
+	sparse_matrix_t C = nullptr;
+	matrix_descr descrA, descrB, descrC;
+	std::string input;
+
+	spgemm_mkl_t() {
+		mkl_peak_mem_usage(MKL_PEAK_MEM_ENABLE);
+		descrA.type = SPARSE_MATRIX_TYPE_GENERAL;
+		descrA.diag = SPARSE_DIAG_NON_UNIT;
+		descrB.type = SPARSE_MATRIX_TYPE_GENERAL;
+		descrB.diag = SPARSE_DIAG_NON_UNIT;
+		descrC.type = SPARSE_MATRIX_TYPE_GENERAL;
+		descrC.diag = SPARSE_DIAG_NON_UNIT;
 	}
 
-	for (int i = 0; i < eigen_A.nonZeros(); ++i) {
-		csr_columns_A[i] = innerIndexPtr_A[i];
-		csr_values_A[i] = valuePtr_A[i];
-	}
+	~spgemm_mkl_t() { release_C(); }
 
-	sparse_matrix_t A;
-	sparse_status_t status = mkl_sparse_d_create_csr(&A, SPARSE_INDEX_BASE_ZERO, eigen_A.rows(), eigen_A.cols(),
-													 csr_row_pointer_A, csr_row_pointer_A + 1,
-													 csr_columns_A, csr_values_A);
-	if (status != SPARSE_STATUS_SUCCESS) {
-		std::cerr << "Failed to create CSR matrix with MKL. Error code: " << status << "\n";
-		return -1;
+	void release_C() {
+		if (C) mkl_sparse_destroy(C);
+		C = nullptr;
 	}
 
-	// Convert Eigen matrix B to MKL format using Eigen's internal data
-	const int* outerIndexPtr_B = eigen_B.outerIndexPtr();
-	const int* innerIndexPtr_B = eigen_B.innerIndexPtr();
-	const double* valuePtr_B = eigen_B.valuePtr();
-
-	MKL_INT *csr_row_pointer_B = (MKL_INT *)mkl_malloc((eigen_B.rows() + 1) * sizeof(MKL_INT), 64);
-	MKL_INT *csr_columns_B = (MKL_INT *)mkl_malloc(eigen_B.nonZeros() * sizeof(MKL_INT), 64);
-	double *csr_values_B = (double *)mkl_malloc(eigen_B.nonZeros() * sizeof(double), 64);
-
-	for (int i = 0; i <= eigen_B.rows(); ++i) {
-		csr_row_pointer_B[i] = outerIndexPtr_B[i];
+	void load(const std::string &input) {
+		release_C();
+		A.load(input, "A");
+		B.load(input, "B");
+		this->input = input;
 	}
 
-	for (int i = 0; i < eigen_B.nonZeros(); ++i) {
-		csr_columns_B[i] = innerIndexPtr_B[i];
-		csr_values_B[i] = valuePtr_B[i];
+	json run(const std::string &output, int reps) {
+		auto setup = [this]() {
+			release_C();
+			mkl_free_buffers();
+		};
+		auto test = [this]() {
+			mkl_sparse_sp2m(SPARSE_OPERATION_NON_TRANSPOSE, descrA, A.handle, SPARSE_OPERATION_NON_TRANSPOSE, descrB, B.handle, SPARSE_STAGE_FULL_MULT, &C);
+			mkl_sparse_order(C);
+		};
+		json measurements = sweep_threads(threads, [&](int threads) {
+			mkl_set_num_threads(threads);
+			if (numa) {
+				A.place_rows(threads);
+				B.place_rows(threads);
+			}
+			json entry;
+			entry.update(benchmark_samples(timing, setup, test, reps));
+			if (counters) entry.update(measure_counters(timing, setup, test, reps));
+			if (numa) entry["numa"] = {{"A", A.placement()}, {"B", B.placement()}};
+			return entry;
+		});
+		json memory = measure_memory([&]() {
+			setup();
+			mkl_peak_mem_usage(MKL_PEAK_MEM_RESET);
+		}, test);
+		memory["mkl_peak_bytes"] = mkl_peak_mem_usage(MKL_PEAK_MEM);
+		record_memory(measurements, memory, {
+			{"A", A.structure_bytes()},
+			{"B", B.structure_bytes()},
+			{"C", eigen_structure_bytes(mkl_csr_map(C))},
+		});
+		if (numa) measurements["numa_nodes"] = A.topology.nodes;
+		mkl_csr_map_t C_view = mkl_csr_map(C);
+		measurements["checksum"] = output_checksum(C_view.valuePtr(), C_view.nonZeros());
+		if (verify.enabled) {
+			measurements["verification"] = verify.spgemm(input, BINARY_CSR, C_view.rows(), C_view.cols(), C_view.outerIndexPtr(), C_view.innerIndexPtr(), C_view.valuePtr());
+		}
+		std::ofstream measurements_file(output + "/measurements.json");
+		measurements_file << measurements;
+		measurements_file.close();
+		return measurements;
 	}
 
-	sparse_matrix_t B;
-	status = mkl_sparse_d_create_csr(&B, SPARSE_INDEX_BASE_ZERO, eigen_B.rows(), eigen_B.cols(),
-									 csr_row_pointer_B, csr_row_pointer_B + 1,
-									 csr_columns_B, csr_values_B);
-	if (status != SPARSE_STATUS_SUCCESS) {
-		std::cerr << "Failed to create CSR matrix with MKL. Error code: " << status << "\n";
-		return -1;
+	void fetch(const std::string &output) {
+		// Save MKL's C through an Eigen view of its arrays
+		Eigen::saveMarket(mkl_csr_map(C), (output + "/C.ttx").c_str());
 	}
+};
 
-	matrix_descr descrA, descrB, descrC;
-
-	descrA.type = SPARSE_MATRIX_TYPE_GENERAL;
-	descrA.diag = SPARSE_DIAG_NON_UNIT;
-	descrB.type = SPARSE_MATRIX_TYPE_GENERAL;
-	descrB.diag = SPARSE_DIAG_NON_UNIT;
-	descrC.type = SPARSE_MATRIX_TYPE_GENERAL;
-	descrC.diag = SPARSE_DIAG_NON_UNIT;
+int main(int argc, char **argv) {
+	auto params = parse(argc, argv);
 
-	sparse_matrix_t C;
-	auto time = benchmark(
-		[]() {mkl_free_buffers();},
-		[&A, &descrA, &B, &descrB, &C, &descrC]() {
-			C = NULL;
-			mkl_sparse_sp2m(SPARSE_OPERATION_NON_TRANSPOSE, descrA, A, SPARSE_OPERATION_NON_TRANSPOSE, descrB, B, SPARSE_STAGE_FULL_MULT, &C);
-			mkl_sparse_order(C);
+	spgemm_mkl_t spgemm;
+	common_options_t options(spgemm.threads, spgemm.counters, spgemm.timing, &spgemm.verify);
+
+	std::vector<option> long_options = options.long_options({
+		{"help", no_argument, 0, 'h'},
+		{"numa", no_argument, 0, 'N'},
+	});
+	std::string short_options = options.short_options("hN");
+
+	// Parse the options
+	int option_index = 0;
+	int c;
+	optind = 1;
+	while ((c = getopt_long(params.argc, params.argv, short_options.c_str(), long_options.data(), &option_index)) != -1) {
+		switch (c) {
+			case 'h':
+				std::cout << "Options:" << std::endl;
+				std::cout << "  -h, --help      Print this help message" << std::endl;
+				std::cout << "  -N, --numa      Place each thread's rows of A and B on its NUMA node" << std::endl;
+				options.help(18, "load/verify/run/fetch", "C_ref.bin or A times B", "C.ttx");
+				exit(0);
+			case 'N':
+				spgemm.numa = true;
+				break;
+			case '?':
+				// getopt_long already printed an error message
+				break;
+			default:
+				if (!options.parse(c, optarg)) abort();
 		}
-	);
-
-	MKL_INT *rows_start_C;
-	MKL_INT *rows_end_C;
-	MKL_INT *columns_C;
-	double *values_C;
-	sparse_index_base_t indexing = SPARSE_INDEX_BASE_ZERO;
-
-	mkl_sparse_d_export_csr(C, &indexing, &m, &n, &rows_start_C, &rows_end_C, &columns_C, &values_C);
-
-	// Convert MKL matrix C to Eigen format
-	Eigen::SparseMatrix<double, Eigen::RowMajor> eigen_C(n, m);
-	eigen_C.resizeNonZeros(rows_start_C[m]);
-
-	for (int i = 0; i < m; ++i) {
-		eigen_C.outerIndexPtr()[i] = rows_start_C[i];
 	}
-	eigen_C.outerIndexPtr()[m] = rows_start_C[m];
 
-	for (int i = 0; i < rows_start_C[m]; ++i) {
-		eigen_C.innerIndexPtr()[i] = columns_C[i];
-		eigen_C.valuePtr()[i] = values_C[i];
+	std::map<std::string, server_command_t> commands = {
+		{"load", [&](const server_args_t &args) { spgemm.load(server_arg(args, 0, "input dir")); return json(); }},
+		{"numa", [&](const server_args_t &args) { spgemm.numa = server_arg(args, 0, "on|off") == "on"; return json(); }},
+		{"run", [&](const server_args_t &args) { return spgemm.run(server_arg(args, 0, "output dir"), server_reps(args, 1)); }},
+		{"fetch", [&](const server_args_t &args) { spgemm.fetch(server_arg(args, 0, "output dir")); return json(); }},
+	};
+	options.add_commands(commands);
+	if (options.server) return serve(commands);
+	if (!options.manifest.empty()) return run_manifest(options.manifest, commands, options.write_output);
+
+	try {
+		spgemm.load(params.input);
+	} catch (const std::runtime_error &e) {
+		std::cerr << e.what() << "\n";
+		return -1;
 	}
-
-	// Save the Eigen matrix to MatrixMarket format
-	Eigen::saveMarket(eigen_C, (params.output + "/C.ttx").c_str());
-
-	json measurements;
-	measurements["time"] = time;
-	measurements["memory"] = 0;
-	std::ofstream measurements_file(params.output + "/measurements.json");
-	measurements_file << measurements;
-	measurements_file.close();
-
+	spgemm.run(params.output, 0);
+	if (options.write_output) spgemm.fetch(params.output);
 	return 0;
 }
@@ -3,20 +3,23 @@ using TensorMarket
 using JSON
 function spgemm_mkl(A, B)
     tmpdir = mktempdir(@__DIR__, prefix="experiment_")
-    A_path = joinpath(tmpdir, "A.ttx")
-    B_path = joinpath(tmpdir, "B.ttx")
+    A_path = joinpath(tmpdir, "A.bin")
+    B_path = joinpath(tmpdir, "B.bin")
     C_path = joinpath(tmpdir, "C.ttx")
-    fwrite(A_path, Tensor(Dense(SparseList(Element(0.0))), A)) #TACO matrix market readerr can only read real-valued matrices
-    fwrite(B_path, Tensor(Dense(SparseList(Element(0.0))), B)) #TACO matrix market readerr can only read real-valued matrices
+    write_binary_matrix(A_path, A, layout=:csr)
+    write_binary_matrix(B_path, B, layout=:csr)
     mklvars_path = joinpath(@__DIR__, "../deps/intel/setvars.sh")
     spgemm_path = joinpath(@__DIR__, "spgemm_mkl")
-    withenv() do
-        cmd = "source $mklvars_path; $spgemm_path -i $tmpdir -o $tmpdir"
-        run(`bash -c $cmd`)
-    end 
-    C = fread(C_path)
-    time = JSON.parsefile(joinpath(tmpdir, "measurements.json"))["time"]
-    return (;time=time*10^-9, C=C)
+    cmd = "source $mklvars_path; exec $spgemm_path -- --server"
+    server = driver_server(`bash -c $cmd`)
+    driver_request(server, "load", tmpdir)
+    measurements = driver_request(server, "run", tmpdir)
+    C = nothing
+    if !driver_verify[]
+        driver_request(server, "fetch", tmpdir)
+        C = fread(C_path)
+    end
+    return (;time=measurements["time"]*10^-9, C=C, scaling=measurements["scaling"], memory=measurements["memory"], timing=measurements["timing"], counters=counter_measurements(measurements), verify_measurements(measurements)...)
 end
 
 has_mkl() = isfile(joinpath(@__DIR__, "spgemm_mkl"))
\ No newline at end of file
@@ -0,0 +1,519 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <sys/stat.h>
+#include <iostream>
+#include <cstdint>
+#include <vector>
+#include "../deps/SparseRooflineBenchmark/src/benchmark.hpp"
+#include "../common/server.hpp"
+#include "../common/threads.hpp"
+#include "../common/memory.hpp"
+#include "../common/perf_counters.hpp"
+#include "../common/timing.hpp"
+#include "../common/eigen_operand.hpp"
+#include "../common/csr_view.hpp"
+#include "../common/verify.hpp"
+#include "../common/numa.hpp"
+#include "../common/options.hpp"
+
+extern int optind;
+
+// Row accumulators of the Gustavson engine. AUTO picks one per row.
+enum accumulator_t { ACCUMULATOR_AUTO, ACCUMULATOR_DENSE, ACCUMULATOR_HASH, ACCUMULATOR_HEAP };
+
+const char *accumulator_names[] = {"auto", "dense", "hash", "heap"};
+
+accumulator_t parse_accumulator(const std::string &name) {
+  for (int a = 0; a < 4; a++) {
+    if (name == accumulator_names[a]) return (accumulator_t)a;
+  }
+  throw std::invalid_argument("Invalid accumulator " + name);
+}
+
+// Scratch of one thread of the Gustavson engine, reused across rows and
+// calls. Each row kernel returns the number of nonzeros in row i of C and,
+// when Numeric, also writes them in column order to out_idx and out_val.
+struct gustavson_workspace_t {
+  struct heap_entry_t {
+    sparse_index_t col;
+    sparse_index_t p;
+    sparse_index_t end;
+    double a;
+    bool operator>(const heap_entry_t &other) const { return col > other.col; }
+  };
+
+  std::vector<unsigned> mark;
+  std::vector<double> spa;
+  std::vector<sparse_index_t> cols;
+  std::vector<sparse_index_t> keys;
+  std::vector<double> sums;
+  std::vector<heap_entry_t> heap;
+  unsigned stamp = 0;
+
+  void reserve(sparse_index_t n) {
+    if ((sparse_index_t)mark.size() != n) {
+      mark.assign(n, 0);
+      spa.assign(n, 0);
+      stamp = 0;
+    }
+  }
+
+  template <bool Numeric>
+  sparse_index_t row_dense(const csr_view_t &A, const csr_view_t &B, sparse_index_t i, sparse_index_t *out_idx, double *out_val) {
+    if (++stamp == 0) {
+      std::fill(mark.begin(), mark.end(), 0);
+      stamp = 1;
+    }
+    cols.clear();
+    for (sparse_index_t q = A.pos[i]; q < A.pos[i + 1]; q++) {
+      sparse_index_t k = A.idx[q];
+      double a = A.val[q];
+      for (sparse_index_t p = B.pos[k]; p < B.pos[k + 1]; p++) {
+        sparse_index_t j = B.idx[p];
+        if (mark[j] != stamp) {
+          mark[j] = stamp;
+          cols.push_back(j);
+          if (Numeric) spa[j] = a * B.val[p];
+        } else if (Numeric) {
+          spa[j] += a * B.val[p];
+        }
+      }
+    }
+    if (Numeric) {
+      std::sort(cols.begin(), cols.end());
+      for (size_t n = 0; n < cols.size(); n++) {
+        out_idx[n] = cols[n];
+        out_val[n] = spa[cols[n]];
+      }
+    }
+    return cols.size();
+  }
+
+  template <bool Numeric>
+  sparse_index_t row_hash(const csr_view_t &A, const csr_view_t &B, sparse_index_t i, long flops, sparse_index_t *out_idx, double *out_val) {
+    long bound = std::min<long>(flops, B.cols);
+    size_t size = 16;
+    while (size < 2 * (size_t)bound) size *= 2;
+    size_t mask = size - 1;
+    keys.assign(size, -1);
+    if (Numeric) sums.resize(size);
+    sparse_index_t count = 0;
+    for (sparse_index_t q = A.pos[i]; q < A.pos[i + 1]; q++) {
+      sparse_index_t k = A.idx[q];
+      double a = A.val[q];
+      for (sparse_index_t p = B.pos[k]; p < B.pos[k + 1]; p++) {
+        sparse_index_t j = B.idx[p];
+        size_t h = ((uint64_t)j * 0x9e3779b97f4a7c15ull >> 32) & mask;
+        while (keys[h] != -1 && keys[h] != j) h = (h + 1) & mask;
+        if (keys[h] == -1) {
+          keys[h] = j;
+          count++;
+          if (Numeric) sums[h] = a * B.val[p];
+        } else if (Numeric) {
+          sums[h] += a * B.val[p];
+        }
+      }
+    }
+    if (Numeric) {
+      cols.clear();
+      for (size_t h = 0; h < size; h++) {
+        if (keys[h] != -1) cols.push_back(h);
+      }
+      std::sort(cols.begin(), cols.end(), [&](sparse_index_t x, sparse_index_t y) { return keys[x] < keys[y]; });
+      for (sparse_index_t n = 0; n < count; n++) {
+        out_idx[n] = keys[cols[n]];
+        out_val[n] = sums[cols[n]];
+      }
+    }
+    return count;
+  }
+
+  template <bool Numeric>
+  sparse_index_t row_heap(const csr_view_t &A, const csr_view_t &B, sparse_index_t i, sparse_index_t *out_idx, double *out_val) {
+    heap.clear();
+    for (sparse_index_t q = A.pos[i]; q < A.pos[i + 1]; q++) {
+      sparse_index_t k = A.idx[q];
+      if (B.pos[k] < B.pos[k + 1]) {
+        heap.push_back({B.idx[B.pos[k]], B.pos[k], B.pos[k + 1], A.val[q]});
+      }
+    }
+    std::make_heap(heap.begin(), heap.end(), std::greater<heap_entry_t>());
+    sparse_index_t count = 0;
+    sparse_index_t last = -1;
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), std::greater<heap_entry_t>());
+      heap_entry_t &e = heap.back();
+      if (e.col != last) {
+        if (Numeric) {
+          out_idx[count] = e.col;
+          out_val[count] = e.a * B.val[e.p];
+        }
+        count++;
+        last = e.col;
+      } else if (Numeric) {
+        out_val[count - 1] += e.a * B.val[e.p];
+      }
+      if (++e.p < e.end) {
+        e.col = B.idx[e.p];
+        std::push_heap(heap.begin(), heap.end(), std::greater<heap_entry_t>());
+      } else {
+        heap.pop_back();
+      }
+    }
+    return count;
+  }
+
+  size_t index_bytes() const {
+    return mark.capacity() * sizeof(unsigned) + (cols.capacity() + keys.capacity()) * sizeof(sparse_index_t) +
+           heap.capacity() * sizeof(heap_entry_t);
+  }
+
+  size_t value_bytes() const {
+    return (spa.capacity() + sums.capacity()) * sizeof(double);
+  }
+};
+
+// A contiguous range of chunks owned by one thread. Its owner and thieves
+// both claim chunks from `next`, so a chunk is run exactly once.
+struct alignas(64) chunk_queue_t {
+  std::atomic<int> next{0};
+  int end = 0;
+};
+
+// Row-by-row (Gustavson) SpGEMM C = A * B. A symbolic pass sizes every row
+// of C, then a numeric pass writes the rows straight into their slots of the
+// preallocated C, so threads never build private pieces that would need to be
+// concatenated. Each row uses the accumulator that suits its flop count, the
+// number of products a_ik * b_kj it contributes:
+//  - heap: a k-way merge of the B rows, cheapest for a handful of flops;
+//  - hash: an open-addressing table sized for the row's flops;
+//  - dense: a SPA over all columns of C, once the flops are a sizeable
+//    fraction of them.
+// Rows are grouped into chunks of about equal flops, chunks_per_thread per
+// thread, and each thread starts on its own share of the chunks and steals
+// from the others once it runs out, so a few heavy rows of a power-law matrix
+// do not leave the other threads idle.
+struct gustavson_t {
+  accumulator_t accumulator = ACCUMULATOR_AUTO;
+  // Rows with at most this many flops use the heap.
+  long heap_max_flops = 32;
+  // Rows with at least this fraction of B.cols as flops use the dense SPA.
+  double dense_min_fraction = 1.0 / 16;
+  int chunks_per_thread = 8;
+
+  std::vector<sparse_index_t> C_pos;
+  // Pages of C that the numeric pass touches first, see symbolic().
+  numa_array_t<sparse_index_t> C_idx;
+  numa_array_t<double> C_val;
+  int C_threads = 0;
+  std::vector<long> row_flops;
+  std::vector<unsigned char> row_accumulator;
+  std::vector<long> flops_prefix;
+  // Rows [chunk_rows[c], chunk_rows[c + 1]) form chunk c.
+  std::vector<sparse_index_t> chunk_rows;
+  std::vector<long> chunk_nnz;
+  std::vector<chunk_queue_t> queues;
+  std::vector<gustavson_workspace_t> workspaces;
+  long long symbolic_time = 0;
+  long long numeric_time = 0;
+  long long steals = 0;
+
+  accumulator_t choose(long flops, sparse_index_t n) const {
+    if (accumulator != ACCUMULATOR_AUTO) return accumulator;
+    if (flops <= heap_max_flops) return ACCUMULATOR_HEAP;
+    if (flops >= dense_min_fraction * n) return ACCUMULATOR_DENSE;
+    return ACCUMULATOR_HASH;
+  }
+
+  static int num_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+  }
+
+  void multiply(const csr_view_t &A, const csr_view_t &B) {
+    if (A.cols != B.rows) {
+      throw std::invalid_argument("Dimension mismatch in SpGEMM");
+    }
+    auto tic = std::chrono::high_resolution_clock::now();
+    steals = 0;
+    partition(A, B);
+    symbolic(A, B);
+    auto mid = std::chrono::high_resolution_clock::now();
+    numeric(A, B);
+    auto toc = std::chrono::high_resolution_clock::now();
+    symbolic_time = std::chrono::duration_cast<std::chrono::nanoseconds>(mid - tic).count();
+    numeric_time = std::chrono::duration_cast<std::chrono::nanoseconds>(toc - mid).count();
+  }
+
+  // Count the flops and pick the accumulator of every row, then cut the rows
+  // into chunks of about equal work. An empty row still costs one unit.
+  void partition(const csr_view_t &A, const csr_view_t &B) {
+    sparse_index_t m = A.rows;
+    row_flops.resize(m);
+    row_accumulator.resize(m);
+    #pragma omp parallel for schedule(static)
+    for (sparse_index_t i = 0; i < m; i++) {
+      long flops = 0;
+      for (sparse_index_t q = A.pos[i]; q < A.pos[i + 1]; q++) {
+        sparse_index_t k = A.idx[q];
+        flops += B.pos[k + 1] - B.pos[k];
+      }
+      row_flops[i] = flops;
+      row_accumulator[i] = choose(flops, B.cols);
+    }
+    flops_prefix.resize(m + 1);
+    flops_prefix[0] = 0;
+    for (sparse_index_t i = 0; i < m; i++) {
+      flops_prefix[i + 1] = flops_prefix[i] + row_flops[i] + 1;
+    }
+
+    int threads = num_threads();
+    int chunks = (int)std::max<sparse_index_t>(1, std::min<sparse_index_t>(m, threads * chunks_per_thread));
+    chunk_rows.resize(chunks + 1);
+    for (int c = 0; c <= chunks; c++) {
+      long target = flops_prefix[m] * c / chunks;
+      chunk_rows[c] = std::lower_bound(flops_prefix.begin(), flops_prefix.end(), target) - flops_prefix.begin();
+    }
+    chunk_rows[chunks] = m;
+    chunk_nnz.resize(chunks);
+
+    if ((int)workspaces.size() != threads) {
+      workspaces = std::vector<gustavson_workspace_t>(threads);
+      queues = std::vector<chunk_queue_t>(threads);
+    }
+    for (auto &workspace : workspaces) workspace.reserve(B.cols);
+  }
+
+  // Run chunk(c, workspace) for every chunk, each thread first draining its
+  // own queue and then stealing from the others in turn.
+  template <typename Chunk>
+  void for_each_chunk(Chunk chunk) {
+    int chunks = chunk_rows.size() - 1;
+    int threads = workspaces.size();
+    for (int t = 0; t < threads; t++) {
+      queues[t].next = (long)chunks * t / threads;
+      queues[t].end = (long)chunks * (t + 1) / threads;
+    }
+    long long stolen = 0;
+    #pragma omp parallel num_threads(threads) reduction(+:stolen)
+    {
+#ifdef _OPENMP
+      int t = omp_get_thread_num();
+#else
+      int t = 0;
+#endif
+      for (int v = 0; v < threads; v++) {
+        chunk_queue_t &queue = queues[(t + v) % threads];
+        for (int c = queue.next++; c < queue.end; c = queue.next++) {
+          chunk(c, workspaces[t]);
+          stolen += v > 0;
+        }
+      }
+    }
+    steals += stolen;
+  }
+
+  void symbolic(const csr_view_t &A, const csr_view_t &B) {
+    sparse_index_t m = A.rows;
+    C_pos.resize(m + 1);
+    for_each_chunk([&](int c, gustavson_workspace_t &workspace) {
+      long nnz = 0;
+      for (sparse_index_t i = chunk_rows[c]; i < chunk_rows[c + 1]; i++) {
+        sparse_index_t count = 0;
+        if (row_flops[i] > 0) {
+          switch (row_accumulator[i]) {
+            case ACCUMULATOR_DENSE: count = workspace.row_dense<false>(A, B, i, nullptr, nullptr); break;
+            case ACCUMULATOR_HASH: count = workspace.row_hash<false>(A, B, i, row_flops[i], nullptr, nullptr); break;
+            default: count = workspace.row_heap<false>(A, B, i, nullptr, nullptr); break;
+          }
+        }
+        C_pos[i + 1] = count;
+        nnz += count;
+      }
+      chunk_nnz[c] = nnz;
+    });
+
+    // Offsets of the chunks, then of the rows within each chunk.
+    int chunks = chunk_rows.size() - 1;
+    std::vector<long> chunk_start(chunks + 1, 0);
+    for (int c = 0; c < chunks; c++) {
+      chunk_start[c + 1] = chunk_start[c] + chunk_nnz[c];
+    }
+    C_pos[0] = 0;
+    #pragma omp parallel for schedule(static)
+    for (int c = 0; c < chunks; c++) {
+      long offset = chunk_start[c];
+      for (sparse_index_t i = chunk_rows[c]; i < chunk_rows[c + 1]; i++) {
+        offset += C_pos[i + 1];
+        C_pos[i + 1] = offset;
+      }
+    }
+    // Fresh pages whenever the size of C or the team changes, instead of a
+    // serial zero fill here: each thread then places the rows of its own
+    // chunks on its node, and with pinned threads they stay there for the
+    // later runs that reuse them.
+    size_t nnz = C_pos[m];
+    if (C_idx.size() != nnz || C_threads != (int)workspaces.size()) {
+      C_idx = numa_array_t<sparse_index_t>(nnz);
+      C_val = numa_array_t<double>(nnz);
+      C_threads = workspaces.size();
+    }
+  }
+
+  void numeric(const csr_view_t &A, const csr_view_t &B) {
+    for_each_chunk([&](int c, gustavson_workspace_t &workspace) {
+      for (sparse_index_t i = chunk_rows[c]; i < chunk_rows[c + 1]; i++) {
+        if (row_flops[i] == 0) continue;
+        sparse_index_t *out_idx = C_idx.data() + C_pos[i];
+        double *out_val = C_val.data() + C_pos[i];
+        switch (row_accumulator[i]) {
+          case ACCUMULATOR_DENSE: workspace.row_dense<true>(A, B, i, out_idx, out_val); break;
+          case ACCUMULATOR_HASH: workspace.row_hash<true>(A, B, i, row_flops[i], out_idx, out_val); break;
+          default: workspace.row_heap<true>(A, B, i, out_idx, out_val); break;
+        }
+      }
+    });
+  }
+
+  json workspace_bytes() const {
+    size_t index = row_flops.capacity() * sizeof(long) + row_accumulator.capacity() +
+                   (flops_prefix.capacity() + chunk_nnz.capacity()) * sizeof(long) +
+                   chunk_rows.capacity() * sizeof(sparse_index_t) + queues.capacity() * sizeof(chunk_queue_t);
+    size_t value = 0;
+    for (auto &workspace : workspaces) {
+      index += workspace.index_bytes();
+      value += workspace.value_bytes();
+    }
+    return structure_bytes(index, value);
+  }
+};
+
+struct spgemm_native_t {
+  thread_sweep_t threads;
+  // Also read hardware counters around the measured call.
+  bool counters = false;
+  // Warmup, sample count and cache flushing of the measured call.
+  timing_t timing;
+  // Check the result against a reference after each run.
+  verify_t verify;
+  eigen_operand_t<Eigen::RowMajor> A;
+  eigen_operand_t<Eigen::RowMajor> B;
+  gustavson_t engine;
+  std::string input;
+
+  void load(const std::string &input) {
+    A.load(input, "A");
+    B.load(input, "B");
+    this->input = input;
+  }
+
+  json run(const std::string &output, int reps) {
+    csr_view_t A_view = csr_view(*A);
+    csr_view_t B_view = csr_view(*B);
+    auto setup = []() {};
+    auto test = [&]() {
+      engine.multiply(A_view, B_view);
+    };
+    json measurements = sweep_threads(threads, [&](int) {
+      json entry;
+      entry.update(benchmark_samples(timing, setup, test, reps));
+      entry["symbolic_time"] = engine.symbolic_time;
+      entry["numeric_time"] = engine.numeric_time;
+      entry["chunks"] = engine.chunk_rows.size() - 1;
+      entry["steals"] = engine.steals;
+      if (counters) entry.update(measure_counters(timing, setup, test, reps));
+      return entry;
+    });
+    size_t nnz = engine.C_idx.size();
+    record_memory(measurements, measure_memory(setup, test), {
+      {"A", eigen_structure_bytes(*A)},
+      {"B", eigen_structure_bytes(*B)},
+      {"C", structure_bytes((engine.C_pos.size() + nnz) * sizeof(sparse_index_t), nnz * sizeof(double))},
+      {"accumulators", engine.workspace_bytes()},
+    });
+
+    json rows;
+    for (int a = ACCUMULATOR_DENSE; a <= ACCUMULATOR_HEAP; a++) {
+      rows[accumulator_names[a]] = std::count(engine.row_accumulator.begin(), engine.row_accumulator.end(), a);
+    }
+    measurements["accumulator"] = accumulator_names[engine.accumulator];
+    measurements["accumulator_rows"] = rows;
+    measurements["checksum"] = output_checksum(engine.C_val.data(), nnz);
+    if (verify.enabled) {
+      measurements["verification"] = verify.spgemm(input, BINARY_CSR, A->rows(), B->cols(), engine.C_pos.data(), engine.C_idx.data(), engine.C_val.data());
+    }
+    std::ofstream measurements_file(output + "/measurements.json");
+    measurements_file << measurements;
+    measurements_file.close();
+    return measurements;
+  }
+
+  void fetch(const std::string &output) {
+    Eigen::Map<Eigen::SparseMatrix<double, Eigen::RowMajor, sparse_index_t>> C(
+        A->rows(), B->cols(), engine.C_idx.size(), engine.C_pos.data(), engine.C_idx.data(), engine.C_val.data());
+    Eigen::saveMarket(C, (output + "/C.ttx").c_str());
+  }
+};
+
+int main(int argc, char **argv) {
+  auto params = parse(argc, argv);
+
+  spgemm_native_t spgemm;
+  common_options_t options(spgemm.threads, spgemm.counters, spgemm.timing, &spgemm.verify);
+
+  std::vector<option> long_options = options.long_options({
+    {"help", no_argument, 0, 'h'},
+    {"accumulator", required_argument, 0, 'a'},
+  });
+  std::string short_options = options.short_options("ha:");
+
+  // Parse the options
+  int option_index = 0;
+  int c;
+  optind = 1;
+  while ((c = getopt_long(params.argc, params.argv, short_options.c_str(), long_options.data(), &option_index)) != -1) {
+    switch (c) {
+      case 'h':
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -h, --help         Print this help message" << std::endl;
+        std::cout << "  -a, --accumulator  Row accumulator, from [auto, dense, hash, heap]" << std::endl;
+        options.help(21, "load/accumulator/verify/run/fetch", "C_ref.bin or A times B", "C.ttx");
+        exit(0);
+      case 'a':
+        try {
+          spgemm.engine.accumulator = parse_accumulator(optarg);
+        } catch (const std::invalid_argument &e) {
+          std::cerr << e.what() << std::endl;
+          exit(1);
+        }
+        break;
+      case '?':
+        // getopt_long already printed an error message
+        break;
+      default:
+        if (!options.parse(c, optarg)) abort();
+    }
+  }
+
+  std::map<std::string, server_command_t> commands = {
+    {"load", [&](const server_args_t &args) { spgemm.load(server_arg(args, 0, "input dir")); return json(); }},
+    {"accumulator", [&](const server_args_t &args) {
+      spgemm.engine.accumulator = parse_accumulator(server_arg(args, 0, "name"));
+      return json();
+    }},
+    {"run", [&](const server_args_t &args) { return spgemm.run(server_arg(args, 0, "output dir"), server_reps(args, 1)); }},
+    {"fetch", [&](const server_args_t &args) { spgemm.fetch(server_arg(args, 0, "output dir")); return json(); }},
+  };
+  options.add_commands(commands);
+  if (options.server) return serve(commands);
+  if (!options.manifest.empty()) return run_manifest(options.manifest, commands, options.write_output);
+
+  spgemm.load(params.input);
+  spgemm.run(params.output, 0);
+  if (options.write_output) spgemm.fetch(params.output);
+  return 0;
+}
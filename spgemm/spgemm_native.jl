@@ -0,0 +1,29 @@
+using Finch
+using TensorMarket
+using JSON
+function spgemm_native_helper(accumulator, A, B)
+    tmpdir = mktempdir(@__DIR__, prefix="experiment_")
+    A_path = joinpath(tmpdir, "A.bin")
+    B_path = joinpath(tmpdir, "B.bin")
+    C_path = joinpath(tmpdir, "C.ttx")
+    write_binary_matrix(A_path, A, layout=:csr, index_type=Int32)
+    write_binary_matrix(B_path, B, layout=:csr, index_type=Int32)
+    spgemm_path = joinpath(@__DIR__, "spgemm_native")
+    server = driver_server(`$spgemm_path -- --server`)
+    driver_request(server, "load", tmpdir)
+    driver_request(server, "accumulator", accumulator)
+    measurements = driver_request(server, "run", tmpdir)
+    C = nothing
+    if !driver_verify[]
+        driver_request(server, "fetch", tmpdir)
+        C = fread(C_path)
+    end
+    return (;time=measurements["time"]*10^-9, C=C, scaling=measurements["scaling"], memory=measurements["memory"], timing=measurements["timing"], counters=counter_measurements(measurements), verify_measurements(measurements)...)
+end
+
+spgemm_native(A, B) = spgemm_native_helper("auto", A, B)
+spgemm_native_dense(A, B) = spgemm_native_helper("dense", A, B)
+spgemm_native_hash(A, B) = spgemm_native_helper("hash", A, B)
+spgemm_native_heap(A, B) = spgemm_native_helper("heap", A, B)
+
+has_native() = isfile(joinpath(@__DIR__, "spgemm_native"))
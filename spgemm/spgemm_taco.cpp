@@ -4,144 +4,289 @@
 #include <iostream>
 #include <cstdint>
 #include "../deps/SparseRooflineBenchmark/src/benchmark.hpp"
+#include "../common/server.hpp"
+#include "../common/threads.hpp"
+#include "../common/memory.hpp"
+#include "../common/perf_counters.hpp"
+#include "../common/timing.hpp"
+#include "../common/taco_operand.hpp"
+#include "../common/taco_kernel_cache.hpp"
+#include "../common/verify.hpp"
+#include "../common/options.hpp"
 
 namespace fs = std::filesystem;
 
 using namespace taco;
 extern int optind;
 
+Format parse_format(const std::string &name, const std::string &operand) {
+  if (name == "csr") {
+    return Format({Dense, Sparse});
+  } else if (name == "dcsr") {
+    return Format({Sparse, Sparse});
+  } else if (name == "dense") {
+    return Format({Dense, Dense});
+  }
+  throw std::invalid_argument("Invalid format for " + operand);
+}
+
+struct spgemm_taco_t {
+  thread_sweep_t threads;
+  // Also read hardware counters around the measured call.
+  bool counters = false;
+  // Warmup, sample count and cache flushing of the measured call.
+  timing_t timing;
+  // Check the result against a reference after each run.
+  verify_t verify;
+  std::string schedule = "gustavson";
+  std::string format_a = "csr";
+  std::string format_b = "csr";
+  taco_operand_t A_file, B_file;
+  fs::path input;
+  // The formats A and B were last loaded in.
+  std::string loaded_a, loaded_b;
+  Tensor<double> A;
+  Tensor<double> B;
+  Tensor<double> C;
+  bool needs_compile = true;
+  // Rows per dynamically scheduled task of gustavson-parallel.
+  int chunk = 16;
+  // Nanoseconds the last run spent compiling, 0 when it reused the kernel.
+  long long compile_time = 0;
+
+  void load(const fs::path &input) {
+    A = A_file.load(input, "A", parse_format(format_a, "A"));
+    B = B_file.load(input, "B", parse_format(format_b, "B"));
+    this->input = input;
+    loaded_a = format_a;
+    loaded_b = format_b;
+    needs_compile = true;
+  }
+
+  void set_schedule(const std::string &name) {
+    if (name != "inner" && name != "gustavson" && name != "outer" && name != "gustavson-parallel") {
+      throw std::invalid_argument("Invalid schedule");
+    }
+    needs_compile = needs_compile || name != schedule;
+    schedule = name;
+  }
+
+  void set_chunk(int rows) {
+    if (rows < 1) {
+      throw std::invalid_argument("chunk must be positive");
+    }
+    needs_compile = needs_compile || rows != chunk;
+    chunk = rows;
+  }
+
+  // Within one process TACO reuses the module of an isomorphic statement it has
+  // already compiled, so after the first matrix this is a cache lookup, and the
+  // kernel cache (taco_kernel_cache.hpp) spares later processes the compiler.
+  void compile() {
+    compile_time = 0;
+    if (!needs_compile) return;
+    int m = A.getDimension(0);
+    int n = B.getDimension(1);
+
+    if (schedule != "outer") {
+      C = Tensor<double>("C", {m, n}, Format({Dense, Sparse}));
+    } else {
+      C = Tensor<double>("C", {m, n}, Format({Dense, Dense}));
+    }
+
+    IndexVar i("i"), j("j"), k("k");
+    IndexStmt stmt;
+
+    if (schedule == "inner") {
+      C(i, j) += A(i, k) * B(j, k);
+      stmt = C.getAssignment().concretize();
+      stmt = stmt.reorder({i,j,k});
+    } else if (schedule == "gustavson") {
+      C(i, j) += A(i, k) * B(k, j);
+      stmt = C.getAssignment().concretize();
+    } else if (schedule == "gustavson-parallel") {
+      // Each row of C accumulates in a dense workspace, which TACO gives every
+      // thread its own copy of, and chunks of rows run on any thread
+      IndexExpr product = A(i, k) * B(k, j);
+      C(i, j) = product;
+      TensorVar w("w", Type(Float64, {Dimension(n)}), Format({Dense}));
+      IndexVar i0("i0"), i1("i1");
+      stmt = C.getAssignment().concretize();
+      stmt = stmt.reorder({i,k,j}).precompute(product, j, j, w);
+      stmt = stmt.split(i, i0, i1, chunk).parallelize(i0, ParallelUnit::CPUThread, OutputRaceStrategy::NoRaces);
+    } else {
+      C(i, j) += A(k, i) * B(k, j);
+      stmt = C.getAssignment().concretize();
+      stmt = stmt.reorder({k,i,j});
+    }
+
+    auto tic = std::chrono::high_resolution_clock::now();
+    if (schedule == "gustavson-parallel") {
+      taco_compile_scheduled(C, stmt, ParallelSchedule::Dynamic, 1);
+    } else {
+      C.compile(stmt);
+    }
+    compile_time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - tic).count();
+    needs_compile = false;
+  }
+
+  json run(const fs::path &output, int reps) {
+    if (format_a != loaded_a || format_b != loaded_b) {
+      load(input);
+    }
+    compile();
+
+    // Assemble output indices and numerically compute the result
+    auto setup = [this]() {
+      C.setNeedsAssemble(true);
+      C.setNeedsCompute(true);
+    };
+    auto test = [this]() {
+      C.assemble(); //no need for dense ouptut
+      C.compute();
+    };
+    json measurements = sweep_threads(threads, [&](int) {
+      json entry;
+      entry.update(benchmark_samples(timing, setup, test, reps));
+      if (counters) entry.update(measure_counters(timing, setup, test, reps));
+      return entry;
+    });
+    record_memory(measurements, measure_memory(setup, test), {
+      {"A", taco_structure_bytes(A)},
+      {"B", taco_structure_bytes(B)},
+      {"C", taco_structure_bytes(C)},
+    });
+    measurements["compile_time"] = compile_time;
+    if (schedule == "gustavson-parallel") {
+      measurements["chunk"] = chunk;
+      measurements["omp_schedule"] = taco_omp_schedule(C);
+    }
+    // The inner schedule reads B^T and the outer one A^T from the input
+    bool transpose_a = schedule == "outer";
+    bool transpose_b = schedule == "inner";
+    if (schedule == "outer") {
+      const double *values = (const double *)C.getStorage().getValues().getData();
+      size_t size = (size_t)C.getDimension(0) * C.getDimension(1);
+      measurements["checksum"] = output_checksum(values, size);
+      if (verify.enabled) {
+        measurements["verification"] = verify.spgemm_dense(input, C.getDimension(0), C.getDimension(1), values, transpose_a, transpose_b);
+      }
+    } else {
+      taco_csr_arrays_t csr = taco_csr_arrays(C);
+      measurements["checksum"] = output_checksum(csr.val, csr.pos[csr.rows]);
+      if (verify.enabled) {
+        measurements["verification"] = verify.spgemm(input, BINARY_CSR, csr.rows, csr.cols, csr.pos, csr.idx, csr.val, transpose_a, transpose_b);
+      }
+    }
+    std::ofstream measurements_file(output/"measurements.json");
+    measurements_file << measurements;
+    measurements_file.close();
+    return measurements;
+  }
+
+  void fetch(const fs::path &output) {
+    write(output/"C.ttx", C);
+  }
+};
+
 int main(int argc, char **argv) {
+  int status = taco_kernel_cache_main(argc, argv);
+  if (status >= 0) return status;
+  enable_taco_kernel_cache();
+
   auto params = parse(argc, argv);
 
-  static struct option long_options[] = {
+  spgemm_taco_t spgemm;
+  common_options_t options(spgemm.threads, spgemm.counters, spgemm.timing, &spgemm.verify);
+
+  std::vector<option> long_options = options.long_options({
     {"help", no_argument, 0, 'h'},
     {"schedule", required_argument, 0, 's'},
     {"format_a", required_argument, 0, 'a'},
     {"format_b", required_argument, 0, 'b'},
-    {0, 0, 0, 0}
-  };
-
-  std::string schedule = "gustavson";
-  std::string format_a = "csr";
-  std::string format_b = "csr";
+    {"chunk", required_argument, 0, 'C'},
+  });
+  std::string short_options = options.short_options("hs:a:b:C:");
 
   // Parse the options
   int option_index = 0;
   int c;
   optind = 1;
-  while ((c = getopt_long(params.argc, params.argv, "hs:a:b:", long_options, &option_index)) != -1) {
+  while ((c = getopt_long(params.argc, params.argv, short_options.c_str(), long_options.data(), &option_index)) != -1) {
     switch (c) {
       case 'h':
         std::cout << "Options:" << std::endl;
         std::cout << "  -h, --help      Print this help message" << std::endl;
-        std::cout << "  -s, --schedule  Execution schedule, from [gustavson, inner, outer]" << std::endl;
+        std::cout << "  -s, --schedule  Execution schedule, from [gustavson, inner, outer, gustavson-parallel]" << std::endl;
         std::cout << "  -a, --format_a  Format of A, from [csr, dcsr, dense]" << std::endl;
         std::cout << "  -b, --format_b  Format of B, from [csr, dcsr, dense]" << std::endl;
+        std::cout << "  -C, --chunk     Rows per dynamically scheduled task of gustavson-parallel (default 16)" << std::endl;
+        options.help(18, "load/schedule/format/chunk/verify/run/fetch", "C_ref.bin or A times B", "C.ttx");
         exit(0);
       case 's':
-        schedule = optarg;
+        spgemm.schedule = optarg;
         break;
       case 'a':
-        format_a = optarg;
+        spgemm.format_a = optarg;
         break;
       case 'b':
-        format_b = optarg;
+        spgemm.format_b = optarg;
+        break;
+      case 'C':
+        try {
+          spgemm.set_chunk(std::stoi(optarg));
+        } catch (const std::exception &e) {
+          std::cerr << "Invalid chunk" << std::endl;
+          exit(1);
+        }
         break;
       case '?':
         // getopt_long already printed an error message
         break;
       default:
-        abort();
+        if (!options.parse(c, optarg)) abort();
     }
   }
 
+  std::map<std::string, server_command_t> commands = {
+    {"load", [&](const server_args_t &args) { spgemm.load(server_arg(args, 0, "input dir")); return json(); }},
+    {"schedule", [&](const server_args_t &args) { spgemm.set_schedule(server_arg(args, 0, "name")); return json(); }},
+    // Formats take effect at the next load or run.
+    {"format", [&](const server_args_t &args) {
+      parse_format(server_arg(args, 0, "format_a"), "A");
+      parse_format(server_arg(args, 1, "format_b"), "B");
+      spgemm.format_a = args[0];
+      spgemm.format_b = args[1];
+      return json();
+    }},
+    {"chunk", [&](const server_args_t &args) { spgemm.set_chunk(std::stoi(server_arg(args, 0, "rows"))); return json(); }},
+    {"run", [&](const server_args_t &args) { return spgemm.run(server_arg(args, 0, "output dir"), server_reps(args, 1)); }},
+    {"fetch", [&](const server_args_t &args) { spgemm.fetch(server_arg(args, 0, "output dir")); return json(); }},
+  };
+  options.add_commands(commands);
+  if (options.server) return serve(commands);
+  if (!options.manifest.empty()) return run_manifest(options.manifest, commands, options.write_output);
+
   // Check that all required options are present
   if (params.input.empty() || params.output.empty()) {
     std::cerr << "Missing required option" << std::endl;
     exit(1);
   }
 
-  Tensor<double> A;
-  if (format_a == "csr") {
-    A = read(fs::path(params.input)/"A.ttx", Format({Dense, Sparse}), true);
-  } else if (format_a == "dcsr") {
-    A = read(fs::path(params.input)/"A.ttx", Format({Sparse, Sparse}), true);
-  } else if (format_a == "dense") {
-    A = read(fs::path(params.input)/"A.ttx", Format({Dense, Dense}), true);
-  } else {
-    std::cerr << "Invalid format for A" << std::endl;
-    exit(1);
-  }
-  Tensor<double> B;
-  if (format_b == "csr") {
-    B = read(fs::path(params.input)/"B.ttx", Format({Dense, Sparse}), true);
-  } else if (format_b == "dcsr") {
-    B = read(fs::path(params.input)/"B.ttx", Format({Sparse, Sparse}), true);
-  } else if (format_b == "dense") {
-    B = read(fs::path(params.input)/"B.ttx", Format({Dense, Dense}), true);
-  } else {
-    std::cerr << "Invalid format for B" << std::endl;
+  try {
+    spgemm.set_schedule(spgemm.schedule);
+    spgemm.load(params.input);
+  } catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
     exit(1);
   }
 
-  int m = A.getDimension(0);
-  int n = B.getDimension(1);
-
-  Tensor<double> C;
-
-  if (schedule == "inner" || schedule == "gustavson") {
-    C = Tensor<double>("C", {m, n}, Format({Dense, Sparse}));
-  } else if (schedule == "outer") {
-    C = Tensor<double>("C", {m, n}, Format({Dense, Dense}));
-  } else {
-    std::cerr << "Invalid schedule" << std::endl;
-    exit(1);
-  }
-
-  IndexVar i, j, k;
-  IndexStmt stmt;
-
-  if (schedule == "inner") {
-    C(i, j) += A(i, k) * B(j, k);
-    stmt= C.getAssignment().concretize();
-    stmt = stmt.reorder({i,j,k}); 
-  } else if (schedule == "gustavson") {
-    C(i, j) += A(i, k) * B(k, j);
-  } else if (schedule == "outer") {
-    C(i, j) += A(k, i) * B(k, j);
-    stmt = C.getAssignment().concretize();
-    stmt = stmt.reorder({k,i,j});
-  } else {
-    std::cerr << "Invalid schedule" << std::endl;
-    exit(1);
-  }
-
-  C.compile();
-
-  // Assemble output indices and numerically compute the result
-  auto time = benchmark(
-    [&C]() {
-      C.setNeedsAssemble(true);
-      C.setNeedsCompute(true);
-    },
-    [&C]() {
-      C.assemble(); //no need for dense ouptut
-      C.compute();
-    }
-  );
-
-  write(fs::path(params.output)/"C.ttx", C);
+  spgemm.run(params.output, 0);
+  if (options.write_output) spgemm.fetch(params.output);
 
   if (params.verbose) {
-    C.printAssembleIR(std::cout, true, true);
-    C.printComputeIR(std::cout, true, true);
+    spgemm.C.printAssembleIR(std::cout, true, true);
+    spgemm.C.printComputeIR(std::cout, true, true);
   }
-
-  json measurements;
-  measurements["time"] = time;
-  measurements["memory"] = 0;
-  std::ofstream measurements_file(fs::path(params.output)/"measurements.json");
-  measurements_file << measurements;
-  measurements_file.close();
   return 0;
 }
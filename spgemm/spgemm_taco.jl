@@ -1,25 +1,31 @@
 using Finch
 using TensorMarket
 using JSON
-function spgemm_taco(args, A, B)
+function spgemm_taco(schedule, A, B)
     tmpdir = mktempdir(@__DIR__, prefix="experiment_")
-    A_path = joinpath(tmpdir, "A.ttx")
-    B_path = joinpath(tmpdir, "B.ttx")
+    A_path = joinpath(tmpdir, "A.bin")
+    B_path = joinpath(tmpdir, "B.bin")
     C_path = joinpath(tmpdir, "C.ttx")
-    fwrite(A_path, Tensor(Dense(SparseList(Element(0.0))), A)) #TACO matrix market readerr can only read real-valued matrices
-    fwrite(B_path, Tensor(Dense(SparseList(Element(0.0))), B)) #TACO matrix market readerr can only read real-valued matrices
+    write_binary_matrix(A_path, A, layout=:csr, index_type=Int32)
+    write_binary_matrix(B_path, B, layout=:csr, index_type=Int32)
     taco_path = joinpath(@__DIR__, "../deps/taco/build/lib")
-    withenv("DYLD_FALLBACK_LIBRARY_PATH"=>"$taco_path", "LD_LIBRARY_PATH" => "$taco_path", "TACO_CFLAGS" => "-O3 -ffast-math -std=c99 -march=native -ggdb") do
-        spgemm_path = joinpath(@__DIR__, "spgemm_taco")
-        run(`$spgemm_path -i $tmpdir -o $tmpdir -- $args`)
+    spgemm_path = joinpath(@__DIR__, "spgemm_taco")
+    server = driver_server(addenv(`$spgemm_path -- --server`, "DYLD_FALLBACK_LIBRARY_PATH"=>"$taco_path", "LD_LIBRARY_PATH" => "$taco_path", "TACO_CFLAGS" => "-O3 -ffast-math -std=c99 -march=native -fopenmp -ggdb"))
+    driver_request(server, "load", tmpdir)
+    driver_request(server, "schedule", schedule)
+    driver_request(server, "chunk", taco_chunk[])
+    measurements = driver_request(server, "run", tmpdir)
+    C = nothing
+    if !driver_verify[]
+        driver_request(server, "fetch", tmpdir)
+        C = fread(C_path)
     end
-    C = fread(C_path)
-    time = JSON.parsefile(joinpath(tmpdir, "measurements.json"))["time"]
-    return (;time=time*10^-9, C=C)
+    return (;time=measurements["time"]*10^-9, C=C, compile_time=measurements["compile_time"]*10^-9, scaling=measurements["scaling"], memory=measurements["memory"], timing=measurements["timing"], counters=counter_measurements(measurements), verify_measurements(measurements)...)
 end
 
-spgemm_taco_inner(A, B) = spgemm_taco(`--schedule inner`, A, permutedims(B))
-spgemm_taco_gustavson(A, B) = spgemm_taco(`--schedule gustavson`, A, B)
-spgemm_taco_outer(A, B) = spgemm_taco(`--schedule outer`, permutedims(A), B)
+spgemm_taco_inner(A, B) = spgemm_taco("inner", A, permutedims(B))
+spgemm_taco_gustavson(A, B) = spgemm_taco("gustavson", A, B)
+spgemm_taco_outer(A, B) = spgemm_taco("outer", permutedims(A), B)
+spgemm_taco_gustavson_parallel(A, B) = spgemm_taco("gustavson-parallel", A, B)
 
 has_taco() = isfile(joinpath(@__DIR__, "spgemm_taco"))
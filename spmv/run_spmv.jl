@@ -22,6 +22,46 @@ s = ArgParseSettings("Run SPMV experiments.")
         arg_type = String
         help = "output file path"
         default = "spmv_results.json"
+    "--threads", "-t"
+        arg_type = String
+        help = "comma separated thread counts for the C++ drivers"
+        default = "1"
+    "--pin"
+        action = :store_true
+        help = "pin C++ driver threads to cores"
+    "--counters"
+        action = :store_true
+        help = "read hardware performance counters in the C++ drivers"
+    "--warmup"
+        arg_type = Int
+        help = "untimed calls before the C++ drivers start sampling"
+        default = 0
+    "--min_time"
+        arg_type = Float64
+        help = "seconds the C++ drivers sample each run for at least"
+        default = 0.2
+    "--min_reps"
+        arg_type = Int
+        help = "samples the C++ drivers take per run at least"
+        default = 1
+    "--flush"
+        action = :store_true
+        help = "flush the last level cache before every timed call in the C++ drivers"
+    "--verify"
+        action = :store_true
+        help = "check results inside the C++ drivers instead of fetching them"
+    "--tolerance"
+        arg_type = Float64
+        help = "largest error the C++ drivers accept, relative to the largest reference value"
+        default = 1e-9
+    "--num_vectors", "-k"
+        arg_type = Int
+        help = "right-hand sides per call in the TACO, Eigen and MKL drivers (SpMM when above 1)"
+        default = 1
+    "--chunk"
+        arg_type = Int
+        help = "rows per dynamically scheduled task of the parallel TACO schedule"
+        default = 64
     "--dataset", "-d"
         arg_type = String
         help = "dataset keyword"
@@ -81,12 +121,28 @@ datasets = OrderedDict(
     ],
 )
 
+include("../common/driver_server.jl")
+include("../common/binary_matrix.jl")
+driver_threads[] = parsed_args["threads"]
+driver_pin[] = parsed_args["pin"]
+driver_counters[] = parsed_args["counters"]
+driver_warmup[] = parsed_args["warmup"]
+driver_min_time[] = parsed_args["min_time"]
+driver_min_reps[] = parsed_args["min_reps"]
+driver_flush[] = parsed_args["flush"]
+driver_verify[] = parsed_args["verify"]
+driver_tolerance[] = parsed_args["tolerance"]
+# Right-hand sides per call, sent to the drivers that support SpMM
+const spmv_num_vectors = Ref(parsed_args["num_vectors"])
+const taco_chunk = Ref(parsed_args["chunk"])
 include("synthetic.jl")
 include("spmv_finch.jl")
 include("spmv_taco.jl")
 include("spmv_julia.jl")
 include("spmv_eigen.jl")
 include("spmv_mkl.jl")
+include("spmv_native.jl")
+include("spmv_stream.jl")
 
 dataset_tags = OrderedDict(
     "willow_symmetric" => "symmetric",
@@ -111,8 +167,24 @@ methods = OrderedDict(
         "finch_row_maj_sparseblocklist" => spmv_finch_row_maj_sparseblocklist,
         (has_taco() ? ["taco_col_maj" => spmv_taco_col_maj] : [])...,
         (has_taco() ? ["taco_row_maj" => spmv_taco_row_maj] : [])...,
+        (has_taco() ? ["taco_row_maj_parallel" => spmv_taco_row_maj_parallel] : [])...,
+        (has_taco() ? ["taco_col_maj_privatized" => spmv_taco_col_maj_privatized] : [])...,
+        (has_taco() ? ["taco_symmetric" => spmv_taco_symmetric] : [])...,
         (has_eigen() ? ["eigen" => spmv_eigen] : [])...,
+        (has_eigen() ? ["eigen_symmetric" => spmv_eigen_symmetric] : [])...,
         (has_mkl() ? ["mkl" => spmv_mkl] : [])...,
+        (has_mkl() ? ["mkl_inspector_executor" => spmv_mkl_inspector] : [])...,
+        (has_mkl() ? ["mkl_numa" => spmv_mkl_numa] : [])...,
+        (has_mkl() ? ["mkl_symmetric" => spmv_mkl_symmetric] : [])...,
+        (has_native() ? ["native_csr" => spmv_native_csr] : [])...,
+        (has_native() ? ["native_bcsr" => spmv_native_bcsr] : [])...,
+        (has_native() ? ["native_sell" => spmv_native_sell] : [])...,
+        (has_native() ? ["native_fp32" => spmv_native_fp32] : [])...,
+        (has_native() ? ["native_bf16" => spmv_native_bf16] : [])...,
+        (has_native() ? ["native_fp16" => spmv_native_fp16] : [])...,
+        (has_native() ? ["native_bf16_delta16" => spmv_native_bf16_delta16] : [])...,
+        (has_native() ? ["native_numa" => spmv_native_numa] : [])...,
+        (has_stream() ? ["stream_csr" => spmv_stream_csr] : [])...,
     ],
     "unsymmetric" => [
         "julia_stdlib" => spmv_julia,
@@ -122,8 +194,21 @@ methods = OrderedDict(
         "finch_row_maj_sparseblocklist" => spmv_finch_row_maj_sparseblocklist,
         (has_taco() ? ["taco_col_maj" => spmv_taco_col_maj] : [])...,
         (has_taco() ? ["taco_row_maj" => spmv_taco_row_maj] : [])...,
+        (has_taco() ? ["taco_row_maj_parallel" => spmv_taco_row_maj_parallel] : [])...,
+        (has_taco() ? ["taco_col_maj_privatized" => spmv_taco_col_maj_privatized] : [])...,
         (has_eigen() ? ["eigen" => spmv_eigen] : [])...,
         (has_mkl() ? ["mkl" => spmv_mkl] : [])...,
+        (has_mkl() ? ["mkl_inspector_executor" => spmv_mkl_inspector] : [])...,
+        (has_mkl() ? ["mkl_numa" => spmv_mkl_numa] : [])...,
+        (has_native() ? ["native_csr" => spmv_native_csr] : [])...,
+        (has_native() ? ["native_bcsr" => spmv_native_bcsr] : [])...,
+        (has_native() ? ["native_sell" => spmv_native_sell] : [])...,
+        (has_native() ? ["native_fp32" => spmv_native_fp32] : [])...,
+        (has_native() ? ["native_bf16" => spmv_native_bf16] : [])...,
+        (has_native() ? ["native_fp16" => spmv_native_fp16] : [])...,
+        (has_native() ? ["native_bf16_delta16" => spmv_native_bf16_delta16] : [])...,
+        (has_native() ? ["native_numa" => spmv_native_numa] : [])...,
+        (has_stream() ? ["stream_csr" => spmv_stream_csr] : [])...,
     ],
     "symmetric_pattern" => [
         "julia_stdlib" => spmv_julia,
@@ -138,8 +223,24 @@ methods = OrderedDict(
         "finch_row_maj_sparseblocklist" => spmv_finch_row_maj_sparseblocklist,
         (has_taco() ? ["taco_col_maj" => spmv_taco_col_maj] : [])...,
         (has_taco() ? ["taco_row_maj" => spmv_taco_row_maj] : [])...,
+        (has_taco() ? ["taco_row_maj_parallel" => spmv_taco_row_maj_parallel] : [])...,
+        (has_taco() ? ["taco_col_maj_privatized" => spmv_taco_col_maj_privatized] : [])...,
+        (has_taco() ? ["taco_symmetric" => spmv_taco_symmetric] : [])...,
         (has_eigen() ? ["eigen" => spmv_eigen] : [])...,
+        (has_eigen() ? ["eigen_symmetric" => spmv_eigen_symmetric] : [])...,
         (has_mkl() ? ["mkl" => spmv_mkl] : [])...,
+        (has_mkl() ? ["mkl_inspector_executor" => spmv_mkl_inspector] : [])...,
+        (has_mkl() ? ["mkl_numa" => spmv_mkl_numa] : [])...,
+        (has_mkl() ? ["mkl_symmetric" => spmv_mkl_symmetric] : [])...,
+        (has_native() ? ["native_csr" => spmv_native_csr] : [])...,
+        (has_native() ? ["native_bcsr" => spmv_native_bcsr] : [])...,
+        (has_native() ? ["native_sell" => spmv_native_sell] : [])...,
+        (has_native() ? ["native_fp32" => spmv_native_fp32] : [])...,
+        (has_native() ? ["native_bf16" => spmv_native_bf16] : [])...,
+        (has_native() ? ["native_fp16" => spmv_native_fp16] : [])...,
+        (has_native() ? ["native_bf16_delta16" => spmv_native_bf16_delta16] : [])...,
+        (has_native() ? ["native_numa" => spmv_native_numa] : [])...,
+        (has_stream() ? ["stream_csr" => spmv_stream_csr] : [])...,
     ],
     "unsymmetric_pattern" => [
         "julia_stdlib" => spmv_julia,
@@ -151,8 +252,21 @@ methods = OrderedDict(
         "finch_row_maj_sparseblocklist" => spmv_finch_row_maj_sparseblocklist,
         (has_taco() ? ["taco_col_maj" => spmv_taco_col_maj] : [])...,
         (has_taco() ? ["taco_row_maj" => spmv_taco_row_maj] : [])...,
+        (has_taco() ? ["taco_row_maj_parallel" => spmv_taco_row_maj_parallel] : [])...,
+        (has_taco() ? ["taco_col_maj_privatized" => spmv_taco_col_maj_privatized] : [])...,
         (has_eigen() ? ["eigen" => spmv_eigen] : [])...,
         (has_mkl() ? ["mkl" => spmv_mkl] : [])...,
+        (has_mkl() ? ["mkl_inspector_executor" => spmv_mkl_inspector] : [])...,
+        (has_mkl() ? ["mkl_numa" => spmv_mkl_numa] : [])...,
+        (has_native() ? ["native_csr" => spmv_native_csr] : [])...,
+        (has_native() ? ["native_bcsr" => spmv_native_bcsr] : [])...,
+        (has_native() ? ["native_sell" => spmv_native_sell] : [])...,
+        (has_native() ? ["native_fp32" => spmv_native_fp32] : [])...,
+        (has_native() ? ["native_bf16" => spmv_native_bf16] : [])...,
+        (has_native() ? ["native_fp16" => spmv_native_fp16] : [])...,
+        (has_native() ? ["native_bf16_delta16" => spmv_native_bf16_delta16] : [])...,
+        (has_native() ? ["native_numa" => spmv_native_numa] : [])...,
+        (has_stream() ? ["stream_csr" => spmv_stream_csr] : [])...,
     ],
     "permutation" => [
         "julia_stdlib" => spmv_julia,
@@ -164,8 +278,21 @@ methods = OrderedDict(
         "finch_row_maj_sparsepoint_pattern" => spmv_finch_row_maj_sparsepoint_pattern,
         (has_taco() ? ["taco_col_maj" => spmv_taco_col_maj] : [])...,
         (has_taco() ? ["taco_row_maj" => spmv_taco_row_maj] : [])...,
+        (has_taco() ? ["taco_row_maj_parallel" => spmv_taco_row_maj_parallel] : [])...,
+        (has_taco() ? ["taco_col_maj_privatized" => spmv_taco_col_maj_privatized] : [])...,
         (has_eigen() ? ["eigen" => spmv_eigen] : [])...,
         (has_mkl() ? ["mkl" => spmv_mkl] : [])...,
+        (has_mkl() ? ["mkl_inspector_executor" => spmv_mkl_inspector] : [])...,
+        (has_mkl() ? ["mkl_numa" => spmv_mkl_numa] : [])...,
+        (has_native() ? ["native_csr" => spmv_native_csr] : [])...,
+        (has_native() ? ["native_bcsr" => spmv_native_bcsr] : [])...,
+        (has_native() ? ["native_sell" => spmv_native_sell] : [])...,
+        (has_native() ? ["native_fp32" => spmv_native_fp32] : [])...,
+        (has_native() ? ["native_bf16" => spmv_native_bf16] : [])...,
+        (has_native() ? ["native_fp16" => spmv_native_fp16] : [])...,
+        (has_native() ? ["native_bf16_delta16" => spmv_native_bf16_delta16] : [])...,
+        (has_native() ? ["native_numa" => spmv_native_numa] : [])...,
+        (has_stream() ? ["stream_csr" => spmv_stream_csr] : [])...,
     ],
     "banded" => [
         "julia_stdlib" => spmv_julia,
@@ -175,8 +302,21 @@ methods = OrderedDict(
         "finch_row_maj_sparseband" => spmv_finch_row_maj_sparseband,
         (has_taco() ? ["taco_col_maj" => spmv_taco_col_maj] : [])...,
         (has_taco() ? ["taco_row_maj" => spmv_taco_row_maj] : [])...,
+        (has_taco() ? ["taco_row_maj_parallel" => spmv_taco_row_maj_parallel] : [])...,
+        (has_taco() ? ["taco_col_maj_privatized" => spmv_taco_col_maj_privatized] : [])...,
         (has_eigen() ? ["eigen" => spmv_eigen] : [])...,
         (has_mkl() ? ["mkl" => spmv_mkl] : [])...,
+        (has_mkl() ? ["mkl_inspector_executor" => spmv_mkl_inspector] : [])...,
+        (has_mkl() ? ["mkl_numa" => spmv_mkl_numa] : [])...,
+        (has_native() ? ["native_csr" => spmv_native_csr] : [])...,
+        (has_native() ? ["native_bcsr" => spmv_native_bcsr] : [])...,
+        (has_native() ? ["native_sell" => spmv_native_sell] : [])...,
+        (has_native() ? ["native_fp32" => spmv_native_fp32] : [])...,
+        (has_native() ? ["native_bf16" => spmv_native_bf16] : [])...,
+        (has_native() ? ["native_fp16" => spmv_native_fp16] : [])...,
+        (has_native() ? ["native_bf16_delta16" => spmv_native_bf16_delta16] : [])...,
+        (has_native() ? ["native_numa" => spmv_native_numa] : [])...,
+        (has_stream() ? ["stream_csr" => spmv_stream_csr] : [])...,
     ],
 )
 
@@ -217,18 +357,36 @@ for (dataset, mtxs) in datasets
             @info "testing" key mtx
             res = method(y, A, x)
             time = res.time
-            y_ref = something(y_ref, res.y)
-
-            norm(res.y - y_ref)/norm(y_ref) < 0.1 || @warn("incorrect result via norm")
+            if res.y !== nothing
+                y_ref = something(y_ref, res.y)
+                norm(res.y - y_ref)/norm(y_ref) < 0.1 || @warn("incorrect result via norm")
+            end
+            verification = hasproperty(res, :verification) ? res.verification : nothing
+            verification === nothing || verification["passed"] || @warn("incorrect result via verification", verification)
 
             @info "results" time
-            push!(results, OrderedDict(
+            result = OrderedDict(
                 "time" => time,
                 "method" => key,
                 "kernel" => "spmv",
                 "matrix" => mtx,
                 "dataset" => dataset,
-            ))
+            )
+            hasproperty(res, :scaling) && (result["scaling"] = res.scaling)
+            hasproperty(res, :compile_time) && (result["compile_time"] = res.compile_time)
+            hasproperty(res, :convert_time) && (result["convert_time"] = res.convert_time)
+            hasproperty(res, :max_error) && (result["max_error"] = res.max_error)
+            hasproperty(res, :relative_error) && (result["relative_error"] = res.relative_error)
+            hasproperty(res, :stream) && (result["stream"] = res.stream)
+            hasproperty(res, :numa) && (result["numa"] = res.numa)
+            hasproperty(res, :num_vectors) && (result["num_vectors"] = res.num_vectors)
+            hasproperty(res, :time_per_vector) && (result["time_per_vector"] = res.time_per_vector)
+            hasproperty(res, :timing) && (result["timing"] = res.timing)
+            hasproperty(res, :memory) && (result["memory"] = res.memory)
+            hasproperty(res, :checksum) && (result["checksum"] = res.checksum)
+            verification === nothing || (result["verification"] = verification)
+            hasproperty(res, :counters) && res.counters !== nothing && (result["counters"] = res.counters)
+            push!(results, result)
             write(parsed_args["output"], JSON.json(results, 4))
         end
     end
@@ -2,42 +2,184 @@
 #include <sys/stat.h>
 #include <iostream>
 #include <cstdint>
-#include <Eigen/Sparse>
-#include <unsupported/Eigen/SparseExtra>
 #include "../deps/SparseRooflineBenchmark/src/benchmark.hpp"
+#include "../common/server.hpp"
+#include "../common/threads.hpp"
+#include "../common/memory.hpp"
+#include "../common/perf_counters.hpp"
+#include "../common/timing.hpp"
+#include "../common/eigen_operand.hpp"
+#include "../common/verify.hpp"
+#include "../common/options.hpp"
 
-int main(int argc, char **argv) {
-	auto params = parse(argc, argv);
+extern int optind;
 
-	Eigen::SparseMatrix<double> A;
+struct spmv_eigen_t {
+	thread_sweep_t threads;
+	// Also read hardware counters around the measured call.
+	bool counters = false;
+	// Warmup, sample count and cache flushing of the measured call.
+	timing_t timing;
+	// Check the result against a reference after each run.
+	verify_t verify;
+	// Eigen only parallelizes sparse times dense products for row-major storage.
+	eigen_operand_t<Eigen::RowMajor> A;
 	Eigen::VectorXd x;
 	Eigen::VectorXd y;
+	// Treat A as symmetric: keep only its upper triangle and multiply through
+	// selfadjointView, which mirrors it (single threaded in Eigen).
+	bool symmetric = false;
+	bool upper = false;
+	// With more than one vector, multiply A by the n x k block X instead of x.
+	int num_vectors = 1;
+	std::string input;
+	eigen_block_t X;
+	eigen_block_t Y;
 
-	Eigen::loadMarket(A, (params.input + "/A.ttx").c_str());
-	Eigen::SparseMatrix<double> sparseX;
-	Eigen::loadMarket(sparseX, (params.input + "/x.ttx").c_str());
-	Eigen::MatrixXd denseX = sparseX;
-	x = denseX;
+	void load(const std::string &input) {
+		A.load(input, "A");
+		x = load_eigen_vector(input, "x");
+		this->input = input;
+		X = eigen_block_t();
+		upper = false;
+	}
 
+	void keep_upper() {
+		if (symmetric && !upper) {
+			if (A->rows() != A->cols()) {
+				throw std::runtime_error("Symmetric mode needs a square matrix");
+			}
+			A.keep_upper();
+			upper = true;
+		} else if (!symmetric && upper) {
+			// A holds only its upper triangle, read it again in full
+			load(input);
+		}
+	}
 
-	// Assemble output indices and numerically compute the result
-	auto time = benchmark(
-		[&A, &x, &y]() { },
-		[&A, &x, &y]() {
-			y = A * x;
+	json run(const std::string &output, int reps) {
+		keep_upper();
+		if (num_vectors < 1) {
+			throw std::invalid_argument("num_vectors must be positive");
+		}
+		if (num_vectors > 1 && X.cols() != num_vectors) {
+			X = load_eigen_block(input, x, num_vectors);
+		}
+		// Assemble output indices and numerically compute the result
+		auto setup = [this]() { };
+		auto test = [this]() {
+			if (num_vectors > 1) {
+				if (symmetric) {
+					Y = A->selfadjointView<Eigen::Upper>() * X;
+				} else {
+					Y = *A * X;
+				}
+			} else if (symmetric) {
+				y = A->selfadjointView<Eigen::Upper>() * x;
+			} else {
+				y = *A * x;
+			}
+		};
+		json measurements = sweep_threads(threads, [&](int threads) {
+			Eigen::setNbThreads(threads);
+			json entry;
+			entry.update(benchmark_samples(timing, setup, test, reps));
+			entry["time_per_vector"] = entry["time"].get<double>() / num_vectors;
+			if (counters) entry.update(measure_counters(timing, setup, test, reps));
+			return entry;
+		});
+		json structures = {{"A", eigen_structure_bytes(*A)}};
+		if (num_vectors > 1) {
+			structures["X"] = structure_bytes(0, X.size() * sizeof(double));
+			structures["Y"] = structure_bytes(0, Y.size() * sizeof(double));
+		} else {
+			structures["x"] = structure_bytes(0, x.size() * sizeof(double));
+			structures["y"] = structure_bytes(0, y.size() * sizeof(double));
 		}
-	);
-
-	Eigen::MatrixXd denseY = y;
-	Eigen::SparseMatrix<double> sparseY = denseY.sparseView();
-	Eigen::saveMarket(sparseY, (params.input + "/y.ttx").c_str());
-
-	json measurements;
-	measurements["time"] = time;
-	measurements["memory"] = 0;
-	std::ofstream measurements_file(params.output + "/measurements.json");
-	measurements_file << measurements;
-	measurements_file.close();
+		record_memory(measurements, measure_memory(setup, test), structures);
+		measurements["symmetric"] = symmetric;
+		measurements["num_vectors"] = num_vectors;
+		const double *result = num_vectors > 1 ? Y.data() : y.data();
+		measurements["checksum"] = output_checksum(result, A->rows() * num_vectors);
+		if (verify.enabled) {
+			measurements["verification"] = verify.spmv(input, result, A->rows(), num_vectors, false, symmetric);
+		}
+		std::ofstream measurements_file(output + "/measurements.json");
+		measurements_file << measurements;
+		measurements_file.close();
+		return measurements;
+	}
+
+	void fetch(const std::string &output) {
+		if (num_vectors > 1) {
+			save_eigen_block(Y, output + "/Y.ttx");
+			y = Y.col(0);
+		}
+		Eigen::MatrixXd denseY = y;
+		Eigen::SparseMatrix<double> sparseY = denseY.sparseView();
+		Eigen::saveMarket(sparseY, (output + "/y.ttx").c_str());
+	}
+};
+
+int main(int argc, char **argv) {
+	auto params = parse(argc, argv);
+
+	spmv_eigen_t spmv;
+	common_options_t options(spmv.threads, spmv.counters, spmv.timing, &spmv.verify);
+
+	std::vector<option> long_options = options.long_options({
+		{"help", no_argument, 0, 'h'},
+		{"symmetric", no_argument, 0, 's'},
+		{"num_vectors", required_argument, 0, 'k'},
+	});
+	std::string short_options = options.short_options("hsk:");
+
+	// Parse the options
+	int option_index = 0;
+	int c;
+	optind = 1;
+	while ((c = getopt_long(params.argc, params.argv, short_options.c_str(), long_options.data(), &option_index)) != -1) {
+		switch (c) {
+			case 'h':
+				std::cout << "Options:" << std::endl;
+				std::cout << "  -h, --help      Print this help message" << std::endl;
+				std::cout << "  -s, --symmetric Store only the upper triangle of A and multiply it as symmetric" << std::endl;
+				std::cout << "  -k, --num_vectors  Multiply by k right-hand sides at once (X.bin, or x and k - 1 generated)" << std::endl;
+				options.help(18, "load/symmetric/num_vectors/verify/run/fetch", "y_ref.bin, Y_ref.bin or A times x", "y.ttx (and Y.ttx)");
+				exit(0);
+			case 's':
+				spmv.symmetric = true;
+				break;
+			case 'k':
+				try {
+					spmv.num_vectors = std::stoi(optarg);
+				} catch (const std::exception &e) {
+					std::cerr << "Invalid num_vectors" << std::endl;
+					exit(1);
+				}
+				break;
+			case '?':
+				// getopt_long already printed an error message
+				break;
+			default:
+				if (!options.parse(c, optarg)) abort();
+		}
+	}
+
+	std::map<std::string, server_command_t> commands = {
+		{"load", [&](const server_args_t &args) { spmv.load(server_arg(args, 0, "input dir")); return json(); }},
+		{"symmetric", [&](const server_args_t &args) { spmv.symmetric = server_arg(args, 0, "on|off") == "on"; return json(); }},
+		{"num_vectors", [&](const server_args_t &args) { spmv.num_vectors = std::stoi(server_arg(args, 0, "k")); return json(); }},
+		{"run", [&](const server_args_t &args) { return spmv.run(server_arg(args, 0, "output dir"), server_reps(args, 1)); }},
+		{"fetch", [&](const server_args_t &args) { spmv.fetch(server_arg(args, 0, "output dir")); return json(); }},
+	};
+	options.add_commands(commands);
+	if (options.server) return serve(commands);
+	if (!options.manifest.empty()) return run_manifest(options.manifest, commands, options.write_output);
+
+	spmv.load(params.input);
+	spmv.run(params.output, 0);
+	if (options.write_output) spmv.fetch(params.output);
 
 	return 0;
 }
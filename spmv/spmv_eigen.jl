@@ -2,24 +2,31 @@ using Finch
 using TensorMarket
 using JSON
 
-function spmv_eigen(y, A, x)
+function spmv_eigen_helper(symmetric, A, x)
     tmpdir = mktempdir(@__DIR__, prefix="experiment_")
-    A_path = joinpath(tmpdir, "A.ttx")
-    x_path = joinpath(tmpdir, "x.ttx")
+    A_path = joinpath(tmpdir, "A.bin")
+    x_path = joinpath(tmpdir, "x.bin")
     y_path = joinpath(tmpdir, "y.ttx")
     
-    fwrite(A_path, Tensor(Dense(SparseList(Element(0.0))), A))
-    fwrite(x_path, Tensor(Dense(SparseList(Element(0.0))), reshape(Vector(x), :, 1)))
+    write_binary_matrix(A_path, symmetric ? triu(A) : A, layout=:csr)
+    write_binary_vector(x_path, x)
     
     spmv_path = joinpath(@__DIR__, "spmv_eigen")
-    withenv() do
-        run(`$spmv_path -i $tmpdir -o $tmpdir`)
-    end 
+    server = driver_server(`$spmv_path -- --server`)
+    driver_request(server, "symmetric", symmetric ? "on" : "off")
+    driver_request(server, "load", tmpdir)
+    driver_request(server, "num_vectors", spmv_num_vectors[])
+    measurements = driver_request(server, "run", tmpdir)
+    y = nothing
+    if !driver_verify[]
+        driver_request(server, "fetch", tmpdir)
+        y = Vector(reshape(SparseMatrixCSC(fread(y_path)), :))
+    end
     
-    y = Vector(reshape(SparseMatrixCSC(fread(y_path)), :))
-    time = JSON.parsefile(joinpath(tmpdir, "measurements.json"))["time"]
-    
-    return (;time=time*10^-9, y=y)
+    return (;time=measurements["time"]*10^-9, y=y, num_vectors=measurements["num_vectors"], time_per_vector=measurements["time_per_vector"]*10^-9, scaling=measurements["scaling"], memory=measurements["memory"], timing=measurements["timing"], counters=counter_measurements(measurements), verify_measurements(measurements)...)
 end
 
+spmv_eigen(y, A, x) = spmv_eigen_helper(false, A, x)
+spmv_eigen_symmetric(y, A, x) = spmv_eigen_helper(true, A, x)
+
 has_eigen() = isfile(joinpath(@__DIR__, "spmv_eigen"))
\ No newline at end of file
@@ -2,88 +2,315 @@
 #include <sys/stat.h>
 #include <iostream>
 #include <cstdint>
+#include <cmath>
 #include <mkl.h>
 #include <Eigen/Sparse>
 #include <unsupported/Eigen/SparseExtra>
 #include "../deps/SparseRooflineBenchmark/src/benchmark.hpp"
+#include "../common/server.hpp"
+#include "../common/threads.hpp"
+#include "../common/memory.hpp"
+#include "../common/perf_counters.hpp"
+#include "../common/timing.hpp"
+#include "../common/mkl_csr.hpp"
+#include "../common/verify.hpp"
+#include "../common/options.hpp"
 
-int main(int argc, char **argv) {
-    mkl_set_num_threads(1);
+extern int optind;
 
-    auto params = parse(argc, argv);
+struct spmv_mkl_t {
+    thread_sweep_t threads;
+    // Also read hardware counters around the measured call.
+    bool counters = false;
+    // Warmup, sample count and cache flushing of the measured call.
+    timing_t timing;
+    // Check the result against a reference after each run.
+    verify_t verify;
+    // Expected number of calls for the inspector-executor mode, 0 to run the
+    // plain CSR path without mkl_sparse_optimize.
+    MKL_INT expected_calls = 0;
+    // Treat A as symmetric: keep only its upper triangle and multiply it as
+    // SPARSE_MATRIX_TYPE_SYMMETRIC with SPARSE_FILL_MODE_UPPER.
+    bool symmetric = false;
+    bool upper = false;
+    // With more than one vector, multiply A by the n x k block X instead of
+    // x with mkl_sparse_d_mm, in row-major layout.
+    MKL_INT num_vectors = 1;
+    // Place the rows of A and y on the NUMA nodes of the threads expected to
+    // multiply them, see mkl_csr_t::place_rows; y is then computed in
+    // y_placed and copied back after the sweep.
+    bool numa = false;
+    numa_array_t<double> y_placed;
+    std::string input;
+    mkl_csr_t A;
+    struct matrix_descr descr;
+    Eigen::VectorXd x;
+    Eigen::VectorXd y;
+    eigen_block_t X;
+    eigen_block_t Y;
 
-    Eigen::SparseMatrix<double, Eigen::RowMajor> eigen_A;
-    Eigen::VectorXd eigen_x;
+    spmv_mkl_t() {
+        mkl_peak_mem_usage(MKL_PEAK_MEM_ENABLE);
+        descr.type = SPARSE_MATRIX_TYPE_GENERAL;
+        descr.diag = SPARSE_DIAG_NON_UNIT;
+    }
 
-    Eigen::loadMarket(eigen_A, (params.input + "/A.ttx").c_str());
-    Eigen::SparseMatrix<double> sparseX;
-    Eigen::loadMarket(sparseX, (params.input + "/x.ttx").c_str());
-    Eigen::MatrixXd denseX = sparseX;
-    eigen_x = denseX;
+    ~spmv_mkl_t() { release(); }
 
-    // Convert Eigen matrix A to MKL format using Eigen's internal data
-    const int* outerIndexPtr = eigen_A.outerIndexPtr();
-    const int* innerIndexPtr = eigen_A.innerIndexPtr();
-    const double* valuePtr = eigen_A.valuePtr();
+    void release() {
+        A.release();
+        x = Eigen::VectorXd();
+        y = Eigen::VectorXd();
+        X = eigen_block_t();
+        Y = eigen_block_t();
+        y_placed = numa_array_t<double>();
+    }
 
-    MKL_INT *csr_row_pointer = (MKL_INT *)mkl_malloc((eigen_A.rows() + 1) * sizeof(MKL_INT), 64);
-    MKL_INT *csr_columns = (MKL_INT *)mkl_malloc(eigen_A.nonZeros() * sizeof(MKL_INT), 64);
-    double *csr_values = (double *)mkl_malloc(eigen_A.nonZeros() * sizeof(double), 64);
+    void load(const std::string &input) {
+        release();
 
-    for (int i = 0; i <= eigen_A.rows(); ++i) {
-        csr_row_pointer[i] = outerIndexPtr[i];
+        A.load(input, "A");
+        x = load_eigen_vector(input, "x");
+        y = Eigen::VectorXd::Zero(A.rows);
+        this->input = input;
+        upper = false;
     }
 
-    for (int i = 0; i < eigen_A.nonZeros(); ++i) {
-        csr_columns[i] = innerIndexPtr[i];
-        csr_values[i] = valuePtr[i];
+    void keep_upper() {
+        if (symmetric && !upper) {
+            if (A.rows != A.cols) {
+                throw std::runtime_error("Symmetric mode needs a square matrix");
+            }
+            A.keep_upper();
+            upper = true;
+        } else if (!symmetric && upper) {
+            // A holds only its upper triangle, read it again in full
+            load(input);
+        }
+        if (symmetric) {
+            descr.type = SPARSE_MATRIX_TYPE_SYMMETRIC;
+            descr.mode = SPARSE_FILL_MODE_UPPER;
+        } else {
+            descr.type = SPARSE_MATRIX_TYPE_GENERAL;
+        }
     }
 
-    sparse_matrix_t A;
-    sparse_status_t status = mkl_sparse_d_create_csr(&A, SPARSE_INDEX_BASE_ZERO, eigen_A.rows(), eigen_A.cols(),
-                                                     csr_row_pointer, csr_row_pointer + 1,
-                                                     csr_columns, csr_values);
-    if (status != SPARSE_STATUS_SUCCESS) {
-        std::cerr << "Failed to create CSR matrix with MKL. Error code: " << status << "\n";
-        return -1;
+    // Place A for `threads` threads and have each of them write its rows of
+    // y (or Y) first.
+    void place(int threads) {
+        A.place_rows(threads);
+        y_placed = numa_array_t<double>(A.rows * num_vectors);
+        #pragma omp parallel num_threads(threads)
+        {
+#ifdef _OPENMP
+            const mkl_csr_t::placed_part_t &part = A.parts[omp_get_thread_num()];
+#else
+            const mkl_csr_t::placed_part_t &part = A.parts[0];
+#endif
+            std::fill(y_placed.data() + part.begin * num_vectors, y_placed.data() + part.end * num_vectors, 0.0);
+        }
     }
 
-    // Convert Eigen vector eigen_x to raw pointer
-    double *x = (double *)mkl_malloc(eigen_x.size() * sizeof(double), 64);
-    for (int i = 0; i < eigen_x.size(); ++i) {
-        x[i] = eigen_x[i];
+    // Time the plain CSR multiply, then the inspection (hint and optimize) and
+    // the optimized multiply, and report how many calls amortize the inspection.
+    template <typename Time>
+    json inspect(Time time_calls) {
+        long long unoptimized_time = time_calls()["time"];
+
+        auto tic = std::chrono::high_resolution_clock::now();
+        if (num_vectors > 1) {
+            mkl_sparse_set_mm_hint(A.handle, SPARSE_OPERATION_NON_TRANSPOSE, descr, SPARSE_LAYOUT_ROW_MAJOR,
+                                   num_vectors, expected_calls);
+        } else {
+            mkl_sparse_set_mv_hint(A.handle, SPARSE_OPERATION_NON_TRANSPOSE, descr, expected_calls);
+        }
+        sparse_status_t status = mkl_sparse_optimize(A.handle);
+        auto toc = std::chrono::high_resolution_clock::now();
+        if (status != SPARSE_STATUS_SUCCESS) {
+            throw std::runtime_error("mkl_sparse_optimize failed. Error code: " + std::to_string(status));
+        }
+        long long inspect_time = std::chrono::duration_cast<std::chrono::nanoseconds>(toc - tic).count();
+        json measurements = time_calls();
+        long long time = measurements["time"];
+        measurements["unoptimized_time"] = unoptimized_time;
+        measurements["inspect_time"] = inspect_time;
+        measurements["expected_calls"] = expected_calls;
+        measurements["amortized_time"] = time + (double)inspect_time / expected_calls;
+        if (time < unoptimized_time) {
+            measurements["break_even_calls"] = (long long)std::ceil((double)inspect_time / (unoptimized_time - time));
+        } else {
+            measurements["break_even_calls"] = nullptr;
+        }
+        return measurements;
     }
-    double *y = (double *)mkl_malloc(sizeof(double) * eigen_A.rows(), 64);
 
-    struct matrix_descr descr;
-    descr.type = SPARSE_MATRIX_TYPE_GENERAL;
-    descr.diag = SPARSE_DIAG_NON_UNIT;
+    json run(const std::string &output, int reps) {
+        keep_upper();
+        if (num_vectors < 1) {
+            throw std::invalid_argument("num_vectors must be positive");
+        }
+        if (num_vectors > 1 && X.cols() != num_vectors) {
+            X = load_eigen_block(input, x, num_vectors);
+            Y = eigen_block_t::Zero(A.rows, num_vectors);
+        }
+        auto setup = []() {};
+        auto test = [this]() {
+            double *out = numa ? y_placed.data() : num_vectors > 1 ? Y.data() : y.data();
+            if (num_vectors > 1) {
+                mkl_sparse_d_mm(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, A.handle, descr, SPARSE_LAYOUT_ROW_MAJOR,
+                                X.data(), num_vectors, num_vectors, 0.0, out, num_vectors);
+            } else {
+                mkl_sparse_d_mv(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, A.handle, descr, x.data(), 0.0, out);
+            }
+        };
+        auto time_calls = [&]() {
+            return benchmark_samples(timing, setup, test, reps);
+        };
+        json measurements = sweep_threads(threads, [&](int threads) {
+            mkl_set_num_threads(threads);
+            if (numa) {
+                place(threads);
+            } else {
+                A.reset_handle();
+            }
+            json entry;
+            if (expected_calls > 0) {
+                entry = inspect(time_calls);
+            } else {
+                entry = time_calls();
+            }
+            entry["time_per_vector"] = entry["time"].get<double>() / num_vectors;
+            if (counters) entry.update(measure_counters(timing, setup, test, reps));
+            if (numa) entry["numa"] = A.placement();
+            return entry;
+        });
+        json memory = measure_memory([&]() {
+            setup();
+            mkl_peak_mem_usage(MKL_PEAK_MEM_RESET);
+        }, test);
+        memory["mkl_peak_bytes"] = mkl_peak_mem_usage(MKL_PEAK_MEM);
+        json structures = {{"A", A.structure_bytes()}};
+        if (num_vectors > 1) {
+            structures["X"] = structure_bytes(0, X.size() * sizeof(double));
+            structures["Y"] = structure_bytes(0, Y.size() * sizeof(double));
+        } else {
+            structures["x"] = structure_bytes(0, A.cols * sizeof(double));
+            structures["y"] = structure_bytes(0, A.rows * sizeof(double));
+        }
+        if (numa) structures["y_placed"] = structure_bytes(0, y_placed.bytes());
+        record_memory(measurements, memory, structures);
+        if (numa) {
+            std::copy(y_placed.data(), y_placed.data() + y_placed.size(), num_vectors > 1 ? Y.data() : y.data());
+            measurements["numa_nodes"] = A.topology.nodes;
+        }
+        measurements["symmetric"] = symmetric;
+        measurements["num_vectors"] = num_vectors;
+        const double *result = num_vectors > 1 ? Y.data() : y.data();
+        measurements["checksum"] = output_checksum(result, A.rows * num_vectors);
+        if (verify.enabled) {
+            measurements["verification"] = verify.spmv(input, result, A.rows, num_vectors, false, symmetric);
+        }
+        std::ofstream measurements_file(output + "/measurements.json");
+        measurements_file << measurements;
+        measurements_file.close();
+        return measurements;
+    }
 
-    //mkl_sparse_set_mv_hint(A, SPARSE_OPERATION_NON_TRANSPOSE, descr, 1000);
-    //mkl_sparse_optimize(A);
+    void fetch(const std::string &output) {
+        if (num_vectors > 1) {
+            save_eigen_block(Y, output + "/Y.ttx");
+            y = Y.col(0);
+        }
+        // Write the Eigen vector to a file
+        Eigen::MatrixXd denseY = y;
+        Eigen::SparseMatrix<double> sparseY = denseY.sparseView();
+        Eigen::saveMarket(sparseY, (output + "/y.ttx").c_str());
+    }
+};
 
-    auto time = benchmark(
-        [&x, &y, &descr, &A]() {},
-        [&x, &y, &descr, &A]() {
-            mkl_sparse_d_mv(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, A, descr, x, 0.0, y);
+int main(int argc, char **argv) {
+    auto params = parse(argc, argv);
+
+    spmv_mkl_t spmv;
+    common_options_t options(spmv.threads, spmv.counters, spmv.timing, &spmv.verify);
+
+    std::vector<option> long_options = options.long_options({
+        {"help", no_argument, 0, 'h'},
+        {"inspect", required_argument, 0, 'I'},
+        {"symmetric", no_argument, 0, 's'},
+        {"num_vectors", required_argument, 0, 'k'},
+        {"numa", no_argument, 0, 'N'},
+    });
+    std::string short_options = options.short_options("hI:sk:N");
+
+    // Parse the options
+    int option_index = 0;
+    int c;
+    optind = 1;
+    while ((c = getopt_long(params.argc, params.argv, short_options.c_str(), long_options.data(), &option_index)) != -1) {
+        switch (c) {
+            case 'h':
+                std::cout << "Options:" << std::endl;
+                std::cout << "  -h, --help      Print this help message" << std::endl;
+                std::cout << "  -I, --inspect   Expected call count for inspector-executor mode (mkl_sparse_optimize)" << std::endl;
+                std::cout << "  -s, --symmetric Store only the upper triangle of A and multiply it as symmetric" << std::endl;
+                std::cout << "  -k, --num_vectors  Multiply by k right-hand sides at once (X.bin, or x and k - 1 generated)" << std::endl;
+                std::cout << "  -N, --numa      Place each thread's rows of A and y on its NUMA node" << std::endl;
+                options.help(18, "load/run/fetch", "y_ref.bin, Y_ref.bin or A times x", "y.ttx (and Y.ttx)");
+                exit(0);
+            case 'I':
+                try {
+                    spmv.expected_calls = std::stoll(optarg);
+                } catch (const std::exception &e) {
+                    std::cerr << "Invalid expected_calls" << std::endl;
+                    exit(1);
+                }
+                break;
+            case 's':
+                spmv.symmetric = true;
+                break;
+            case 'k':
+                try {
+                    spmv.num_vectors = std::stoll(optarg);
+                } catch (const std::exception &e) {
+                    std::cerr << "Invalid num_vectors" << std::endl;
+                    exit(1);
+                }
+                break;
+            case 'N':
+                spmv.numa = true;
+                break;
+            case '?':
+                // getopt_long already printed an error message
+                break;
+            default:
+                if (!options.parse(c, optarg)) abort();
         }
-    );
-    // Convert the result vector y to Eigen format
-    Eigen::VectorXd eigen_y(eigen_A.rows());
-    for (int i = 0; i < eigen_A.rows(); ++i) {
-        eigen_y[i] = y[i];
     }
 
-    // Write the Eigen vector to a file
-    Eigen::MatrixXd denseY = eigen_y;
-    Eigen::SparseMatrix<double> sparseY = denseY.sparseView();
-    Eigen::saveMarket(sparseY, (params.input + "/y.ttx").c_str());
-
-    json measurements;
-    measurements["time"] = time;
-    measurements["memory"] = 0;
-    std::ofstream measurements_file(params.output + "/measurements.json");
-    measurements_file << measurements;
-    measurements_file.close();
+    std::map<std::string, server_command_t> commands = {
+        {"load", [&](const server_args_t &args) { spmv.load(server_arg(args, 0, "input dir")); return json(); }},
+        {"inspect", [&](const server_args_t &args) {
+            spmv.expected_calls = std::stoll(server_arg(args, 0, "expected calls"));
+            return json();
+        }},
+        {"symmetric", [&](const server_args_t &args) { spmv.symmetric = server_arg(args, 0, "on|off") == "on"; return json(); }},
+        {"num_vectors", [&](const server_args_t &args) { spmv.num_vectors = std::stoll(server_arg(args, 0, "k")); return json(); }},
+        {"numa", [&](const server_args_t &args) { spmv.numa = server_arg(args, 0, "on|off") == "on"; return json(); }},
+        {"run", [&](const server_args_t &args) { return spmv.run(server_arg(args, 0, "output dir"), server_reps(args, 1)); }},
+        {"fetch", [&](const server_args_t &args) { spmv.fetch(server_arg(args, 0, "output dir")); return json(); }},
+    };
+    options.add_commands(commands);
+    if (options.server) return serve(commands);
+    if (!options.manifest.empty()) return run_manifest(options.manifest, commands, options.write_output);
+
+    try {
+        spmv.load(params.input);
+    } catch (const std::runtime_error &e) {
+        std::cerr << e.what() << "\n";
+        return -1;
+    }
+    spmv.run(params.output, 0);
+    if (options.write_output) spmv.fetch(params.output);
     return 0;
 }
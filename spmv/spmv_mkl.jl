@@ -1,22 +1,36 @@
 using Finch
 using TensorMarket
 using JSON
-function spmv_mkl(y, A, x)
+function spmv_mkl_helper(expected_calls, A, x; symmetric=false, numa=false)
     tmpdir = mktempdir(@__DIR__, prefix="experiment_")
-    A_path = joinpath(tmpdir, "A.ttx")
-    x_path = joinpath(tmpdir, "x.ttx")
+    A_path = joinpath(tmpdir, "A.bin")
+    x_path = joinpath(tmpdir, "x.bin")
     y_path = joinpath(tmpdir, "y.ttx")
-    fwrite(A_path, Tensor(Dense(SparseList(Element(0.0))), A))
-    fwrite(x_path, Tensor(Dense(SparseList(Element(0.0))), reshape(Vector(x), :, 1)))
+    write_binary_matrix(A_path, symmetric ? triu(A) : A, layout=:csr)
+    write_binary_vector(x_path, x)
     mklvars_path = joinpath(@__DIR__, "../deps/intel/setvars.sh")
     spmv_path = joinpath(@__DIR__, "spmv_mkl")
-    withenv() do
-        cmd = "source $mklvars_path; $spmv_path -i $tmpdir -o $tmpdir"
-        run(`bash -c $cmd`)
-    end 
-    y = fread(y_path)
-    time = JSON.parsefile(joinpath(tmpdir, "measurements.json"))["time"]
-    return (;time=time*10^-9, y=y)
+    cmd = "source $mklvars_path; exec $spmv_path -- --server"
+    server = driver_server(`bash -c $cmd`)
+    driver_request(server, "symmetric", symmetric ? "on" : "off")
+    driver_request(server, "load", tmpdir)
+    driver_request(server, "num_vectors", spmv_num_vectors[])
+    driver_request(server, "inspect", expected_calls)
+    driver_request(server, "numa", numa ? "on" : "off")
+    measurements = driver_request(server, "run", tmpdir)
+    y = nothing
+    if !driver_verify[]
+        driver_request(server, "fetch", tmpdir)
+        y = fread(y_path)
+    end
+    # Per-node rows, bytes and page locality of NUMA placed runs
+    placement = haskey(measurements, "numa") ? (;numa=measurements["numa"]) : (;)
+    return (;time=measurements["time"]*10^-9, y=y, placement..., num_vectors=measurements["num_vectors"], time_per_vector=measurements["time_per_vector"]*10^-9, scaling=measurements["scaling"], memory=measurements["memory"], timing=measurements["timing"], counters=counter_measurements(measurements), verify_measurements(measurements)...)
 end
 
+spmv_mkl(y, A, x) = spmv_mkl_helper(0, A, x)
+spmv_mkl_inspector(y, A, x) = spmv_mkl_helper(1000, A, x)
+spmv_mkl_symmetric(y, A, x) = spmv_mkl_helper(0, A, x, symmetric=true)
+spmv_mkl_numa(y, A, x) = spmv_mkl_helper(0, A, x, numa=true)
+
 has_mkl() = isfile(joinpath(@__DIR__, "spmv_mkl"))
@@ -0,0 +1,1069 @@
+#include <algorithm>
+#include <chrono>
+#include <sys/stat.h>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <string>
+#include <vector>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+#include "../deps/SparseRooflineBenchmark/src/benchmark.hpp"
+#include "../common/server.hpp"
+#include "../common/threads.hpp"
+#include "../common/memory.hpp"
+#include "../common/perf_counters.hpp"
+#include "../common/timing.hpp"
+#include "../common/eigen_operand.hpp"
+#include "../common/csr_view.hpp"
+#include "../common/verify.hpp"
+#include "../common/numa.hpp"
+#include "../common/options.hpp"
+
+extern int optind;
+
+// Storage formats of the native SpMV kernels. BCSR and SELL are converted
+// from the CSR input before timing, and the conversion is timed separately.
+enum format_t { FORMAT_CSR, FORMAT_BCSR, FORMAT_SELL };
+
+const char *format_names[] = {"csr", "bcsr", "sell"};
+
+format_t parse_format(const std::string &name) {
+  for (int f = 0; f < 3; f++) {
+    if (name == format_names[f]) return (format_t)f;
+  }
+  throw std::invalid_argument("Invalid format " + name);
+}
+
+// Run body(begin, end) on every OpenMP thread over a share of [0, n) holding
+// about the same part of the work, where prefix[i] is the work before item i.
+template <typename Body>
+void for_each_part(const sparse_index_t *prefix, sparse_index_t n, Body body) {
+  #pragma omp parallel
+  {
+#ifdef _OPENMP
+    int t = omp_get_thread_num();
+    int parts = omp_get_num_threads();
+#else
+    int t = 0;
+    int parts = 1;
+#endif
+    auto cut = [&](int p) -> sparse_index_t {
+      if (p == parts) return n;
+      double target = (double)prefix[n] * p / parts;
+      return std::lower_bound(prefix, prefix + n + 1, target) - prefix;
+    };
+    body(cut(t), cut(t + 1));
+  }
+}
+
+inline void csr_spmv(const csr_view_t &A, const double *x, double *y) {
+  for_each_part(A.pos, A.rows, [&](sparse_index_t begin, sparse_index_t end) {
+    for (sparse_index_t i = begin; i < end; i++) {
+      double sum = 0;
+      for (sparse_index_t p = A.pos[i]; p < A.pos[i + 1]; p++) {
+        sum += A.val[p] * x[A.idx[p]];
+      }
+      y[i] = sum;
+    }
+  });
+}
+
+// Register-blocked CSR. The matrix is cut into r x c blocks and every block
+// holding a nonzero is stored densely, row-major, with one column index per
+// block, so the kernel keeps r sums in registers, loads c entries of x per
+// block, and reads one index per r * c values instead of one per value. The
+// explicit zeros it stores are its cost; `fill` is stored values over nonzeros.
+//
+// Without a requested size the block size is chosen as in OSKI, from the fill
+// of every candidate measured on a sample of block rows, but with a traffic
+// model in place of a measured register profile: the candidate whose values
+// and indices take the fewest bytes wins, since SpMV is bound by them.
+struct bcsr_t {
+  static constexpr int sizes[] = {1, 2, 3, 4, 6, 8};
+  // Share of block rows sampled to estimate the fill of each candidate.
+  double sample_fraction = 0.02;
+
+  int r = 1;
+  int c = 1;
+  sparse_index_t rows = 0;
+  sparse_index_t cols = 0;
+  sparse_index_t block_rows = 0;
+  sparse_index_t block_cols = 0;
+  std::vector<sparse_index_t> pos, idx;
+  std::vector<double> val;
+  double fill = 1;
+
+  // Estimated stored values over nonzeros for r x c blocks.
+  double estimate_fill(const csr_view_t &A, int r, int c) const {
+    sparse_index_t n = (A.rows + r - 1) / r;
+    sparse_index_t stride = std::max<sparse_index_t>(1, (sparse_index_t)(1 / sample_fraction));
+    std::vector<sparse_index_t> seen((A.cols + c - 1) / c, -1);
+    long blocks = 0;
+    long nnz = 0;
+    for (sparse_index_t I = 0; I < n; I += stride) {
+      for (sparse_index_t i = I * r; i < std::min<sparse_index_t>(A.rows, (I + 1) * r); i++) {
+        for (sparse_index_t p = A.pos[i]; p < A.pos[i + 1]; p++) {
+          sparse_index_t J = A.idx[p] / c;
+          if (seen[J] != I) {
+            seen[J] = I;
+            blocks++;
+          }
+        }
+        nnz += A.pos[i + 1] - A.pos[i];
+      }
+    }
+    return nnz ? (double)blocks * r * c / nnz : 1;
+  }
+
+  void choose_block(const csr_view_t &A) {
+    double nnz = A.pos[A.rows];
+    double best = -1;
+    for (int r : sizes) {
+      for (int c : sizes) {
+        double stored = estimate_fill(A, r, c) * nnz;
+        double bytes = stored * sizeof(double) + (stored / (r * c) + (double)A.rows / r) * sizeof(sparse_index_t);
+        if (best < 0 || bytes < best) {
+          best = bytes;
+          this->r = r;
+          this->c = c;
+        }
+      }
+    }
+  }
+
+  // Convert A with r x c blocks, or with the chosen size when r or c is 0.
+  void convert(const csr_view_t &A, int r, int c) {
+    if (r == 0 || c == 0) {
+      choose_block(A);
+    } else {
+      if (std::find(std::begin(sizes), std::end(sizes), r) == std::end(sizes) ||
+          std::find(std::begin(sizes), std::end(sizes), c) == std::end(sizes)) {
+        throw std::invalid_argument("Block sizes must be 1, 2, 3, 4, 6 or 8");
+      }
+      this->r = r;
+      this->c = c;
+    }
+    r = this->r;
+    c = this->c;
+    rows = A.rows;
+    cols = A.cols;
+    block_rows = (rows + r - 1) / r;
+    block_cols = (cols + c - 1) / c;
+
+    // Count the blocks of every block row, then give each its slot
+    pos.assign(block_rows + 1, 0);
+    #pragma omp parallel
+    {
+      std::vector<sparse_index_t> seen(block_cols, -1);
+      #pragma omp for schedule(dynamic, 256)
+      for (sparse_index_t I = 0; I < block_rows; I++) {
+        sparse_index_t blocks = 0;
+        for (sparse_index_t i = I * r; i < std::min(rows, (I + 1) * r); i++) {
+          for (sparse_index_t p = A.pos[i]; p < A.pos[i + 1]; p++) {
+            sparse_index_t J = A.idx[p] / c;
+            if (seen[J] != I) {
+              seen[J] = I;
+              blocks++;
+            }
+          }
+        }
+        pos[I + 1] = blocks;
+      }
+    }
+    std::partial_sum(pos.begin(), pos.end(), pos.begin());
+    idx.resize(pos[block_rows]);
+    val.assign(pos[block_rows] * r * c, 0.0);
+
+    #pragma omp parallel
+    {
+      // slot[J] is the position of block column J in the current block row
+      std::vector<sparse_index_t> slot(block_cols, -1);
+      #pragma omp for schedule(dynamic, 256)
+      for (sparse_index_t I = 0; I < block_rows; I++) {
+        sparse_index_t *row_idx = idx.data() + pos[I];
+        sparse_index_t blocks = 0;
+        for (sparse_index_t i = I * r; i < std::min(rows, (I + 1) * r); i++) {
+          for (sparse_index_t p = A.pos[i]; p < A.pos[i + 1]; p++) {
+            sparse_index_t J = A.idx[p] / c;
+            if (slot[J] < 0) {
+              slot[J] = 0;
+              row_idx[blocks++] = J;
+            }
+          }
+        }
+        std::sort(row_idx, row_idx + blocks);
+        for (sparse_index_t b = 0; b < blocks; b++) slot[row_idx[b]] = pos[I] + b;
+        for (sparse_index_t i = I * r; i < std::min(rows, (I + 1) * r); i++) {
+          for (sparse_index_t p = A.pos[i]; p < A.pos[i + 1]; p++) {
+            sparse_index_t j = A.idx[p];
+            val[slot[j / c] * r * c + (i - I * r) * c + j % c] = A.val[p];
+          }
+        }
+        for (sparse_index_t b = 0; b < blocks; b++) slot[row_idx[b]] = -1;
+      }
+    }
+    fill = A.pos[rows] ? (double)val.size() / A.pos[rows] : 1;
+  }
+
+  template <int R, int C>
+  void kernel(const double *x, double *y) const {
+    for_each_part(pos.data(), block_rows, [&](sparse_index_t begin, sparse_index_t end) {
+      for (sparse_index_t I = begin; I < end; I++) {
+        double sum[R] = {};
+        for (sparse_index_t b = pos[I]; b < pos[I + 1]; b++) {
+          const double *block = val.data() + b * R * C;
+          const double *xb = x + idx[b] * C;
+          for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+              sum[i] += block[i * C + j] * xb[j];
+            }
+          }
+        }
+        for (int i = 0; i < R; i++) y[I * R + i] = sum[i];
+      }
+    });
+  }
+
+  template <int R>
+  void kernel_rows(const double *x, double *y) const {
+    switch (c) {
+      case 1: kernel<R, 1>(x, y); break;
+      case 2: kernel<R, 2>(x, y); break;
+      case 3: kernel<R, 3>(x, y); break;
+      case 4: kernel<R, 4>(x, y); break;
+      case 6: kernel<R, 6>(x, y); break;
+      case 8: kernel<R, 8>(x, y); break;
+    }
+  }
+
+  // y = A * x for x padded to block_cols * c entries and y to block_rows * r.
+  void multiply(const double *x, double *y) const {
+    switch (r) {
+      case 1: kernel_rows<1>(x, y); break;
+      case 2: kernel_rows<2>(x, y); break;
+      case 3: kernel_rows<3>(x, y); break;
+      case 4: kernel_rows<4>(x, y); break;
+      case 6: kernel_rows<6>(x, y); break;
+      case 8: kernel_rows<8>(x, y); break;
+    }
+  }
+
+  json structure_bytes() const {
+    return ::structure_bytes((pos.size() + idx.size()) * sizeof(sparse_index_t), val.size() * sizeof(double));
+  }
+};
+
+// SELL-C-sigma (Kreutzer et al.). Rows are sorted by length, longest first,
+// within windows of sigma rows, and every run of C sorted rows forms a chunk
+// stored column-major and padded to its longest row, so lane l of a SIMD
+// register holds row l of the chunk and the kernel processes C rows at once
+// with one gather of x per step. C is the number of doubles in a vector
+// register (8 with AVX-512, 4 otherwise); sigma trades the padding, which
+// shrinks as sigma grows, against the locality of y and x.
+struct sell_t {
+#if defined(__AVX512F__)
+  static constexpr int C = 8;
+#else
+  static constexpr int C = 4;
+#endif
+  sparse_index_t sigma = 256;
+
+  sparse_index_t rows = 0;
+  sparse_index_t chunks = 0;
+  // Chunk k stores (chunk_pos[k + 1] - chunk_pos[k]) / C columns from chunk_pos[k].
+  std::vector<sparse_index_t> chunk_pos;
+  // perm[k * C + l] is the row in lane l of chunk k, or rows for padding.
+  std::vector<sparse_index_t> perm;
+  std::vector<sparse_index_t> idx;
+  std::vector<double> val;
+  double fill = 1;
+
+  void convert(const csr_view_t &A, sparse_index_t sigma) {
+    if (sigma < 1) {
+      throw std::invalid_argument("sigma must be positive");
+    }
+    this->sigma = sigma;
+    rows = A.rows;
+    chunks = (rows + C - 1) / C;
+    auto length = [&](sparse_index_t i) { return A.pos[i + 1] - A.pos[i]; };
+
+    perm.resize(chunks * C);
+    std::iota(perm.begin(), perm.begin() + rows, 0);
+    std::fill(perm.begin() + rows, perm.end(), rows);
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (sparse_index_t w = 0; w < rows; w += sigma) {
+      std::stable_sort(perm.begin() + w, perm.begin() + std::min(rows, w + sigma),
+                       [&](sparse_index_t i, sparse_index_t j) { return length(i) > length(j); });
+    }
+
+    chunk_pos.assign(chunks + 1, 0);
+    #pragma omp parallel for schedule(static)
+    for (sparse_index_t k = 0; k < chunks; k++) {
+      sparse_index_t width = 0;
+      for (int l = 0; l < C; l++) {
+        sparse_index_t i = perm[k * C + l];
+        if (i < rows) width = std::max(width, length(i));
+      }
+      chunk_pos[k + 1] = width * C;
+    }
+    std::partial_sum(chunk_pos.begin(), chunk_pos.end(), chunk_pos.begin());
+
+    // Padding repeats column 0 with a zero value, so the kernel needs no mask
+    idx.resize(chunk_pos[chunks]);
+    val.resize(chunk_pos[chunks]);
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (sparse_index_t k = 0; k < chunks; k++) {
+      sparse_index_t width = (chunk_pos[k + 1] - chunk_pos[k]) / C;
+      for (int l = 0; l < C; l++) {
+        sparse_index_t i = perm[k * C + l];
+        sparse_index_t n = i < rows ? length(i) : 0;
+        for (sparse_index_t j = 0; j < width; j++) {
+          sparse_index_t q = chunk_pos[k] + j * C + l;
+          idx[q] = j < n ? A.idx[A.pos[i] + j] : 0;
+          val[q] = j < n ? A.val[A.pos[i] + j] : 0.0;
+        }
+      }
+    }
+    fill = A.pos[rows] ? (double)val.size() / A.pos[rows] : 1;
+  }
+
+  void multiply(const double *x, double *y) const {
+    for_each_part(chunk_pos.data(), chunks, [&](sparse_index_t begin, sparse_index_t end) {
+      for (sparse_index_t k = begin; k < end; k++) {
+        const sparse_index_t *chunk_idx = idx.data() + chunk_pos[k];
+        const double *chunk_val = val.data() + chunk_pos[k];
+        sparse_index_t n = chunk_pos[k + 1] - chunk_pos[k];
+        alignas(64) double sum[C];
+#if defined(__AVX512F__)
+        __m512d acc = _mm512_setzero_pd();
+        for (sparse_index_t q = 0; q < n; q += C) {
+          __m512d a = _mm512_loadu_pd(chunk_val + q);
+          __m512d b;
+          if constexpr (sizeof(sparse_index_t) == 4) {
+            b = _mm512_i32gather_pd(_mm256_loadu_si256((const __m256i *)(chunk_idx + q)), x, 8);
+          } else {
+            b = _mm512_i64gather_pd(_mm512_loadu_si512(chunk_idx + q), x, 8);
+          }
+          acc = _mm512_fmadd_pd(a, b, acc);
+        }
+        _mm512_store_pd(sum, acc);
+#elif defined(__AVX2__)
+        __m256d acc = _mm256_setzero_pd();
+        for (sparse_index_t q = 0; q < n; q += C) {
+          __m256d a = _mm256_loadu_pd(chunk_val + q);
+          __m256d b;
+          if constexpr (sizeof(sparse_index_t) == 4) {
+            b = _mm256_i32gather_pd(x, _mm_loadu_si128((const __m128i *)(chunk_idx + q)), 8);
+          } else {
+            b = _mm256_i64gather_pd(x, _mm256_loadu_si256((const __m256i *)(chunk_idx + q)), 8);
+          }
+          acc = _mm256_fmadd_pd(a, b, acc);
+        }
+        _mm256_store_pd(sum, acc);
+#else
+        for (int l = 0; l < C; l++) sum[l] = 0;
+        for (sparse_index_t q = 0; q < n; q += C) {
+          for (int l = 0; l < C; l++) sum[l] += chunk_val[q + l] * x[chunk_idx[q + l]];
+        }
+#endif
+        for (int l = 0; l < C; l++) {
+          sparse_index_t i = perm[k * C + l];
+          if (i < rows) y[i] = sum[l];
+        }
+      }
+    });
+  }
+
+  json structure_bytes() const {
+    size_t index = chunk_pos.size() + perm.size() + idx.size();
+    return ::structure_bytes(index * sizeof(sparse_index_t), val.size() * sizeof(double));
+  }
+};
+
+// Value storage of the compact CSR kernel. The reduced types are widened to
+// fp32 and accumulated in fp32; fp64 is read and accumulated as is.
+enum value_type_t { VALUES_FP64, VALUES_FP32, VALUES_BF16, VALUES_FP16 };
+
+const char *value_type_names[] = {"fp64", "fp32", "bf16", "fp16"};
+
+value_type_t parse_value_type(const std::string &name) {
+  for (int v = 0; v < 4; v++) {
+    if (name == value_type_names[v]) return (value_type_t)v;
+  }
+  throw std::invalid_argument("Invalid value type " + name);
+}
+
+// Column indices of the compact CSR kernel: the full sparse_index_t array,
+// or 16-bit deltas from the previous column of the row.
+enum index_encoding_t { INDICES_FULL, INDICES_DELTA16 };
+
+const char *index_encoding_names[] = {"full", "delta16"};
+
+index_encoding_t parse_index_encoding(const std::string &name) {
+  for (int e = 0; e < 2; e++) {
+    if (name == index_encoding_names[e]) return (index_encoding_t)e;
+  }
+  throw std::invalid_argument("Invalid index encoding " + name);
+}
+
+// bfloat16: the upper half of an fp32, rounded to nearest even.
+struct bf16_t {
+  uint16_t bits;
+};
+
+inline bf16_t to_bf16(double value) {
+  float f = value;
+  uint32_t bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return {(uint16_t)(bits >> 16)};
+}
+
+inline float widen(bf16_t value) {
+  uint32_t bits = (uint32_t)value.bits << 16;
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+inline float widen(float value) { return value; }
+inline double widen(double value) { return value; }
+#ifdef __FLT16_MAX__
+inline float widen(_Float16 value) { return value; }
+#endif
+
+// CSR with narrower values and/or indices, which cut the bytes streamed per
+// nonzero from 12 (fp64 + 32-bit index) to as few as 4 (bf16 or fp16 + 16-bit
+// delta). With delta16, row i starts at column base[i] and each entry adds
+// its delta to the previous column; a gap wider than 65535 columns is bridged
+// by explicit zeros, counted in `fill`. The error of the result against the
+// fp64 CSR kernel is reported with the time.
+struct compact_csr_t {
+  value_type_t value_type = VALUES_FP64;
+  index_encoding_t index_encoding = INDICES_FULL;
+
+  sparse_index_t rows = 0;
+  // Borrowed from the CSR operand when the indices are full
+  const sparse_index_t *pos = nullptr;
+  const sparse_index_t *idx = nullptr;
+  std::vector<sparse_index_t> delta_pos, base;
+  std::vector<uint16_t> deltas;
+  const double *val64 = nullptr;
+  std::vector<double> bridged64;
+  std::vector<float> val32;
+  std::vector<bf16_t> val_bf16;
+#ifdef __FLT16_MAX__
+  std::vector<_Float16> val_fp16;
+#endif
+  // x rounded to fp32 for the reduced value types
+  std::vector<float> x32;
+  double fill = 1;
+
+  void convert(const csr_view_t &A) {
+#ifndef __FLT16_MAX__
+    if (value_type == VALUES_FP16) {
+      throw std::invalid_argument("fp16 values need a compiler with _Float16");
+    }
+#endif
+    rows = A.rows;
+    pos = A.pos;
+    idx = A.idx;
+    sparse_index_t nnz = A.pos[rows];
+    // Entry q of the stored arrays holds A.val[source[q]], or a zero bridge
+    // when source[q] is -1
+    std::vector<sparse_index_t> source;
+    if (index_encoding == INDICES_DELTA16) {
+      delta_pos.assign(rows + 1, 0);
+      base.resize(rows);
+      #pragma omp parallel for schedule(dynamic, 1024)
+      for (sparse_index_t i = 0; i < rows; i++) {
+        sparse_index_t count = 0;
+        for (sparse_index_t p = A.pos[i] + 1; p < A.pos[i + 1]; p++) {
+          count += 1 + (A.idx[p] - A.idx[p - 1] - 1) / 65535;
+        }
+        delta_pos[i + 1] = count + (A.pos[i + 1] > A.pos[i]);
+        base[i] = A.pos[i + 1] > A.pos[i] ? A.idx[A.pos[i]] : 0;
+      }
+      std::partial_sum(delta_pos.begin(), delta_pos.end(), delta_pos.begin());
+      deltas.resize(delta_pos[rows]);
+      source.resize(delta_pos[rows]);
+      #pragma omp parallel for schedule(dynamic, 1024)
+      for (sparse_index_t i = 0; i < rows; i++) {
+        sparse_index_t q = delta_pos[i];
+        for (sparse_index_t p = A.pos[i]; p < A.pos[i + 1]; p++) {
+          sparse_index_t gap = p == A.pos[i] ? 0 : A.idx[p] - A.idx[p - 1];
+          for (; gap > 65535; gap -= 65535) {
+            deltas[q] = 65535;
+            source[q++] = -1;
+          }
+          deltas[q] = gap;
+          source[q++] = p;
+        }
+      }
+      pos = delta_pos.data();
+    }
+    sparse_index_t stored = pos[rows];
+    auto value = [&](sparse_index_t q) {
+      if (source.empty()) return A.val[q];
+      return source[q] < 0 ? 0.0 : A.val[source[q]];
+    };
+
+    val64 = A.val;
+    if (value_type == VALUES_FP64 && !source.empty()) {
+      bridged64.resize(stored);
+      #pragma omp parallel for schedule(static)
+      for (sparse_index_t q = 0; q < stored; q++) bridged64[q] = value(q);
+      val64 = bridged64.data();
+    } else if (value_type == VALUES_FP32) {
+      val32.resize(stored);
+      #pragma omp parallel for schedule(static)
+      for (sparse_index_t q = 0; q < stored; q++) val32[q] = value(q);
+    } else if (value_type == VALUES_BF16) {
+      val_bf16.resize(stored);
+      #pragma omp parallel for schedule(static)
+      for (sparse_index_t q = 0; q < stored; q++) val_bf16[q] = to_bf16(value(q));
+#ifdef __FLT16_MAX__
+    } else if (value_type == VALUES_FP16) {
+      val_fp16.resize(stored);
+      #pragma omp parallel for schedule(static)
+      for (sparse_index_t q = 0; q < stored; q++) val_fp16[q] = (_Float16)value(q);
+#endif
+    }
+    fill = nnz ? (double)stored / nnz : 1;
+  }
+
+  template <typename Value, typename Input, bool Delta>
+  void kernel(const Value *val, const Input *x, double *y) const {
+    using accumulator_t = decltype(widen(Value()));
+    for_each_part(pos, rows, [&](sparse_index_t begin, sparse_index_t end) {
+      for (sparse_index_t i = begin; i < end; i++) {
+        accumulator_t sum = 0;
+        if constexpr (Delta) {
+          sparse_index_t j = base[i];
+          for (sparse_index_t q = pos[i]; q < pos[i + 1]; q++) {
+            j += deltas[q];
+            sum += widen(val[q]) * x[j];
+          }
+        } else {
+          for (sparse_index_t q = pos[i]; q < pos[i + 1]; q++) {
+            sum += widen(val[q]) * x[idx[q]];
+          }
+        }
+        y[i] = sum;
+      }
+    });
+  }
+
+  template <typename Value, typename Input>
+  void kernel_indices(const Value *val, const Input *x, double *y) const {
+    if (index_encoding == INDICES_DELTA16) {
+      kernel<Value, Input, true>(val, x, y);
+    } else {
+      kernel<Value, Input, false>(val, x, y);
+    }
+  }
+
+  // Round x for the reduced value types; call once per x before multiply.
+  void prepare(const double *x, sparse_index_t n) {
+    if (value_type != VALUES_FP64) x32.assign(x, x + n);
+  }
+
+  void multiply(const double *x, double *y) const {
+    switch (value_type) {
+      case VALUES_FP64: kernel_indices(val64, x, y); break;
+      case VALUES_FP32: kernel_indices(val32.data(), x32.data(), y); break;
+      case VALUES_BF16: kernel_indices(val_bf16.data(), x32.data(), y); break;
+#ifdef __FLT16_MAX__
+      case VALUES_FP16: kernel_indices(val_fp16.data(), x32.data(), y); break;
+#endif
+      default: break;
+    }
+  }
+
+  size_t value_bytes() const {
+    switch (value_type) {
+      case VALUES_FP32: return 4;
+      case VALUES_BF16: case VALUES_FP16: return 2;
+      default: return 8;
+    }
+  }
+
+  json structure_bytes() const {
+    size_t stored = pos[rows];
+    size_t index = (rows + 1) * sizeof(sparse_index_t);
+    if (index_encoding == INDICES_DELTA16) {
+      index += rows * sizeof(sparse_index_t) + stored * sizeof(uint16_t);
+    } else {
+      index += stored * sizeof(sparse_index_t);
+    }
+    return ::structure_bytes(index, stored * value_bytes());
+  }
+
+  // Values and column indices streamed per stored entry
+  double bytes_per_entry() const {
+    return value_bytes() + (index_encoding == INDICES_DELTA16 ? sizeof(uint16_t) : sizeof(sparse_index_t));
+  }
+};
+
+// CSR with every thread's rows in memory of the NUMA node it runs on. Threads
+// are spread over the nodes and pinned to their CPUs, rows are cut between
+// them by nonzeros as in for_each_part, so each node holds one contiguous
+// block of rows, and each thread copies its rows of A into arrays it touches
+// first and is the first to write its rows of y. x stays where the loader put
+// it, or with interleave_x gets its pages dealt round-robin over the nodes so
+// that the gathers are spread over every memory controller instead of one.
+struct numa_csr_t {
+  bool enabled = false;
+  bool interleave_x = false;
+  numa_topology_t topology = numa_topology_t::detect();
+
+  struct part_t {
+    // Index into topology.nodes
+    int node = 0;
+    int cpu = 0;
+    sparse_index_t begin = 0;
+    sparse_index_t end = 0;
+    numa_array_t<sparse_index_t> pos;
+    numa_array_t<sparse_index_t> idx;
+    numa_array_t<double> val;
+    // Nanoseconds this thread spent in the last multiply
+    long long time = 0;
+  };
+  std::vector<part_t> parts;
+  numa_array_t<double> x;
+  numa_array_t<double> y;
+
+  void set(const std::vector<std::string> &args) {
+    if (args.empty() || (args[0] != "on" && args[0] != "off")) {
+      throw std::invalid_argument("Usage: numa on [interleave] | off");
+    }
+    enabled = args[0] == "on";
+    interleave_x = enabled && args.size() > 1 && args[1] == "interleave";
+  }
+
+  // Place A, y and, when interleaved, x for `threads` threads.
+  void prepare(const csr_view_t &A, const double *x_in, sparse_index_t n, int threads) {
+    std::vector<std::pair<int, int>> placement = topology.place(threads);
+    // Nodes that got threads, and the first thread and thread count of each
+    std::vector<int> used;
+    std::vector<int> first(topology.nodes.size(), 0);
+    std::vector<int> count(topology.nodes.size(), 0);
+    for (int t = threads - 1; t >= 0; t--) {
+      first[placement[t].first] = t;
+      count[placement[t].first]++;
+    }
+    for (size_t k = 0; k < topology.nodes.size(); k++) {
+      if (count[k] > 0) used.push_back(k);
+    }
+
+    parts = std::vector<part_t>(threads);
+    y = numa_array_t<double>(A.rows);
+    x = numa_array_t<double>(interleave_x ? n : 0);
+    size_t page_values = sysconf(_SC_PAGESIZE) / sizeof(double);
+    size_t pages = (x.size() + page_values - 1) / page_values;
+    #pragma omp parallel num_threads(threads)
+    {
+#ifdef _OPENMP
+      int t = omp_get_thread_num();
+#else
+      int t = 0;
+#endif
+      part_t &part = parts[t];
+      part.node = placement[t].first;
+      part.cpu = placement[t].second;
+      pin_to_cpu(part.cpu);
+      auto cut = [&](int p) -> sparse_index_t {
+        if (p == threads) return A.rows;
+        double target = (double)A.pos[A.rows] * p / threads;
+        return std::lower_bound(A.pos, A.pos + A.rows + 1, target) - A.pos;
+      };
+      part.begin = cut(t);
+      part.end = cut(t + 1);
+      sparse_index_t offset = A.pos[part.begin];
+      sparse_index_t nnz = A.pos[part.end] - offset;
+      part.pos = numa_array_t<sparse_index_t>(part.end - part.begin + 1);
+      part.idx = numa_array_t<sparse_index_t>(nnz);
+      part.val = numa_array_t<double>(nnz);
+      for (sparse_index_t i = part.begin; i <= part.end; i++) {
+        part.pos[i - part.begin] = A.pos[i] - offset;
+      }
+      std::copy(A.idx + offset, A.idx + offset + nnz, part.idx.data());
+      std::copy(A.val + offset, A.val + offset + nnz, part.val.data());
+      std::fill(y.data() + part.begin, y.data() + part.end, 0.0);
+      // Page p of x goes to used node p % used.size(), and among its threads
+      // to the one whose rank comes up next
+      size_t slot = std::find(used.begin(), used.end(), part.node) - used.begin();
+      size_t rank = t - first[part.node];
+      size_t stride = used.size() * count[part.node];
+      for (size_t p = slot + used.size() * rank; p < pages; p += stride) {
+        x[p * page_values] = 0;
+      }
+    }
+    if (interleave_x) std::copy(x_in, x_in + n, x.data());
+  }
+
+  void multiply(const double *x_in) {
+    const double *xs = interleave_x ? x.data() : x_in;
+    #pragma omp parallel num_threads(parts.size())
+    {
+#ifdef _OPENMP
+      part_t &part = parts[omp_get_thread_num()];
+#else
+      part_t &part = parts[0];
+#endif
+      auto tic = std::chrono::steady_clock::now();
+      double *ys = y.data() + part.begin;
+      for (sparse_index_t i = 0; i < part.end - part.begin; i++) {
+        double sum = 0;
+        for (sparse_index_t p = part.pos[i]; p < part.pos[i + 1]; p++) {
+          sum += part.val[p] * xs[part.idx[p]];
+        }
+        ys[i] = sum;
+      }
+      auto toc = std::chrono::steady_clock::now();
+      part.time = std::chrono::duration_cast<std::chrono::nanoseconds>(toc - tic).count();
+    }
+  }
+
+  // Rows, nonzeros and the A and y bytes of every node, the node's time in
+  // the last multiply (its slowest thread) and the bandwidth that makes, and
+  // the share of those bytes' pages the kernel reports on the node.
+  json report() const {
+    json nodes = json::array();
+    for (size_t k = 0; k < topology.nodes.size(); k++) {
+      int threads = 0;
+      sparse_index_t rows = 0;
+      sparse_index_t nnz = 0;
+      size_t bytes = 0;
+      long long time = 0;
+      double local = 0;
+      size_t sampled = 0;
+      for (const part_t &part : parts) {
+        if (part.node != (int)k) continue;
+        size_t y_bytes = (part.end - part.begin) * sizeof(double);
+        threads++;
+        rows += part.end - part.begin;
+        nnz += part.idx.size();
+        bytes += part.pos.bytes() + part.idx.bytes() + part.val.bytes() + y_bytes;
+        time = std::max(time, part.time);
+        std::pair<const void *, size_t> arrays[] = {
+          {part.pos.data(), part.pos.bytes()},
+          {part.idx.data(), part.idx.bytes()},
+          {part.val.data(), part.val.bytes()},
+          {y.data() + part.begin, y_bytes},
+        };
+        for (auto [data, size] : arrays) {
+          double share = local_page_share(data, size, topology.nodes[k]);
+          if (share < 0) continue;
+          local += share * size;
+          sampled += size;
+        }
+      }
+      if (threads == 0) continue;
+      nodes.push_back({
+        {"node", topology.nodes[k]},
+        {"threads", threads},
+        {"rows", rows},
+        {"nnz", nnz},
+        {"bytes", bytes},
+        {"time", time},
+        {"bandwidth", time > 0 ? bytes / (time * 1e-9) : 0.0},
+        {"local_pages", sampled > 0 ? json(local / sampled) : json(nullptr)},
+      });
+    }
+    return {{"x", interleave_x ? "interleave" : "local"}, {"nodes", nodes}};
+  }
+};
+
+struct spmv_native_t {
+  thread_sweep_t threads;
+  // Also read hardware counters around the measured call.
+  bool counters = false;
+  // Warmup, sample count and cache flushing of the measured call.
+  timing_t timing;
+  // Check the result against a reference after each run.
+  verify_t verify;
+  format_t format = FORMAT_CSR;
+  // Requested BCSR block size, 0 x 0 to choose it from the matrix.
+  int block_rows = 0;
+  int block_cols = 0;
+  sparse_index_t sigma = 256;
+  eigen_operand_t<Eigen::RowMajor> A;
+  bcsr_t bcsr;
+  sell_t sell;
+  // Reduced value or index widths, only for the csr format.
+  compact_csr_t compact;
+  // Per-node placement of A, y and x, only for the fp64 csr format.
+  numa_csr_t numa;
+  Eigen::VectorXd x;
+  Eigen::VectorXd y;
+  // BCSR reads x and writes y padded to whole blocks.
+  Eigen::VectorXd x_padded;
+  Eigen::VectorXd y_padded;
+  std::string input;
+
+  void load(const std::string &input) {
+    A.load(input, "A");
+    x = load_eigen_vector(input, "x");
+    this->input = input;
+  }
+
+  void set_format(const std::string &name, const std::string &parameter) {
+    format = parse_format(name);
+    if (format == FORMAT_BCSR) {
+      block_rows = block_cols = 0;
+      if (!parameter.empty() && parameter != "auto") {
+        size_t by = parameter.find('x');
+        if (by == std::string::npos) {
+          throw std::invalid_argument("Block size must be RxC or auto");
+        }
+        block_rows = std::stoi(parameter.substr(0, by));
+        block_cols = std::stoi(parameter.substr(by + 1));
+      }
+    } else if (format == FORMAT_SELL && !parameter.empty()) {
+      sigma = std::stol(parameter);
+    }
+  }
+
+  void set_precision(const std::string &values, const std::string &indices) {
+    compact.value_type = parse_value_type(values);
+    compact.index_encoding = parse_index_encoding(indices);
+  }
+
+  bool reduced() const {
+    return compact.value_type != VALUES_FP64 || compact.index_encoding != INDICES_FULL;
+  }
+
+  // Convert A to the requested format and return the time it took.
+  long long convert() {
+    if (reduced() && format != FORMAT_CSR) {
+      throw std::invalid_argument("Reduced values and indices are only supported with the csr format");
+    }
+    if (numa.enabled && (reduced() || format != FORMAT_CSR)) {
+      throw std::invalid_argument("NUMA placement is only supported with the fp64 csr format");
+    }
+    csr_view_t A_view = csr_view(*A);
+    auto tic = std::chrono::high_resolution_clock::now();
+    if (reduced()) {
+      compact.convert(A_view);
+      compact.prepare(x.data(), x.size());
+    } else if (format == FORMAT_BCSR) {
+      bcsr.convert(A_view, block_rows, block_cols);
+    } else if (format == FORMAT_SELL) {
+      sell.convert(A_view, sigma);
+    }
+    auto toc = std::chrono::high_resolution_clock::now();
+    if (format == FORMAT_BCSR) {
+      x_padded = Eigen::VectorXd::Zero(bcsr.block_cols * bcsr.c);
+      x_padded.head(x.size()) = x;
+      y_padded = Eigen::VectorXd::Zero(bcsr.block_rows * bcsr.r);
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(toc - tic).count();
+  }
+
+  json run(const std::string &output, int reps) {
+    long long convert_time = convert();
+    csr_view_t A_view = csr_view(*A);
+    y = Eigen::VectorXd::Zero(A->rows());
+    auto setup = []() {};
+    auto test = [&]() {
+      if (format == FORMAT_BCSR) {
+        bcsr.multiply(x_padded.data(), y_padded.data());
+      } else if (format == FORMAT_SELL) {
+        sell.multiply(x.data(), y.data());
+      } else if (reduced()) {
+        compact.multiply(x.data(), y.data());
+      } else if (numa.enabled) {
+        numa.multiply(x.data());
+      } else {
+        csr_spmv(A_view, x.data(), y.data());
+      }
+    };
+    json measurements = sweep_threads(threads, [&](int threads) {
+      json entry;
+      // Placed again for every count, since the rows follow the threads
+      if (numa.enabled) numa.prepare(A_view, x.data(), x.size(), threads);
+      entry.update(benchmark_samples(timing, setup, test, reps));
+      if (numa.enabled) entry["numa"] = numa.report();
+      if (counters) entry.update(measure_counters(timing, setup, test, reps));
+      return entry;
+    });
+    json structures = {
+      {"x", structure_bytes(0, x.size() * sizeof(double))},
+      {"y", structure_bytes(0, y.size() * sizeof(double))},
+    };
+    if (format == FORMAT_BCSR) {
+      structures["A"] = bcsr.structure_bytes();
+      structures["A_csr"] = eigen_structure_bytes(*A);
+      structures["padded_vectors"] = structure_bytes(0, (x_padded.size() + y_padded.size()) * sizeof(double));
+    } else if (format == FORMAT_SELL) {
+      structures["A"] = sell.structure_bytes();
+      structures["A_csr"] = eigen_structure_bytes(*A);
+    } else if (reduced()) {
+      structures["A"] = compact.structure_bytes();
+      structures["A_csr"] = eigen_structure_bytes(*A);
+      structures["x32"] = structure_bytes(0, compact.x32.size() * sizeof(float));
+    } else if (numa.enabled) {
+      size_t index = 0;
+      size_t value = 0;
+      for (const numa_csr_t::part_t &part : numa.parts) {
+        index += part.pos.bytes() + part.idx.bytes();
+        value += part.val.bytes();
+      }
+      structures["A"] = structure_bytes(index, value);
+      structures["A_csr"] = eigen_structure_bytes(*A);
+      structures["y_placed"] = structure_bytes(0, numa.y.bytes());
+      if (numa.interleave_x) structures["x_interleaved"] = structure_bytes(0, numa.x.bytes());
+    } else {
+      structures["A"] = eigen_structure_bytes(*A);
+    }
+    record_memory(measurements, measure_memory(setup, test), structures);
+
+    measurements["format"] = format_names[format];
+    measurements["convert_time"] = convert_time;
+    if (numa.enabled) {
+      std::copy(numa.y.data(), numa.y.data() + numa.y.size(), y.data());
+      measurements["numa_nodes"] = numa.topology.nodes;
+    }
+    if (format == FORMAT_BCSR) {
+      measurements["block_rows"] = bcsr.r;
+      measurements["block_cols"] = bcsr.c;
+      measurements["fill"] = bcsr.fill;
+    } else if (format == FORMAT_SELL) {
+      measurements["chunk_rows"] = sell_t::C;
+      measurements["sigma"] = sell.sigma;
+      measurements["fill"] = sell.fill;
+    }
+    measurements["values"] = value_type_names[compact.value_type];
+    measurements["indices"] = index_encoding_names[compact.index_encoding];
+    if (reduced()) {
+      // Error of this run's y against the fp64 CSR kernel
+      Eigen::VectorXd reference(y.size());
+      csr_spmv(A_view, x.data(), reference.data());
+      double norm = reference.norm();
+      measurements["fill"] = compact.fill;
+      measurements["bytes_per_entry"] = compact.bytes_per_entry();
+      measurements["max_error"] = (y - reference).cwiseAbs().maxCoeff();
+      measurements["relative_error"] = norm > 0 ? (y - reference).norm() / norm : 0.0;
+    }
+    // BCSR leaves y in the head of y_padded
+    const double *result = format == FORMAT_BCSR ? y_padded.data() : y.data();
+    measurements["checksum"] = output_checksum(result, A->rows());
+    if (verify.enabled) measurements["verification"] = verify.spmv(input, result, A->rows(), 1, false, false);
+    std::ofstream measurements_file(output + "/measurements.json");
+    measurements_file << measurements;
+    measurements_file.close();
+    return measurements;
+  }
+
+  void fetch(const std::string &output) {
+    if (format == FORMAT_BCSR) y = y_padded.head(A->rows());
+    Eigen::MatrixXd denseY = y;
+    Eigen::SparseMatrix<double> sparseY = denseY.sparseView();
+    Eigen::saveMarket(sparseY, (output + "/y.ttx").c_str());
+  }
+};
+
+int main(int argc, char **argv) {
+  auto params = parse(argc, argv);
+
+  spmv_native_t spmv;
+  common_options_t options(spmv.threads, spmv.counters, spmv.timing, &spmv.verify);
+  std::string format = "csr";
+  std::string block = "auto";
+  std::string sigma = "256";
+  std::string values = "fp64";
+  std::string indices = "full";
+
+  std::vector<option> long_options = options.long_options({
+    {"help", no_argument, 0, 'h'},
+    {"format", required_argument, 0, 'f'},
+    {"block", required_argument, 0, 'b'},
+    {"sigma", required_argument, 0, 's'},
+    {"values", required_argument, 0, 'P'},
+    {"indices", required_argument, 0, 'I'},
+    {"numa", required_argument, 0, 'N'},
+  });
+  std::string short_options = options.short_options("hf:b:s:P:I:N:");
+
+  // Parse the options
+  int option_index = 0;
+  int c;
+  optind = 1;
+  while ((c = getopt_long(params.argc, params.argv, short_options.c_str(), long_options.data(), &option_index)) != -1) {
+    switch (c) {
+      case 'h':
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -h, --help      Print this help message" << std::endl;
+        std::cout << "  -f, --format    Storage format, from [csr, bcsr, sell]" << std::endl;
+        std::cout << "  -b, --block     BCSR block size as RxC with R, C in [1, 2, 3, 4, 6, 8], or auto" << std::endl;
+        std::cout << "  -s, --sigma     SELL sorting window in rows" << std::endl;
+        std::cout << "  -P, --values    CSR value storage, from [fp64, fp32, bf16, fp16]; reduced types accumulate in fp32" << std::endl;
+        std::cout << "  -I, --indices   CSR column indices, from [full, delta16]" << std::endl;
+        std::cout << "  -N, --numa      Place each thread's rows of A and y on its NUMA node, and x from [local, interleave]" << std::endl;
+        options.help(18, "load/format/precision/numa/verify/run/fetch", "y_ref.bin or A times x", "y.ttx");
+        exit(0);
+      case 'f':
+        format = optarg;
+        break;
+      case 'b':
+        block = optarg;
+        break;
+      case 's':
+        sigma = optarg;
+        break;
+      case 'P':
+        values = optarg;
+        break;
+      case 'I':
+        indices = optarg;
+        break;
+      case 'N':
+        if (std::string(optarg) != "local" && std::string(optarg) != "interleave") {
+          std::cerr << "Invalid x placement " << optarg << std::endl;
+          exit(1);
+        }
+        spmv.numa.set({"on", optarg});
+        break;
+      case '?':
+        // getopt_long already printed an error message
+        break;
+      default:
+        if (!options.parse(c, optarg)) abort();
+    }
+  }
+
+  try {
+    spmv.set_format(format, format == "bcsr" ? block : sigma);
+    spmv.set_precision(values, indices);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  std::map<std::string, server_command_t> commands = {
+    {"load", [&](const server_args_t &args) { spmv.load(server_arg(args, 0, "input dir")); return json(); }},
+    {"format", [&](const server_args_t &args) {
+      spmv.set_format(server_arg(args, 0, "name"), args.size() > 1 ? args[1] : "");
+      return json();
+    }},
+    {"precision", [&](const server_args_t &args) {
+      spmv.set_precision(server_arg(args, 0, "values"), args.size() > 1 ? args[1] : "full");
+      return json();
+    }},
+    {"numa", [&](const server_args_t &args) { spmv.numa.set(args); return json(); }},
+    {"run", [&](const server_args_t &args) { return spmv.run(server_arg(args, 0, "output dir"), server_reps(args, 1)); }},
+    {"fetch", [&](const server_args_t &args) { spmv.fetch(server_arg(args, 0, "output dir")); return json(); }},
+  };
+  options.add_commands(commands);
+  if (options.server) return serve(commands);
+  if (!options.manifest.empty()) return run_manifest(options.manifest, commands, options.write_output);
+
+  spmv.load(params.input);
+  spmv.run(params.output, 0);
+  if (options.write_output) spmv.fetch(params.output);
+  return 0;
+}
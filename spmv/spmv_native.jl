@@ -0,0 +1,43 @@
+using Finch
+using TensorMarket
+using JSON
+
+function spmv_native_helper(format, parameter, A, x; values="fp64", indices="full", numa=nothing)
+    tmpdir = mktempdir(@__DIR__, prefix="experiment_")
+    A_path = joinpath(tmpdir, "A.bin")
+    x_path = joinpath(tmpdir, "x.bin")
+    y_path = joinpath(tmpdir, "y.ttx")
+
+    write_binary_matrix(A_path, A, layout=:csr)
+    write_binary_vector(x_path, x)
+
+    spmv_path = joinpath(@__DIR__, "spmv_native")
+    server = driver_server(`$spmv_path -- --server`)
+    driver_request(server, "load", tmpdir)
+    driver_request(server, "format", format, parameter)
+    driver_request(server, "precision", values, indices)
+    numa === nothing || driver_request(server, "numa", "on", numa)
+    measurements = driver_request(server, "run", tmpdir)
+    y = nothing
+    if !driver_verify[]
+        driver_request(server, "fetch", tmpdir)
+        y = Vector(reshape(SparseMatrixCSC(fread(y_path)), :))
+    end
+
+    # max_error and relative_error against fp64 are only reported for reduced storage
+    errors = haskey(measurements, "relative_error") ? (;max_error=measurements["max_error"], relative_error=measurements["relative_error"]) : (;)
+    # Per-node rows, bytes and bandwidth of NUMA placed runs
+    placement = haskey(measurements, "numa") ? (;numa=measurements["numa"]) : (;)
+    return (;time=measurements["time"]*10^-9, y=y, convert_time=measurements["convert_time"]*10^-9, errors..., placement..., scaling=measurements["scaling"], memory=measurements["memory"], timing=measurements["timing"], counters=counter_measurements(measurements), verify_measurements(measurements)...)
+end
+
+spmv_native_csr(y, A, x) = spmv_native_helper("csr", "", A, x)
+spmv_native_bcsr(y, A, x) = spmv_native_helper("bcsr", "auto", A, x)
+spmv_native_sell(y, A, x) = spmv_native_helper("sell", "256", A, x)
+spmv_native_fp32(y, A, x) = spmv_native_helper("csr", "", A, x, values="fp32")
+spmv_native_bf16(y, A, x) = spmv_native_helper("csr", "", A, x, values="bf16")
+spmv_native_fp16(y, A, x) = spmv_native_helper("csr", "", A, x, values="fp16")
+spmv_native_bf16_delta16(y, A, x) = spmv_native_helper("csr", "", A, x, values="bf16", indices="delta16")
+spmv_native_numa(y, A, x) = spmv_native_helper("csr", "", A, x, numa="interleave")
+
+has_native() = isfile(joinpath(@__DIR__, "spmv_native"))
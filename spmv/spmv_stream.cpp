@@ -0,0 +1,368 @@
+#include <algorithm>
+#include <chrono>
+#include <sys/stat.h>
+#include <iostream>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../deps/SparseRooflineBenchmark/src/benchmark.hpp"
+#include "../common/server.hpp"
+#include "../common/threads.hpp"
+#include "../common/memory.hpp"
+#include "../common/perf_counters.hpp"
+#include "../common/timing.hpp"
+#include "../common/eigen_operand.hpp"
+#include "../common/verify.hpp"
+#include "../common/options.hpp"
+
+extern int optind;
+
+// Out-of-core CSR SpMV for matrices larger than memory. Only the row pointers
+// of A and the vectors stay resident; the column indices and values are read
+// from <input>/A.bin (CSR layout) in row panels of about panel_bytes. While
+// the OpenMP team multiplies one panel, a helper thread preads the next into
+// the other of two buffers, so a panel costs about max(read, compute) rather
+// than their sum. Pointers are 64-bit whatever the build's index width, since
+// the matrices this is for rarely fit 32-bit offsets. With drop_cache, each
+// panel's pages are evicted from the page cache after they are read, so that
+// every repetition reads the device instead of memory.
+struct stream_csr_t {
+  struct panel_t {
+    int64_t begin = 0;
+    int64_t end = 0;
+    // Raw column indices, index_bits wide, and values
+    std::vector<uint64_t> idx;
+    std::vector<double> val;
+  };
+
+  // Time of the last multiply, split by what the threads were doing.
+  struct stats_t {
+    uint64_t bytes = 0;
+    long long read_time = 0;
+    long long compute_time = 0;
+    long long wait_time = 0;
+  };
+
+  size_t panel_bytes = 64 << 20;
+  bool drop_cache = false;
+  binary_matrix_header_t header = {};
+  std::vector<int64_t> pos;
+  std::vector<int64_t> cuts;
+  panel_t buffers[2];
+  stats_t stats;
+
+  ~stream_csr_t() {
+    if (fd >= 0) close(fd);
+  }
+
+  void open_file(const std::string &path) {
+    if (fd >= 0) close(fd);
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open " + path);
+    }
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        std::memcmp(header.magic, BINARY_MATRIX_MAGIC, sizeof(BINARY_MATRIX_MAGIC)) != 0 ||
+        header.version != BINARY_MATRIX_VERSION) {
+      throw std::runtime_error("Not a binary matrix: " + path);
+    }
+    if (header.layout != BINARY_CSR || (header.index_bits != 32 && header.index_bits != 64)) {
+      throw std::runtime_error(path + " must be a CSR binary matrix to be streamed");
+    }
+    std::vector<uint64_t> raw((header.rows + 1) * header.index_bits / 64 + 1);
+    read_fully(raw.data(), (header.rows + 1) * header.index_bits / 8, header.pos_offset);
+    pos.resize(header.rows + 1);
+    for (uint64_t i = 0; i <= header.rows; i++) {
+      pos[i] = header.index_bits == 32 ? ((const uint32_t *)raw.data())[i] : raw[i];
+    }
+    if ((uint64_t)pos[header.rows] != header.nnz) {
+      throw std::runtime_error("Inconsistent row pointers in " + path);
+    }
+  }
+
+  size_t entry_bytes() const {
+    return header.index_bits / 8 + sizeof(double);
+  }
+
+  // Cut the rows into panels of at most panel_bytes, or single rows above it.
+  void plan() {
+    cuts.assign(1, 0);
+    int64_t rows = header.rows;
+    size_t limit = std::max<size_t>(panel_bytes / entry_bytes(), 1);
+    size_t widest = 0;
+    for (int64_t begin = 0; begin < rows;) {
+      int64_t end = std::upper_bound(pos.begin() + begin + 1, pos.end(), pos[begin] + (int64_t)limit) - pos.begin() - 1;
+      end = std::max(end, begin + 1);
+      widest = std::max<size_t>(widest, pos[end] - pos[begin]);
+      cuts.push_back(end);
+      begin = end;
+    }
+    for (panel_t &buffer : buffers) {
+      buffer.idx.resize((widest * header.index_bits + 63) / 64);
+      buffer.val.resize(widest);
+    }
+  }
+
+  int64_t panels() const {
+    return cuts.size() - 1;
+  }
+
+  void read_panel(int64_t k, panel_t &panel) {
+    panel.begin = cuts[k];
+    panel.end = cuts[k + 1];
+    uint64_t first = pos[panel.begin];
+    uint64_t count = pos[panel.end] - first;
+    uint64_t index_bytes = header.index_bits / 8;
+    read_fully(panel.idx.data(), count * index_bytes, header.idx_offset + first * index_bytes);
+    read_fully(panel.val.data(), count * sizeof(double), header.val_offset + first * sizeof(double));
+    if (drop_cache) {
+      posix_fadvise(fd, header.idx_offset + first * index_bytes, count * index_bytes, POSIX_FADV_DONTNEED);
+      posix_fadvise(fd, header.val_offset + first * sizeof(double), count * sizeof(double), POSIX_FADV_DONTNEED);
+    }
+  }
+
+  template <typename Int>
+  void multiply_panel(const panel_t &panel, const double *x, double *y) const {
+    const Int *idx = (const Int *)panel.idx.data();
+    const double *val = panel.val.data();
+    int64_t first = pos[panel.begin];
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int64_t i = panel.begin; i < panel.end; i++) {
+      double sum = 0;
+      for (int64_t p = pos[i] - first; p < pos[i + 1] - first; p++) {
+        sum += val[p] * x[idx[p]];
+      }
+      y[i] = sum;
+    }
+  }
+
+  void multiply(const double *x, double *y) {
+    using clock = std::chrono::high_resolution_clock;
+    auto elapsed = [](clock::time_point tic) {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - tic).count();
+    };
+    stats = stats_t();
+    stats.bytes = header.nnz * entry_bytes();
+    long long read_time = 0;
+    std::exception_ptr error;
+    auto read = [&](int64_t k) {
+      auto tic = clock::now();
+      try {
+        read_panel(k, buffers[k & 1]);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      read_time += elapsed(tic);
+    };
+
+    auto tic = clock::now();
+    if (panels() > 0) read(0);
+    stats.wait_time += elapsed(tic);
+    for (int64_t k = 0; k < panels() && !error; k++) {
+      std::thread reader;
+      if (k + 1 < panels()) reader = std::thread(read, k + 1);
+      tic = clock::now();
+      if (header.index_bits == 32) {
+        multiply_panel<uint32_t>(buffers[k & 1], x, y);
+      } else {
+        multiply_panel<uint64_t>(buffers[k & 1], x, y);
+      }
+      stats.compute_time += elapsed(tic);
+      tic = clock::now();
+      if (reader.joinable()) reader.join();
+      stats.wait_time += elapsed(tic);
+    }
+    stats.read_time = read_time;
+    if (error) std::rethrow_exception(error);
+  }
+
+  size_t resident_bytes() const {
+    size_t bytes = pos.size() * sizeof(int64_t);
+    for (const panel_t &buffer : buffers) {
+      bytes += buffer.idx.size() * sizeof(uint64_t) + buffer.val.size() * sizeof(double);
+    }
+    return bytes;
+  }
+
+private:
+  int fd = -1;
+
+  void read_fully(void *data, uint64_t bytes, uint64_t offset) {
+    char *target = (char *)data;
+    while (bytes > 0) {
+      ssize_t got = pread(fd, target, bytes, offset);
+      if (got <= 0) {
+        throw std::runtime_error("Failed to read the streamed matrix: " +
+                                 std::string(got < 0 ? strerror(errno) : "unexpected end of file"));
+      }
+      target += got;
+      offset += got;
+      bytes -= got;
+    }
+  }
+};
+
+struct spmv_stream_t {
+  thread_sweep_t threads;
+  // Also read hardware counters around the measured call.
+  bool counters = false;
+  // Warmup, sample count and cache flushing of the measured call.
+  timing_t timing;
+  // Check the result against a reference after each run.
+  verify_t verify;
+  stream_csr_t A;
+  Eigen::VectorXd x;
+  Eigen::VectorXd y;
+  std::string input;
+
+  void load(const std::string &input) {
+    std::string bin = input + "/A.bin";
+    if (!binary_matrix_exists(bin)) {
+      throw std::runtime_error("Streaming needs " + bin + " in the CSR layout");
+    }
+    A.open_file(bin);
+    x = load_eigen_vector(input, "x");
+    if ((uint64_t)x.size() != A.header.cols) {
+      throw std::runtime_error("x does not match the columns of A");
+    }
+    this->input = input;
+  }
+
+  json run(const std::string &output, int reps) {
+    A.plan();
+    y = Eigen::VectorXd::Zero(A.header.rows);
+    auto setup = []() {};
+    auto test = [&]() {
+      A.multiply(x.data(), y.data());
+    };
+    json measurements = sweep_threads(threads, [&](int) {
+      json entry;
+      entry.update(benchmark_samples(timing, setup, test, reps));
+      // Bandwidths of the last sample: overall, of the reads alone and of the
+      // kernel alone, all over the streamed bytes of A
+      const stream_csr_t::stats_t &stats = A.stats;
+      long long time = entry["timing"]["samples"].back().get<long long>();
+      entry["stream"] = {
+        {"bytes", stats.bytes},
+        {"read_time", stats.read_time},
+        {"compute_time", stats.compute_time},
+        {"wait_time", stats.wait_time},
+        {"io_bandwidth", stats.bytes / (time * 1e-9)},
+        {"read_bandwidth", stats.read_time > 0 ? stats.bytes / (stats.read_time * 1e-9) : 0.0},
+        {"kernel_bandwidth", stats.compute_time > 0 ? stats.bytes / (stats.compute_time * 1e-9) : 0.0},
+      };
+      if (counters) entry.update(measure_counters(timing, setup, test, reps));
+      return entry;
+    });
+    record_memory(measurements, measure_memory(setup, test), {
+      {"A", structure_bytes(A.resident_bytes(), 0)},
+      {"x", structure_bytes(0, x.size() * sizeof(double))},
+      {"y", structure_bytes(0, y.size() * sizeof(double))},
+    });
+
+    measurements["panel_bytes"] = A.panel_bytes;
+    measurements["panels"] = A.panels();
+    measurements["drop_cache"] = A.drop_cache;
+    measurements["streamed_bytes"] = A.header.nnz * A.entry_bytes();
+    measurements["checksum"] = output_checksum(y.data(), y.size());
+    // Without y_ref.bin this reads all of A into memory
+    if (verify.enabled) measurements["verification"] = verify.spmv(input, y.data(), y.size(), 1, false, false);
+    std::ofstream measurements_file(output + "/measurements.json");
+    measurements_file << measurements;
+    measurements_file.close();
+    return measurements;
+  }
+
+  void fetch(const std::string &output) {
+    Eigen::MatrixXd denseY = y;
+    Eigen::SparseMatrix<double> sparseY = denseY.sparseView();
+    Eigen::saveMarket(sparseY, (output + "/y.ttx").c_str());
+  }
+};
+
+int main(int argc, char **argv) {
+  auto params = parse(argc, argv);
+
+  spmv_stream_t spmv;
+  common_options_t options(spmv.threads, spmv.counters, spmv.timing, &spmv.verify);
+
+  auto set_panel = [&](const std::string &megabytes) {
+    double size = std::stod(megabytes);
+    if (!(size > 0)) {
+      throw std::invalid_argument("Panel size must be positive");
+    }
+    spmv.A.panel_bytes = size * (1 << 20);
+  };
+
+  std::vector<option> long_options = options.long_options({
+    {"help", no_argument, 0, 'h'},
+    {"panel_mb", required_argument, 0, 'P'},
+    {"drop_cache", no_argument, 0, 'D'},
+  });
+  std::string short_options = options.short_options("hP:D");
+
+  // Parse the options
+  int option_index = 0;
+  int c;
+  optind = 1;
+  while ((c = getopt_long(params.argc, params.argv, short_options.c_str(), long_options.data(), &option_index)) != -1) {
+    switch (c) {
+      case 'h':
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -h, --help        Print this help message" << std::endl;
+        std::cout << "  -P, --panel_mb    MiB of indices and values read per row panel (default 64)" << std::endl;
+        std::cout << "  -D, --drop_cache  Evict every panel from the page cache after reading it" << std::endl;
+        options.help(20, "load/panel/drop_cache/verify/run/fetch", "y_ref.bin or A times x", "y.ttx");
+        exit(0);
+      case 'P':
+        try {
+          set_panel(optarg);
+        } catch (const std::exception &e) {
+          std::cerr << "Invalid panel size" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'D':
+        spmv.A.drop_cache = true;
+        break;
+      case '?':
+        // getopt_long already printed an error message
+        break;
+      default:
+        if (!options.parse(c, optarg)) abort();
+    }
+  }
+
+  std::map<std::string, server_command_t> commands = {
+    {"load", [&](const server_args_t &args) { spmv.load(server_arg(args, 0, "input dir")); return json(); }},
+    {"panel", [&](const server_args_t &args) { set_panel(server_arg(args, 0, "MiB")); return json(); }},
+    {"drop_cache", [&](const server_args_t &args) { spmv.A.drop_cache = server_arg(args, 0, "on|off") == "on"; return json(); }},
+    {"run", [&](const server_args_t &args) { return spmv.run(server_arg(args, 0, "output dir"), server_reps(args, 1)); }},
+    {"fetch", [&](const server_args_t &args) { spmv.fetch(server_arg(args, 0, "output dir")); return json(); }},
+  };
+  options.add_commands(commands);
+  if (options.server) return serve(commands);
+  if (!options.manifest.empty()) return run_manifest(options.manifest, commands, options.write_output);
+
+  // Check that all required options are present
+  if (params.input.empty() || params.output.empty()) {
+    std::cerr << "Missing required option" << std::endl;
+    exit(1);
+  }
+
+  try {
+    spmv.load(params.input);
+    spmv.run(params.output, 0);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+  if (options.write_output) spmv.fetch(params.output);
+  return 0;
+}
@@ -0,0 +1,34 @@
+using Finch
+using TensorMarket
+using JSON
+
+# Out-of-core SpMV: the driver streams A.bin from disk in row panels. The
+# panels are evicted from the page cache as they are read, so the freshly
+# written file is not simply read back from memory.
+function spmv_stream_helper(A, x; panel_mb=64, drop_cache=true)
+    tmpdir = mktempdir(@__DIR__, prefix="experiment_")
+    A_path = joinpath(tmpdir, "A.bin")
+    x_path = joinpath(tmpdir, "x.bin")
+    y_path = joinpath(tmpdir, "y.ttx")
+
+    write_binary_matrix(A_path, A, layout=:csr)
+    write_binary_vector(x_path, x)
+
+    spmv_path = joinpath(@__DIR__, "spmv_stream")
+    server = driver_server(`$spmv_path -- --server`)
+    driver_request(server, "load", tmpdir)
+    driver_request(server, "panel", panel_mb)
+    driver_request(server, "drop_cache", drop_cache ? "on" : "off")
+    measurements = driver_request(server, "run", tmpdir)
+    y = nothing
+    if !driver_verify[]
+        driver_request(server, "fetch", tmpdir)
+        y = Vector(reshape(SparseMatrixCSC(fread(y_path)), :))
+    end
+
+    return (;time=measurements["time"]*10^-9, y=y, stream=measurements["stream"], scaling=measurements["scaling"], memory=measurements["memory"], timing=measurements["timing"], counters=counter_measurements(measurements), verify_measurements(measurements)...)
+end
+
+spmv_stream_csr(y, A, x) = spmv_stream_helper(A, x)
+
+has_stream() = isfile(joinpath(@__DIR__, "spmv_stream"))
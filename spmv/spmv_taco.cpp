@@ -4,99 +4,421 @@
 #include <iostream>
 #include <cstdint>
 #include "../deps/SparseRooflineBenchmark/src/benchmark.hpp"
+#include "../common/server.hpp"
+#include "../common/threads.hpp"
+#include "../common/memory.hpp"
+#include "../common/perf_counters.hpp"
+#include "../common/timing.hpp"
+#include "../common/taco_operand.hpp"
+#include "../common/taco_kernel_cache.hpp"
+#include "../common/symmetric_spmv.hpp"
+#include "../common/rhs_block.hpp"
+#include "../common/verify.hpp"
+#include "../common/options.hpp"
 
 namespace fs = std::filesystem;
 
 using namespace taco;
 extern int optind;
 
+struct spmv_taco_t {
+  thread_sweep_t threads;
+  // Also read hardware counters around the measured call.
+  bool counters = false;
+  // Warmup, sample count and cache flushing of the measured call.
+  timing_t timing;
+  // Check the result against a reference after each run.
+  verify_t verify;
+  std::string schedule = "row-major";
+  taco_operand_t A_file, x_file;
+  Tensor<double> A;
+  Tensor<double> x;
+  Tensor<double> y;
+  bool needs_compile = true;
+  // Nanoseconds the last run spent compiling, 0 when it reused the kernel.
+  long long compile_time = 0;
+  // The symmetric schedule keeps only the upper triangle of A, in these
+  // arrays, and multiplies it with a native kernel that mirrors each entry,
+  // since TACO cannot express the transposed update in the same loop.
+  bool upper = false;
+  std::vector<int> upper_pos, upper_idx;
+  std::vector<double> upper_val;
+  symmetric_spmv_t<int> symmetric;
+  std::vector<double> y_values;
+  // With more than one vector, y is the dense n x k product of A and the
+  // row-major block X (see load_rhs_block) instead of A * x.
+  int num_vectors = 1;
+  fs::path input;
+  Tensor<double> X;
+  std::vector<double> X_values;
+  // Rows per task of the parallel schedules, handed out dynamically.
+  int chunk = 64;
+  // The column-major-privatized schedule scatters each of these row blocks of
+  // A, balanced by nonzeros, into a private y and sums the copies into
+  // y_values. There is one block per thread of the count being timed, and
+  // partitioned_for is that count, or 0 before the first partition.
+  struct part_t {
+    Tensor<double> A, x, y;
+  };
+  std::vector<part_t> parts;
+  int partitioned_for = 0;
+
+  void load(const fs::path &input) {
+    A = A_file.load(input, "A", Format({Dense, Sparse}));
+    x = x_file.load(input, "x", Format({Dense}));
+    this->input = input;
+    upper = false;
+    parts.clear();
+    partitioned_for = 0;
+    needs_compile = true;
+  }
+
+  void set_num_vectors(int k) {
+    if (k < 1) {
+      throw std::invalid_argument("num_vectors must be positive");
+    }
+    needs_compile = needs_compile || k != num_vectors;
+    num_vectors = k;
+  }
+
+  void set_schedule(const std::string &name) {
+    if (name != "row-major" && name != "column-major" && name != "row-major-parallel" &&
+        name != "column-major-privatized" && name != "symmetric") {
+      throw std::invalid_argument("Invalid schedule");
+    }
+    needs_compile = needs_compile || name != schedule;
+    schedule = name;
+  }
+
+  void set_chunk(int rows) {
+    if (rows < 1) {
+      throw std::invalid_argument("chunk must be positive");
+    }
+    needs_compile = needs_compile || rows != chunk;
+    chunk = rows;
+  }
+
+  // Within one process TACO reuses the module of an isomorphic statement it has
+  // already compiled, so after the first matrix this is a cache lookup, and the
+  // kernel cache (taco_kernel_cache.hpp) spares later processes the compiler.
+  void compile() {
+    compile_time = 0;
+    if (!needs_compile) return;
+    int m = A.getDimension(0);
+    int n = A.getDimension(1);
+    if (schedule == "symmetric") {
+      if (num_vectors > 1) {
+        throw std::invalid_argument("The symmetric schedule multiplies one vector at a time");
+      }
+      keep_upper();
+      y_values.assign(m, 0.0);
+      needs_compile = false;
+      return;
+    }
+    if (upper) {
+      // A holds only its upper triangle, read it again in full
+      load(input);
+    }
+    parts.clear();
+    partitioned_for = 0;
+    if (schedule == "column-major-privatized") {
+      // The blocks depend on the thread count, so run() partitions A for each
+      // count it sweeps
+      if (num_vectors > 1) {
+        throw std::invalid_argument("The column-major-privatized schedule multiplies one vector at a time");
+      }
+      needs_compile = false;
+      return;
+    }
+    IndexVar i("i"), j("j"), k("k");
+    if (num_vectors > 1) {
+      int rows = x.getDimension(0);
+      X_values = load_rhs_block(input, (const double *)x.getStorage().getValues().getData(), rows, num_vectors);
+      X = Tensor<double>("X", {rows, num_vectors}, Format({Dense, Dense}));
+      X.getStorage().setValues(makeArray(X_values.data(), X_values.size()));
+      if (schedule != "column-major") {
+        y = Tensor<double>("Y", {m, num_vectors}, Format({Dense, Dense}));
+        y(i, k) += A(i, j) * X(j, k);
+      } else {
+        y = Tensor<double>("Y", {n, num_vectors}, Format({Dense, Dense}));
+        y(j, k) += A(i, j) * X(i, k);
+      }
+    } else if (schedule != "column-major") {
+      y = Tensor<double>("y", {m}, Format({Dense}));
+      y(i) += A(i, j) * x(j);
+    } else {
+      y = Tensor<double>("y", {n}, Format({Dense}));
+      y(j) += A(i, j) * x(i);
+    }
+
+    auto tic = std::chrono::high_resolution_clock::now();
+    if (schedule == "row-major-parallel") {
+      // Rows of A are independent, so chunks of them run on any thread. The
+      // split makes each iteration of i0 a chunk of rows, which TACO hands out
+      // one at a time.
+      IndexVar i0("i0"), i1("i1");
+      IndexStmt stmt = y.getAssignment().concretize();
+      stmt = stmt.split(i, i0, i1, chunk).parallelize(i0, ParallelUnit::CPUThread, OutputRaceStrategy::NoRaces);
+      taco_compile_scheduled(y, stmt, ParallelSchedule::Dynamic, 1);
+    } else {
+      y.compile();
+    }
+    compile_time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - tic).count();
+    needs_compile = false;
+  }
+
+  // Split the rows of A into `blocks` blocks of about equal nonzeros that share
+  // A's arrays, compile y(j) += A(i, j) * x(i) for each block and assemble its
+  // private y once, so the timed calls only compute into it. The time counts
+  // towards compile_time.
+  void partition(int blocks) {
+    if (blocks == partitioned_for) return;
+    auto tic = std::chrono::high_resolution_clock::now();
+    taco_csr_arrays_t csr = taco_csr_arrays(A);
+    const double *x_values = (const double *)x.getStorage().getValues().getData();
+    int nnz = csr.pos[csr.rows];
+    parts.clear();
+    int start = 0;
+    for (int t = 1; t <= blocks && start < csr.rows; t++) {
+      int end = t == blocks ? csr.rows : std::lower_bound(csr.pos, csr.pos + csr.rows + 1, (int)((long long)nnz * t / blocks)) - csr.pos;
+      end = std::max(end, start + 1);
+      int rows = end - start;
+      part_t part;
+      // TACO indexes idx and val by position, so a block only needs the pos
+      // array from its first row
+      part.A = makeCSR<double>("A", {rows, csr.cols}, (int *)csr.pos + start, (int *)csr.idx, (double *)csr.val);
+      part.x = Tensor<double>("x", {rows}, Format({Dense}));
+      part.x.getStorage().setValues(makeArray((double *)x_values + start, rows));
+      part.y = Tensor<double>("y", {csr.cols}, Format({Dense}));
+      IndexVar i("i"), j("j");
+      part.y(j) += part.A(i, j) * part.x(i);
+      part.y.compile();
+      part.y.assemble();
+      parts.push_back(part);
+      start = end;
+    }
+    y_values.assign(csr.cols, 0.0);
+    partitioned_for = blocks;
+    compile_time += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - tic).count();
+  }
+
+  void keep_upper() {
+    if (upper) return;
+    taco_csr_arrays_t csr = taco_csr_arrays(A);
+    if (csr.rows != csr.cols) {
+      throw std::runtime_error("The symmetric schedule needs a square matrix");
+    }
+    upper_pos.assign(1, 0);
+    upper_idx.clear();
+    upper_val.clear();
+    for (int i = 0; i < csr.rows; i++) {
+      for (int p = csr.pos[i]; p < csr.pos[i + 1]; p++) {
+        if (csr.idx[p] >= i) {
+          upper_idx.push_back(csr.idx[p]);
+          upper_val.push_back(csr.val[p]);
+        }
+      }
+      upper_pos.push_back(upper_idx.size());
+    }
+    A = makeCSR<double>("A", {csr.rows, csr.cols}, upper_pos.data(), upper_idx.data(), upper_val.data());
+    A_file = taco_operand_t();
+    symmetric.reset();
+    upper = true;
+  }
+
+  json run(const fs::path &output, int reps) {
+    compile();
+
+    // Assemble output indices and numerically compute the result. The private
+    // copies of y stay assembled from partition(), and their compute kernels
+    // zero them before scattering.
+    auto setup = [this]() {
+      y.setNeedsAssemble(true);
+      y.setNeedsCompute(true);
+      for (part_t &part : parts) {
+        part.y.setNeedsCompute(true);
+      }
+    };
+    auto test = [this]() {
+      if (schedule == "column-major-privatized") {
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t t = 0; t < parts.size(); t++) {
+          parts[t].y.compute();
+        }
+        std::vector<const double *> private_y(parts.size());
+        for (size_t t = 0; t < parts.size(); t++) {
+          private_y[t] = (const double *)parts[t].y.getStorage().getValues().getData();
+        }
+        int n = y_values.size();
+        #pragma omp parallel for schedule(static)
+        for (int j = 0; j < n; j++) {
+          double sum = 0.0;
+          for (const double *values : private_y) sum += values[j];
+          y_values[j] = sum;
+        }
+        return;
+      }
+      if (schedule == "symmetric") {
+        const double *x_values = (const double *)x.getStorage().getValues().getData();
+        symmetric.multiply(A.getDimension(0), upper_pos.data(), upper_idx.data(), upper_val.data(), x_values, y_values.data());
+        return;
+      }
+      y.assemble();
+      y.compute();
+    };
+    json measurements = sweep_threads(threads, [&](int count) {
+      json entry;
+      if (schedule == "column-major-privatized") {
+        partition(count);
+        entry["private_copies"] = parts.size();
+      }
+      entry.update(benchmark_samples(timing, setup, test, reps));
+      entry["time_per_vector"] = entry["time"].get<double>() / num_vectors;
+      if (counters) entry.update(measure_counters(timing, setup, test, reps));
+      return entry;
+    });
+    json structures = {{"A", taco_structure_bytes(A)}};
+    if (num_vectors > 1) {
+      structures["X"] = taco_structure_bytes(X);
+      structures["Y"] = taco_structure_bytes(y);
+    } else if (schedule == "symmetric") {
+      structures["x"] = taco_structure_bytes(x);
+      structures["y"] = structure_bytes(0, y_values.size() * sizeof(double));
+      structures["mirror"] = structure_bytes(0, symmetric.workspace_bytes());
+    } else if (schedule == "column-major-privatized") {
+      structures["x"] = taco_structure_bytes(x);
+      structures["y"] = structure_bytes(0, y_values.size() * sizeof(double));
+      structures["private_y"] = structure_bytes(0, parts.size() * y_values.size() * sizeof(double));
+    } else {
+      structures["x"] = taco_structure_bytes(x);
+      structures["y"] = taco_structure_bytes(y);
+    }
+    record_memory(measurements, measure_memory(setup, test), structures);
+    measurements["symmetric"] = schedule == "symmetric";
+    measurements["num_vectors"] = num_vectors;
+    if (schedule == "row-major-parallel") {
+      measurements["chunk"] = chunk;
+      measurements["omp_schedule"] = taco_omp_schedule(y);
+    }
+    measurements["compile_time"] = compile_time;
+    bool own_values = schedule == "symmetric" || schedule == "column-major-privatized";
+    const double *result = own_values ? y_values.data() : (const double *)y.getStorage().getValues().getData();
+    size_t n = own_values ? y_values.size() : y.getDimension(0);
+    measurements["checksum"] = output_checksum(result, n * num_vectors);
+    if (verify.enabled) {
+      measurements["verification"] = verify.spmv(input, result, n, num_vectors, schedule == "column-major", schedule == "symmetric");
+    }
+    std::ofstream measurements_file(output/"measurements.json");
+    measurements_file << measurements;
+    measurements_file.close();
+    return measurements;
+  }
+
+  void fetch(const fs::path &output) {
+    if (num_vectors > 1) {
+      // Write Y, and its first column, A * x, as y
+      write(output/"Y.ttx", y);
+      const double *Y_values = (const double *)y.getStorage().getValues().getData();
+      y_values.resize(y.getDimension(0));
+      for (size_t i = 0; i < y_values.size(); i++) y_values[i] = Y_values[i * num_vectors];
+    }
+    if (schedule == "symmetric" || schedule == "column-major-privatized" || num_vectors > 1) {
+      Tensor<double> y_symmetric("y", {(int)y_values.size()}, Format({Dense}));
+      y_symmetric.getStorage().setValues(makeArray(y_values.data(), y_values.size()));
+      write(output/"y.ttx", y_symmetric);
+      return;
+    }
+    write(output/"y.ttx", y);
+  }
+};
+
 int main(int argc, char **argv){
+  int status = taco_kernel_cache_main(argc, argv);
+  if (status >= 0) return status;
+  enable_taco_kernel_cache();
+
   auto params = parse(argc, argv);
 
-  static struct option long_options[] = {
+  spmv_taco_t spmv;
+  common_options_t options(spmv.threads, spmv.counters, spmv.timing, &spmv.verify);
+
+  std::vector<option> long_options = options.long_options({
     {"help", no_argument, 0, 'h'},
     {"schedule", required_argument, 0, 's'},
-    {0, 0, 0, 0}
-  };
-
-  std::string schedule = "row_major";
+    {"num_vectors", required_argument, 0, 'k'},
+    {"chunk", required_argument, 0, 'C'},
+  });
+  std::string short_options = options.short_options("hs:k:C:");
 
   // Parse the options
   int option_index = 0;
   int c;
   optind = 1;
-  while ((c = getopt_long(params.argc, params.argv, "hs:", long_options, &option_index)) != -1) {
+  while ((c = getopt_long(params.argc, params.argv, short_options.c_str(), long_options.data(), &option_index)) != -1) {
     switch (c) {
       case 'h':
         std::cout << "Options:" << std::endl;
         std::cout << "  -h, --help      Print this help message" << std::endl;
-        std::cout << "  -s, --schedule  Execution schedule, from [row-major, column-major]" << std::endl;
+        std::cout << "  -s, --schedule  Execution schedule, from [row-major, column-major, row-major-parallel," << std::endl;
+        std::cout << "                  column-major-privatized, symmetric]" << std::endl;
+        std::cout << "  -k, --num_vectors  Multiply by k right-hand sides at once (X.bin, or x and k - 1 generated)" << std::endl;
+        std::cout << "  -C, --chunk     Rows per dynamically scheduled task of row-major-parallel (default 64)" << std::endl;
+        options.help(18, "load/schedule/chunk/num_vectors/verify/run/fetch", "y_ref.bin, Y_ref.bin or A (A^T for column-major) times x", "y.ttx (and Y.ttx)");
         exit(0);
       case 's':
-        schedule = optarg;
+        spmv.schedule = optarg;
+        break;
+      case 'k':
+        try {
+          spmv.set_num_vectors(std::stoi(optarg));
+        } catch (const std::exception &e) {
+          std::cerr << "Invalid num_vectors" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'C':
+        try {
+          spmv.set_chunk(std::stoi(optarg));
+        } catch (const std::exception &e) {
+          std::cerr << "Invalid chunk" << std::endl;
+          exit(1);
+        }
         break;
       case '?':
         // getopt_long already printed an error message
         break;
       default:
-        abort();
+        if (!options.parse(c, optarg)) abort();
     }
   }
 
+  std::map<std::string, server_command_t> commands = {
+    {"load", [&](const server_args_t &args) { spmv.load(server_arg(args, 0, "input dir")); return json(); }},
+    {"schedule", [&](const server_args_t &args) { spmv.set_schedule(server_arg(args, 0, "name")); return json(); }},
+    {"num_vectors", [&](const server_args_t &args) { spmv.set_num_vectors(std::stoi(server_arg(args, 0, "k"))); return json(); }},
+    {"chunk", [&](const server_args_t &args) { spmv.set_chunk(std::stoi(server_arg(args, 0, "rows"))); return json(); }},
+    {"run", [&](const server_args_t &args) { return spmv.run(server_arg(args, 0, "output dir"), server_reps(args, 1)); }},
+    {"fetch", [&](const server_args_t &args) { spmv.fetch(server_arg(args, 0, "output dir")); return json(); }},
+  };
+  options.add_commands(commands);
+  if (options.server) return serve(commands);
+  if (!options.manifest.empty()) return run_manifest(options.manifest, commands, options.write_output);
+
   // Check that all required options are present
   if (params.input.empty() || params.output.empty()) {
     std::cerr << "Missing required option" << std::endl;
     exit(1);
   }
 
-  Tensor<double> A = read(fs::path(params.input)/"A.ttx", Format({Dense, Sparse}), true);
-  Tensor<double> x = read(fs::path(params.input)/"x.ttx", Format({Dense}), true);
-  int m = A.getDimension(0);
-  int n = A.getDimension(1);
-  Tensor<double> y;
-  if (schedule == "row-major")
-    y = Tensor<double>("y", {m}, Format({Dense}));
-  else if (schedule == "column-major")
-    y = Tensor<double>("y", {n}, Format({Dense}));
-  else {
-    std::cerr << "Invalid schedule" << std::endl;
-    exit(1);
-  }
-
-  IndexVar i, j;
-
-  if (schedule == "row-major")
-    y(i) += A(i, j) * x(j);
-  else if (schedule == "column-major")
-    y(j) += A(i, j) * x(i);
-  else {
-    std::cerr << "Invalid schedule" << std::endl;
+  try {
+    spmv.set_schedule(spmv.schedule);
+  } catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
     exit(1);
   }
 
-  //perform an spmv of the matrix in c++
-
-  y.compile();
-
-  // Assemble output indices and numerically compute the result
-  auto time = benchmark(
-    [&y]() {
-      y.setNeedsAssemble(true);
-      y.setNeedsCompute(true);
-    },
-    [&y]() {
-      y.assemble();
-      y.compute();
-    }
-  );
-
-  write(fs::path(params.input)/"y.ttx", y);
-
-  json measurements;
-  measurements["time"] = time;
-  measurements["memory"] = 0;
-  std::ofstream measurements_file(fs::path(params.output)/"measurements.json");
-  measurements_file << measurements;
-  measurements_file.close();
+  spmv.load(params.input);
+  spmv.run(params.output, 0);
+  if (options.write_output) spmv.fetch(params.output);
   return 0;
 }
@@ -1,24 +1,34 @@
 using Finch
 using TensorMarket
 using JSON
-function spmv_taco_helper(args, A, x)
+function spmv_taco_helper(schedule, A, x)
     tmpdir = mktempdir(@__DIR__, prefix="experiment_")
-    A_path = joinpath(tmpdir, "A.ttx")
-    x_path = joinpath(tmpdir, "x.ttx")
+    A_path = joinpath(tmpdir, "A.bin")
+    x_path = joinpath(tmpdir, "x.bin")
     y_path = joinpath(tmpdir, "y.ttx")
-    fwrite(A_path, Tensor(Dense(SparseList(Element(0.0))), A))
-    fwrite(x_path, Tensor(Dense(Element(0.0)), x))
+    write_binary_matrix(A_path, schedule == "symmetric" ? triu(A) : A, layout=:csr, index_type=Int32)
+    write_binary_vector(x_path, x)
     taco_path = joinpath(@__DIR__, "../deps/taco/build/lib")
-    withenv("DYLD_FALLBACK_LIBRARY_PATH"=>"$taco_path", "LD_LIBRARY_PATH" => "$taco_path", "TACO_CFLAGS" => "-O3 -ffast-math -std=c99 -march=native -ggdb") do
-        spmv_path = joinpath(@__DIR__, "spmv_taco")
-        run(`$spmv_path -i $tmpdir -o $tmpdir -- $args`)
+    spmv_path = joinpath(@__DIR__, "spmv_taco")
+    server = driver_server(addenv(`$spmv_path -- --server`, "DYLD_FALLBACK_LIBRARY_PATH"=>"$taco_path", "LD_LIBRARY_PATH" => "$taco_path", "TACO_CFLAGS" => "-O3 -ffast-math -std=c99 -march=native -fopenmp -ggdb"))
+    driver_request(server, "load", tmpdir)
+    driver_request(server, "schedule", schedule)
+    driver_request(server, "chunk", taco_chunk[])
+    # The symmetric and privatized schedules multiply one vector at a time
+    driver_request(server, "num_vectors", schedule in ("symmetric", "column-major-privatized") ? 1 : spmv_num_vectors[])
+    measurements = driver_request(server, "run", tmpdir)
+    y = nothing
+    if !driver_verify[]
+        driver_request(server, "fetch", tmpdir)
+        y = fread(y_path)
     end
-    y = fread(y_path)
-    time = JSON.parsefile(joinpath(tmpdir, "measurements.json"))["time"]
-    return (;time=time*10^-9, y=y)
+    return (;time=measurements["time"]*10^-9, y=y, compile_time=measurements["compile_time"]*10^-9, num_vectors=measurements["num_vectors"], time_per_vector=measurements["time_per_vector"]*10^-9, scaling=measurements["scaling"], memory=measurements["memory"], timing=measurements["timing"], counters=counter_measurements(measurements), verify_measurements(measurements)...)
 end
 
-spmv_taco_row_maj(y, A, x) = spmv_taco_helper(`--schedule row-major`, A, x)
-spmv_taco_col_maj(y, A, x) = spmv_taco_helper(`--schedule column-major`, permutedims(A), x)
+spmv_taco_row_maj(y, A, x) = spmv_taco_helper("row-major", A, x)
+spmv_taco_col_maj(y, A, x) = spmv_taco_helper("column-major", permutedims(A), x)
+spmv_taco_row_maj_parallel(y, A, x) = spmv_taco_helper("row-major-parallel", A, x)
+spmv_taco_col_maj_privatized(y, A, x) = spmv_taco_helper("column-major-privatized", permutedims(A), x)
+spmv_taco_symmetric(y, A, x) = spmv_taco_helper("symmetric", A, x)
 
 has_taco() = isfile(joinpath(@__DIR__, "spmv_taco"))
\ No newline at end of file